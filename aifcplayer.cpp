@@ -77,6 +77,9 @@ bool AifcPlayer::play(int mixRate, const char *path, uint32_t startOffset) {
 	}
 	_pos = 0;
 	_sampleL = _sampleR = 0;
+	_prev[0] = _prev[1] = 0;
+	_channel = 0;
+	_samplesPos = _samplesCount = 0;
 	return _ssndSize != 0;
 }
 
@@ -89,20 +92,39 @@ static int16_t decodeSDX2(int16_t prev, int8_t data) {
 	return (data & 1) != 0 ? prev + sqr : sqr;
 }
 
-int8_t AifcPlayer::readSampleData() {
+void AifcPlayer::decodeBlock() {
 	if (_pos >= _ssndSize) {
 		_pos = 0;
 		_f.seek(_ssndOffset);
 	}
-	const int8_t data = _f.readByte();
-	++_pos;
-	return data;
+	// the sound data is read and decoded by blocks, the channels are interleaved
+	int8_t data[kBlockSize];
+	const int count = MIN<uint32_t>(kBlockSize, _ssndSize - _pos);
+	const int len = _f.read(data, count);
+	if (len < count) {
+		// past the end of the file, decoded as zeroes like the missing bytes were
+		memset(data + len, 0, count - len);
+	}
+	_pos += count;
+	int16_t prev[2] = { _prev[0], _prev[1] };
+	int channel = _channel;
+	for (int i = 0; i < count; ++i) {
+		prev[channel] = decodeSDX2(prev[channel], data[i]);
+		_samples[i] = prev[channel];
+		channel ^= 1;
+	}
+	_prev[0] = prev[0];
+	_prev[1] = prev[1];
+	_channel = channel;
+	_samplesCount = count;
+	_samplesPos = 0;
 }
 
 void AifcPlayer::decodeSamples() {
+	// the frames are decoded ahead, the resampling only steps through them
 	for (uint32_t pos = _rate.getInt(); pos == _rate.getInt(); _rate.offset += _rate.inc) {
-		_sampleL = decodeSDX2(_sampleL, readSampleData());
-		_sampleR = decodeSDX2(_sampleR, readSampleData());
+		_sampleL = readSample();
+		_sampleR = readSample();
 	}
 }
 
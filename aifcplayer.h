@@ -6,6 +6,9 @@
 #include "file.h"
 
 struct AifcPlayer {
+	enum {
+		kBlockSize = 4096
+	};
 
 	File _f;
 	uint32_t _ssndOffset;
@@ -13,13 +16,23 @@ struct AifcPlayer {
 	uint32_t _pos;
 	int16_t _sampleL, _sampleR;
 	Frac _rate;
+	int16_t _prev[2]; // SDX2 predictors
+	int _channel;
+	int16_t _samples[kBlockSize]; // decoded, interleaved
+	int _samplesPos, _samplesCount;
 
 	AifcPlayer();
 
 	bool play(int mixRate, const char *path, uint32_t offset);
 	void stop();
 
-	int8_t readSampleData();
+	void decodeBlock();
+	int16_t readSample() {
+		if (_samplesPos >= _samplesCount) {
+			decodeBlock();
+		}
+		return _samples[_samplesPos++];
+	}
 	void decodeSamples();
 	void readSamples(int16_t *buf, int len);
 };
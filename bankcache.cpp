@@ -0,0 +1,142 @@
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <unistd.h>
+#include <algorithm>
+#include <atomic>
+#include <string>
+#include <vector>
+#include "bankcache.h"
+#include "file.h"
+#include "util.h"
+
+static const char *kSuffix = ".unp";
+
+BankCache::BankCache(const char *dir, uint32_t maxSize)
+	: _dir(strdup(dir)), _maxSize(maxSize), _totalSize(0) {
+	struct stat st;
+	if (stat(_dir, &st) != 0 && mkdir(_dir, 0755) != 0) {
+		warning("Unable to create cache directory '%s'", _dir);
+	}
+	evict();
+}
+
+BankCache::~BankCache() {
+	free(_dir);
+}
+
+bool BankCache::getPath(char *path, int pathSize, int bank, uint32_t offset, uint32_t packedSize, uint32_t crc) const {
+	const int len = snprintf(path, pathSize, "%s/%02x_%08x_%08x_%08x%s", _dir, bank, offset, packedSize, crc, kSuffix);
+	// a truncated name could match the file of another resource
+	return len > 0 && len < pathSize;
+}
+
+bool BankCache::read(int bank, uint32_t offset, uint32_t packedSize, uint32_t crc, uint8_t *dst, uint32_t size) {
+	char path[MAXPATHLEN];
+	if (!getPath(path, sizeof(path), bank, offset, packedSize, crc)) {
+		return false;
+	}
+	const int fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		return false;
+	}
+	bool ret = false;
+	struct stat st;
+	if (fstat(fd, &st) == 0 && st.st_size == (off_t)size) {
+		void *p = mmap(0, size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (p != MAP_FAILED) {
+			memcpy(dst, p, size);
+			munmap(p, size);
+			ret = true;
+		}
+	}
+	close(fd);
+	if (ret) {
+		// refresh the timestamp used for the eviction order
+		utimes(path, 0);
+		debug(DBG_BANK, "BankCache::read() hit bank %d offset 0x%X size %d", bank, offset, size);
+	}
+	return ret;
+}
+
+void BankCache::write(int bank, uint32_t offset, uint32_t packedSize, uint32_t crc, const uint8_t *data, uint32_t size) {
+	char path[MAXPATHLEN];
+	if (!getPath(path, sizeof(path), bank, offset, packedSize, crc)) {
+		return;
+	}
+	// unique per process and per writer, the parts are also prefetched on a thread
+	static std::atomic<uint32_t> counter;
+	char tmpPath[MAXPATHLEN + 32];
+	const int len = snprintf(tmpPath, sizeof(tmpPath), "%s.%d.%u", path, (int)getpid(), (unsigned int)counter++);
+	if (len <= 0 || len >= (int)sizeof(tmpPath)) {
+		return;
+	}
+	File f;
+	if (!f.openForWriting(tmpPath)) {
+		warning("Unable to write cache file '%s'", tmpPath);
+		return;
+	}
+	f.write(data, size);
+	const bool err = f.ioErr();
+	f.close();
+	// renaming is atomic, concurrent runs never see partial files
+	if (err || rename(tmpPath, path) != 0) {
+		unlink(tmpPath);
+		return;
+	}
+	// the directory is only scanned again when the running total exceeds the limit
+	if (_totalSize.fetch_add(size) + size > _maxSize) {
+		evict();
+	}
+}
+
+struct CacheFile {
+	std::string path;
+	time_t mtime;
+	uint32_t size;
+
+	bool operator<(const CacheFile &f) const {
+		return mtime < f.mtime;
+	}
+};
+
+void BankCache::evict() {
+	std::lock_guard<std::mutex> lock(_evictMutex);
+	DIR *d = opendir(_dir);
+	if (!d) {
+		return;
+	}
+	std::vector<CacheFile> files;
+	uint64_t totalSize = 0;
+	const int suffixLen = strlen(kSuffix);
+	struct dirent *de;
+	while ((de = readdir(d)) != 0) {
+		const int len = strlen(de->d_name);
+		if (len <= suffixLen || strcmp(de->d_name + len - suffixLen, kSuffix) != 0) {
+			continue;
+		}
+		CacheFile cf;
+		cf.path = std::string(_dir) + "/" + de->d_name;
+		struct stat st;
+		if (stat(cf.path.c_str(), &st) == 0) {
+			cf.mtime = st.st_mtime;
+			cf.size = st.st_size;
+			totalSize += cf.size;
+			files.push_back(cf);
+		}
+	}
+	closedir(d);
+	if (totalSize > _maxSize) {
+		std::sort(files.begin(), files.end());
+		for (size_t i = 0; i < files.size() && totalSize > _maxSize; ++i) {
+			debug(DBG_BANK, "BankCache::evict() '%s'", files[i].path.c_str());
+			if (unlink(files[i].path.c_str()) == 0) {
+				totalSize -= files[i].size;
+			}
+		}
+	}
+	_totalSize = totalSize;
+}
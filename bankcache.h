@@ -0,0 +1,27 @@
+
+#ifndef BANKCACHE_H__
+#define BANKCACHE_H__
+
+#include <atomic>
+#include <mutex>
+#include "intern.h"
+
+// Directory of unpacked bank resources, one file per (bank, offset, packed size, crc).
+// The least recently used files are removed when the total size exceeds the limit.
+struct BankCache {
+
+	char *_dir;
+	uint32_t _maxSize;
+	std::atomic<uint64_t> _totalSize; // scanned at startup and when exceeding the limit
+	std::mutex _evictMutex;
+
+	BankCache(const char *dir, uint32_t maxSize);
+	~BankCache();
+
+	bool getPath(char *path, int pathSize, int bank, uint32_t offset, uint32_t packedSize, uint32_t crc) const;
+	bool read(int bank, uint32_t offset, uint32_t packedSize, uint32_t crc, uint8_t *dst, uint32_t size);
+	void write(int bank, uint32_t offset, uint32_t packedSize, uint32_t crc, const uint8_t *data, uint32_t size);
+	void evict();
+};
+
+#endif
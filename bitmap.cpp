@@ -1,7 +1,30 @@
-
 #include "bitmap.h"
 #include "util.h"
 
+static void clutRow(const uint8_t *src, const uint8_t *pal, int w, int bpp, int colorKey, uint8_t *dst) {
+	for (int x = 0; x < w; ++x) {
+		const int color = src[x];
+		const int b = pal[color * 4];
+		const int g = pal[color * 4 + 1];
+		const int r = pal[color * 4 + 2];
+		dst[x * bpp]     = r;
+		dst[x * bpp + 1] = g;
+		dst[x * bpp + 2] = b;
+		if (bpp == 4) {
+			dst[x * bpp + 3] = (color == 0 || (colorKey == ((r << 16) | (g << 8) | b))) ? 0 : 255;
+		}
+	}
+}
+
+static void rgbRow(const uint8_t *src, int w, uint8_t *dst) {
+	for (int x = 0; x < w; ++x) {
+		const uint32_t color = READ_LE_UINT32(src); src += 4;
+		*dst++ = (color >> 16) & 255;
+		*dst++ = (color >>  8) & 255;
+		*dst++ =  color        & 255;
+	}
+}
+
 static void clut(const uint8_t *src, const uint8_t *pal, int pitch, int w, int h, int bpp, bool flipY, int colorKey, uint8_t *dst) {
 	int dstPitch = bpp * w;
 	if (flipY) {
@@ -9,60 +32,131 @@ static void clut(const uint8_t *src, const uint8_t *pal, int pitch, int w, int h
 		dstPitch = -bpp * w;
 	}
 	for (int y = 0; y < h; ++y) {
-		for (int x = 0; x < w; ++x) {
-			const int color = src[x];
-			const int b = pal[color * 4];
-			const int g = pal[color * 4 + 1];
-			const int r = pal[color * 4 + 2];
-			dst[x * bpp]     = r;
-			dst[x * bpp + 1] = g;
-			dst[x * bpp + 2] = b;
-			if (bpp == 4) {
-				dst[x * bpp + 3] = (color == 0 || (colorKey == ((r << 16) | (g << 8) | b))) ? 0 : 255;
-			}
-		}
+		clutRow(src, pal, w, bpp, colorKey, dst);
 		src += w;
 		dst += dstPitch;
 	}
 }
 
-uint8_t *decode_bitmap(const uint8_t *src, bool alpha, int colorKey, int *w, int *h) {
+struct BitmapHeader {
+	uint32_t imageOffset;
+	int width, height;
+	int depth;
+	int compression;
+};
+
+static bool readBitmapHeader(const uint8_t *src, BitmapHeader *hdr) {
 	if (memcmp(src, "BM", 2) != 0) {
-		return 0;
+		return false;
+	}
+	hdr->imageOffset = READ_LE_UINT32(src + 0xA);
+	hdr->width = READ_LE_UINT32(src + 0x12);
+	hdr->height = READ_LE_UINT32(src + 0x16);
+	hdr->depth = READ_LE_UINT16(src + 0x1C);
+	hdr->compression = READ_LE_UINT32(src + 0x1E);
+	if ((hdr->depth != 8 && hdr->depth != 32) || hdr->compression != 0) {
+		warning("Unhandled bitmap depth %d compression %d", hdr->depth, hdr->compression);
+		return false;
 	}
-	const uint32_t imageOffset = READ_LE_UINT32(src + 0xA);
-	const int width = READ_LE_UINT32(src + 0x12);
-	const int height = READ_LE_UINT32(src + 0x16);
-	const int depth = READ_LE_UINT16(src + 0x1C);
-	const int compression = READ_LE_UINT32(src + 0x1E);
-	if ((depth != 8 && depth != 32) || compression != 0) {
-		warning("Unhandled bitmap depth %d compression %d", depth, compression);
+	return true;
+}
+
+uint8_t *decode_bitmap(const uint8_t *src, bool alpha, int colorKey, int *w, int *h) {
+	BitmapHeader hdr;
+	if (!readBitmapHeader(src, &hdr)) {
 		return 0;
 	}
+	const int width = hdr.width;
+	const int height = hdr.height;
 	const int bpp = (!alpha && colorKey < 0) ? 3 : 4;
 	uint8_t *dst = (uint8_t *)malloc(width * height * bpp);
 	if (!dst) {
 		warning("Failed to allocate bitmap buffer, width %d height %d bpp %d", width, height, bpp);
 		return 0;
 	}
-	if (depth == 8) {
+	if (hdr.depth == 8) {
 		const uint8_t *palette = src + 14 /* BITMAPFILEHEADER */ + 40 /* BITMAPINFOHEADER */;
 		const bool flipY = true;
-		clut(src + imageOffset, palette, (width + 3) & ~3, width, height, bpp, flipY, colorKey, dst);
+		clut(src + hdr.imageOffset, palette, (width + 3) & ~3, width, height, bpp, flipY, colorKey, dst);
 	} else {
-		assert(depth == 32 && bpp == 3);
-		const uint8_t *p = src + imageOffset;
+		assert(hdr.depth == 32 && bpp == 3);
+		const uint8_t *p = src + hdr.imageOffset;
 		for (int y = height - 1; y >= 0; --y) {
-			uint8_t *q = dst + y * width * bpp;
-			for (int x = 0; x < width; ++x) {
-				const uint32_t color = READ_LE_UINT32(p); p += 4;
-				*q++ = (color >> 16) & 255;
-				*q++ = (color >>  8) & 255;
-				*q++ =  color        & 255;
-			}
+			rgbRow(p, width, dst + y * width * bpp);
+			p += width * 4;
 		}
 	}
 	*w = width;
 	*h = height;
 	return dst;
 }
+
+uint8_t *decode_bitmap_stream(BitmapReadProc readProc, void *userdata, bool alpha, int colorKey, int *w, int *h, uint8_t **buf, uint32_t *bufSize) {
+	static const int kHeaderSize = 14 /* BITMAPFILEHEADER */ + 40 /* BITMAPINFOHEADER */;
+	uint8_t header[kHeaderSize];
+	BitmapHeader hdr;
+	if (readProc(userdata, header, kHeaderSize) != kHeaderSize || !readBitmapHeader(header, &hdr) || hdr.imageOffset < kHeaderSize) {
+		return 0;
+	}
+	const int width = hdr.width;
+	const int height = hdr.height;
+	const int bpp = (!alpha && colorKey < 0) ? 3 : 4;
+	if (hdr.depth == 32 && bpp != 3) {
+		return 0;
+	}
+	// the palette and the rows are consumed as they are inflated
+	uint8_t palette[256 * 4];
+	memset(palette, 0, sizeof(palette));
+	uint32_t offset = kHeaderSize;
+	if (hdr.depth == 8) {
+		const uint32_t count = MIN<uint32_t>(sizeof(palette), hdr.imageOffset - offset);
+		if (readProc(userdata, palette, count) != count) {
+			return 0;
+		}
+		offset += count;
+	}
+	while (offset < hdr.imageOffset) {
+		uint8_t tmp[256];
+		const uint32_t count = MIN<uint32_t>(sizeof(tmp), hdr.imageOffset - offset);
+		if (readProc(userdata, tmp, count) != count) {
+			return 0;
+		}
+		offset += count;
+	}
+	const uint32_t size = width * height * bpp;
+	if (*bufSize < size) {
+		free(*buf);
+		*buf = (uint8_t *)malloc(size);
+		if (!*buf) {
+			*bufSize = 0;
+			warning("Failed to allocate bitmap buffer, width %d height %d bpp %d", width, height, bpp);
+			return 0;
+		}
+		*bufSize = size;
+	}
+	const uint32_t pitch = (hdr.depth == 8) ? ((width + 3) & ~3) : width * 4;
+	uint8_t *row = (uint8_t *)malloc(pitch);
+	if (!row) {
+		return 0;
+	}
+	uint8_t *dst = *buf;
+	bool ret = true;
+	for (int y = height - 1; y >= 0; --y) {
+		if (readProc(userdata, row, pitch) != pitch) {
+			ret = false;
+			break;
+		}
+		if (hdr.depth == 8) {
+			clutRow(row, palette, width, bpp, colorKey, dst + y * width * bpp);
+		} else {
+			rgbRow(row, width, dst + y * width * bpp);
+		}
+	}
+	free(row);
+	if (!ret) {
+		return 0;
+	}
+	*w = width;
+	*h = height;
+	return dst;
+}
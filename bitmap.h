@@ -6,4 +6,10 @@
 
 uint8_t *decode_bitmap(const uint8_t *src, bool alpha, int colorKey, int *w, int *h);
 
+// returns the number of bytes read
+typedef uint32_t (*BitmapReadProc)(void *userdata, uint8_t *dst, uint32_t len);
+
+// decodes the rows as they are read, the buffer is reallocated if too small and can be reused
+uint8_t *decode_bitmap_stream(BitmapReadProc readProc, void *userdata, bool alpha, int colorKey, int *w, int *h, uint8_t **buf, uint32_t *bufSize);
+
 #endif
@@ -0,0 +1,157 @@
+
+#include <algorithm>
+#include "bitmapcache.h"
+#include "resource_nth.h"
+#include "util.h"
+
+BitmapCache::BitmapCache(ResourceNth *nth)
+	: _nth(nth), _quit(false), _useCounter(0), _lastNum(-1) {
+	for (int i = 0; i < kThreadsCount; ++i) {
+		_threads[i] = std::thread(&BitmapCache::run, this);
+	}
+}
+
+BitmapCache::~BitmapCache() {
+	{
+		std::lock_guard<std::mutex> lock(_mutex);
+		_quit = true;
+	}
+	_cond.notify_all();
+	for (int i = 0; i < kThreadsCount; ++i) {
+		_threads[i].join();
+	}
+	for (std::map<int, Entry>::iterator it = _entries.begin(); it != _entries.end(); ++it) {
+		free(it->second.buf);
+	}
+}
+
+void BitmapCache::setReferences(const uint8_t *code, uint32_t size) {
+	// updateResources(num) operands, the scan can match bytes of other instructions
+	// but these are filtered by the range and a missing file is not an error
+	_refs.clear();
+	for (uint32_t i = 0; i + 2 < size; ++i) {
+		if (code[i] == 0x19) {
+			const int num = READ_BE_UINT16(code + i + 1);
+			if (num >= 3000 && num < 4000 && std::find(_refs.begin(), _refs.end(), num) == _refs.end()) {
+				_refs.push_back(num);
+			}
+		}
+	}
+	debug(DBG_RESOURCE, "BitmapCache::setReferences() %d backgrounds", (int)_refs.size());
+	for (int i = 0; i < (int)_refs.size() && i < kLookAhead; ++i) {
+		request(_refs[i]);
+	}
+}
+
+void BitmapCache::request(int num) {
+	std::lock_guard<std::mutex> lock(_mutex);
+	if (_entries.find(num) != _entries.end()) {
+		return;
+	}
+	evict();
+	Entry &e = _entries[num];
+	e.state = kStatePending;
+	e.w = e.h = 0;
+	e.buf = 0;
+	e.bufSize = 0;
+	e.lastUse = ++_useCounter;
+	_queue.push_back(num);
+	_cond.notify_one();
+}
+
+const uint8_t *BitmapCache::get(int num, int *w, int *h) {
+	std::unique_lock<std::mutex> lock(_mutex);
+	std::map<int, Entry>::iterator it = _entries.find(num);
+	if (it == _entries.end() || it->second.state == kStatePending) {
+		// not started yet, decoded on this thread
+		_queue.remove(num);
+		_lastNum = num;
+		evict();
+		Entry &e = _entries[num];
+		e.state = kStateDecoding;
+		if (it == _entries.end()) {
+			e.buf = 0;
+			e.bufSize = 0;
+		}
+		lock.unlock();
+		decode(num, &e);
+		lock.lock();
+		it = _entries.find(num);
+	} else if (it->second.state == kStateDecoding) {
+		debug(DBG_RESOURCE, "BitmapCache::get() waiting for %d", num);
+		while (it->second.state == kStateDecoding) {
+			_cond.wait(lock);
+		}
+	}
+	Entry &e = it->second;
+	e.lastUse = ++_useCounter;
+	_lastNum = num;
+	lock.unlock();
+
+	// queue the next backgrounds of the part
+	std::vector<int>::const_iterator ref = std::find(_refs.begin(), _refs.end(), num);
+	if (ref != _refs.end()) {
+		for (int i = 0; i < kLookAhead && ++ref != _refs.end(); ++i) {
+			request(*ref);
+		}
+	}
+	if (e.state != kStateReady) {
+		return 0;
+	}
+	*w = e.w;
+	*h = e.h;
+	return e.buf;
+}
+
+void BitmapCache::evict() {
+	// only called from the game thread, the last picture returned is kept
+	while (_entries.size() >= kMaxEntries) {
+		std::map<int, Entry>::iterator lru = _entries.end();
+		for (std::map<int, Entry>::iterator it = _entries.begin(); it != _entries.end(); ++it) {
+			if (it->first == _lastNum || it->second.state == kStateDecoding) {
+				continue;
+			}
+			if (lru == _entries.end() || it->second.lastUse < lru->second.lastUse) {
+				lru = it;
+			}
+		}
+		if (lru == _entries.end()) {
+			break;
+		}
+		debug(DBG_RESOURCE, "BitmapCache::evict() %d", lru->first);
+		_queue.remove(lru->first);
+		free(lru->second.buf);
+		_entries.erase(lru);
+	}
+}
+
+void BitmapCache::decode(int num, Entry *e) {
+	int w = 0, h = 0;
+	const bool ret = _nth->decodeBmp(num, &w, &h, &e->buf, &e->bufSize) != 0;
+	std::lock_guard<std::mutex> lock(_mutex);
+	e->w = w;
+	e->h = h;
+	e->state = ret ? kStateReady : kStateFailed;
+	_cond.notify_all();
+}
+
+void BitmapCache::run() {
+	std::unique_lock<std::mutex> lock(_mutex);
+	while (1) {
+		while (!_quit && _queue.empty()) {
+			_cond.wait(lock);
+		}
+		if (_quit) {
+			break;
+		}
+		const int num = _queue.front();
+		_queue.pop_front();
+		// entries being decoded are not evicted, the pointer stays valid
+		Entry *e = &_entries[num];
+		e->state = kStateDecoding;
+		lock.unlock();
+		debug(DBG_RESOURCE, "BitmapCache::run() decoding %d", num);
+		decode(num, e);
+		lock.lock();
+	}
+}
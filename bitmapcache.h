@@ -0,0 +1,61 @@
+
+#ifndef BITMAPCACHE_H__
+#define BITMAPCACHE_H__
+
+#include "intern.h"
+#include <condition_variable>
+#include <list>
+#include <map>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+struct ResourceNth;
+
+// Decoded backgrounds of the 15th and 20th editions. The pictures referenced
+// by the bytecode of the current part are decoded ahead on worker threads.
+struct BitmapCache {
+	enum {
+		kThreadsCount = 2,
+		kMaxEntries = 8,
+		kLookAhead = 2
+	};
+
+	enum {
+		kStatePending,
+		kStateDecoding,
+		kStateReady,
+		kStateFailed
+	};
+
+	struct Entry {
+		int state;
+		int w, h;
+		uint8_t *buf;
+		uint32_t bufSize;
+		uint32_t lastUse;
+	};
+
+	ResourceNth *_nth;
+	std::thread _threads[kThreadsCount];
+	std::mutex _mutex;
+	std::condition_variable _cond;
+	bool _quit;
+	std::list<int> _queue;
+	std::map<int, Entry> _entries;
+	uint32_t _useCounter;
+	int _lastNum; // picture returned by the last get() call
+	std::vector<int> _refs; // in the bytecode order
+
+	BitmapCache(ResourceNth *nth);
+	~BitmapCache();
+
+	void setReferences(const uint8_t *code, uint32_t size);
+	void request(int num);
+	const uint8_t *get(int num, int *w, int *h);
+	void evict();
+	void decode(int num, Entry *e);
+	void run();
+};
+
+#endif
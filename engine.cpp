@@ -7,19 +7,30 @@
 #include "engine.h"
 #include "file.h"
 #include "graphics.h"
+#include "profiler.h"
 #include "resource_nth.h"
 #include "resource_win31.h"
+#include "rewind.h"
+#include "serializer.h"
 #include "systemstub.h"
 #include "util.h"
 
 
 Engine::Engine(const char *dataDir, int partNum)
 	: _graphics(0), _stub(0), _script(&_mix, &_res, &_ply, &_vid), _mix(&_ply), _res(&_vid, dataDir),
-	_ply(), _vid(&_res), _partNum(partNum) {
+	_ply(), _vid(&_res), _partNum(partNum), _rewind(0), _stateBuf(0), _stateBufSize(0), _rewinding(false), _journal(0), _journalPath(0), _stateHash(0), _profiler(0) {
 	_res.detectVersion();
 	_ply.init(&_res);
 }
 
+Engine::~Engine() {
+	delete _profiler;
+	delete _stateHash;
+	delete _journal;
+	delete _rewind;
+	free(_stateBuf);
+}
+
 static const int _restartPos[36 * 2] = {
 	16008,  0, 16001,  0, 16002, 10, 16002, 12, 16002, 14,
 	16003, 20, 16003, 24, 16003, 26, 16004, 30, 16004, 31,
@@ -55,10 +66,24 @@ void Engine::run() {
 		doWin31Logos();
 		break;
 	case kStateGame:
+		if (_rewind) {
+			if (_stub->_pi.rewind) {
+				rewindFrame();
+				break;
+			}
+			_rewinding = false;
+			pushRewindState();
+		}
 		_script.setupTasks();
 		_script.updateInput();
 		processInput();
+		if (_stateHash) {
+			_stateHash->beginFrame();
+		}
 		_script.runTasks();
+		if (_stateHash) {
+			updateStateHash();
+		}
 		_mix.update();
 		if (_res.getDataType() == Resource::DT_3DO) {
 			switch (_res._nextPart) {
@@ -139,7 +164,7 @@ void Engine::setup(Language lang, int graphicsType, const char *scalerName, int
 		_vid._stringsTable = Video::_stringsTableMac;
 		break;
 	}
-	_mix.init(mixerType);
+	_mix.init(mixerType, _stub);
 #ifndef BYPASS_PROTECTION
 	switch (_res.getDataType()) {
 	case Resource::DT_DOS:
@@ -157,25 +182,40 @@ void Engine::setup(Language lang, int graphicsType, const char *scalerName, int
 		break;
 	}
 #endif
-	if (_res.getDataType() == Resource::DT_3DO && _partNum == kPartIntro) {
+	// logos and title screens are skipped when recording or replaying inputs
+	if (_res.getDataType() == Resource::DT_3DO && _partNum == kPartIntro && !_journal) {
 		_state = kStateLogo3DO;
-	} else if (_res.getDataType() == Resource::DT_WIN31 && _partNum == kPartIntro) {
+	} else if (_res.getDataType() == Resource::DT_WIN31 && _partNum == kPartIntro && !_journal) {
 		_state = kStateLogoWin31;
 	} else {
 		_state = kStateGame;
 		const int num = _partNum;
+		int part = num;
+		int pos = -1;
 		if (num < 36) {
-			_script.restartAt(_restartPos[num * 2], _restartPos[num * 2 + 1]);
-		} else {
-			_script.restartAt(num);
+			part = _restartPos[num * 2];
+			pos = _restartPos[num * 2 + 1];
+		}
+		if (_journal) {
+			startJournal(lang, part, pos);
 		}
+		_script.restartAt(part, pos);
 	}
 }
 
 void Engine::finish() {
+	if (_journal) {
+		_journal->close();
+	}
+	if (_stateHash) {
+		_stateHash->close();
+	}
+	if (_profiler) {
+		_profiler->dump();
+	}
 	_graphics->fini();
-	_ply.stop();
 	_mix.quit();
+	_ply.stop();
 	_res.freeMemBlock();
 }
 
@@ -277,3 +317,132 @@ void Engine::saveGameState(uint8_t slot, const char *desc) {
 
 void Engine::loadGameState(uint8_t slot) {
 }
+
+void Engine::setJournal(const char *path, bool record) {
+	delete _journal;
+	_journal = new Journal;
+	_journalPath = path;
+	if (record) {
+		return;
+	}
+	if (!_journal->openForReplay(path, &_journalHdr)) {
+		error("Unable to replay inputs from '%s'", path);
+	}
+	if (_journalHdr.dataType != _res.getDataType()) {
+		warning("Input journal recorded with data type %d, using %d", _journalHdr.dataType, _res.getDataType());
+	}
+	// these are used when loading the game data, set them before Engine::setup()
+	Script::_difficulty = (Difficulty)_journalHdr.difficulty;
+	Script::_useRemasteredAudio = (_journalHdr.remasteredAudio != 0);
+}
+
+void Engine::startJournal(Language lang, int &part, int &pos) {
+	if (_journal->_replaying) {
+		if (_journalHdr.lang != lang) {
+			warning("Input journal recorded with language %d", _journalHdr.lang);
+		}
+		part = _journalHdr.part;
+		pos = _journalHdr.pos;
+		_script._scriptVars[Script::VAR_RANDOM_SEED] = _journalHdr.seed;
+		debug(DBG_INFO, "Replaying inputs from part %d pos %d seed 0x%04X", part, pos, _journalHdr.seed);
+		openStateHash(_journalPath, false);
+	} else {
+		_journalHdr.dataType = _res.getDataType();
+		_journalHdr.lang = lang;
+		_journalHdr.difficulty = Script::_difficulty;
+		_journalHdr.remasteredAudio = Script::_useRemasteredAudio ? 1 : 0;
+		_journalHdr.part = part;
+		_journalHdr.pos = pos;
+		_journalHdr.seed = _script._scriptVars[Script::VAR_RANDOM_SEED];
+		if (!_journal->openForRecording(_journalPath, &_journalHdr)) {
+			delete _journal;
+			_journal = 0;
+			return;
+		}
+		debug(DBG_INFO, "Recording inputs to '%s'", _journalPath);
+		openStateHash(_journalPath, true);
+	}
+	_ply.setSyncLatched(true);
+	_script._journal = _journal;
+}
+
+void Engine::openStateHash(const char *journalPath, bool record) {
+	char path[MAXPATHLEN];
+	snprintf(path, sizeof(path), "%s.hash", journalPath);
+	_stateHash = new StateHash;
+	const bool ret = record ? _stateHash->openForRecording(path) : _stateHash->openForVerifying(path);
+	if (!ret) {
+		delete _stateHash;
+		_stateHash = 0;
+		return;
+	}
+	debug(DBG_INFO, "%s state hashes '%s'", record ? "Recording" : "Verifying", path);
+	_script._stateHash = _stateHash;
+}
+
+void Engine::updateStateHash() {
+	uint32_t hash = kHashInit;
+	hash = HASH_DATA(hash, _script._scriptVars, sizeof(_script._scriptVars));
+	hash = HASH_DATA(hash, _script._scriptTasks, sizeof(_script._scriptTasks));
+	hash = HASH_DATA(hash, _script._scriptStates, sizeof(_script._scriptStates));
+	const uint32_t pageHash = _graphics->getPageHash(_vid._buffers[1]);
+	if (!_stateHash->endFrame(hash, pageHash)) {
+		_stub->_pi.quit = true;
+	}
+}
+
+void Engine::enableProfiler() {
+	if (!_profiler) {
+		_profiler = new Profiler;
+		_script._profiler = _profiler;
+	}
+}
+
+void Engine::setRewindBudget(uint32_t size) {
+	delete _rewind;
+	_rewind = (size != 0) ? new RewindBuffer(size) : 0;
+}
+
+void Engine::saveOrLoad(Serializer &ser) {
+	// resources first as a part change resets the palette and the segments
+	_res.saveOrLoad(ser);
+	_script.saveOrLoad(ser);
+	_vid.saveOrLoad(ser);
+}
+
+void Engine::pushRewindState() {
+	Serializer sizer(Serializer::SM_SIZE);
+	saveOrLoad(sizer);
+	if (sizer._pos > _stateBufSize) {
+		_stateBufSize = sizer._pos;
+		_stateBuf = (uint8_t *)realloc(_stateBuf, _stateBufSize);
+		if (!_stateBuf) {
+			error("Unable to allocate state buffer (%d bytes)", _stateBufSize);
+		}
+	}
+	Serializer ser(Serializer::SM_SAVE, _stateBuf, sizer._pos);
+	saveOrLoad(ser);
+	_rewind->push(_stateBuf, ser._pos);
+}
+
+void Engine::rewindFrame() {
+	static const int kFrameDuration = 20;
+	if (!_rewinding) {
+		// audio is not part of the snapshots
+		_mix.stopAll();
+		_ply.stop();
+		_rewinding = true;
+	}
+	uint32_t size;
+	const uint8_t *state = _rewind->pop(&size);
+	if (state) {
+		Serializer ser(Serializer::SM_LOAD, const_cast<uint8_t *>(state), size);
+		saveOrLoad(ser);
+		if (ser._err) {
+			warning("Engine::rewindFrame() truncated state, size %d", size);
+		}
+		_vid.updateDisplay(0xFE, _stub);
+	}
+	_stub->processEvents();
+	_stub->sleep(kFrameDuration);
+}
@@ -8,13 +8,18 @@
 #define ENGINE_H__
 
 #include "intern.h"
+#include "journal.h"
 #include "script.h"
 #include "mixer.h"
 #include "sfxplayer.h"
 #include "resource.h"
+#include "statehash.h"
 #include "video.h"
 
 struct Graphics;
+struct Profiler;
+struct RewindBuffer;
+struct Serializer;
 struct SystemStub;
 
 struct Engine {
@@ -36,8 +41,18 @@ struct Engine {
 	SfxPlayer _ply;
 	Video _vid;
 	int _partNum;
+	RewindBuffer *_rewind;
+	uint8_t *_stateBuf;
+	uint32_t _stateBufSize;
+	bool _rewinding;
+	Journal *_journal;
+	const char *_journalPath;
+	JournalHeader _journalHdr;
+	StateHash *_stateHash;
+	Profiler *_profiler;
 
 	Engine(const char *dataDir, int partNum);
+	~Engine();
 
 	void setSystemStub(SystemStub *, Graphics *);
 
@@ -59,6 +74,18 @@ struct Engine {
 
 	void saveGameState(uint8_t slot, const char *desc);
 	void loadGameState(uint8_t slot);
+
+	void setJournal(const char *path, bool record);
+	void startJournal(Language lang, int &part, int &pos);
+	void openStateHash(const char *journalPath, bool record);
+	void updateStateHash();
+
+	void enableProfiler();
+
+	void setRewindBudget(uint32_t size);
+	void saveOrLoad(Serializer &ser);
+	void pushRewindState();
+	void rewindFrame();
 };
 
 #endif
@@ -5,9 +5,15 @@
  */
 
 #include <dirent.h>
+#include <fcntl.h>
+#include <sys/mman.h>
 #include <sys/param.h>
 #include <sys/stat.h>
 #include <string.h>
+#include <unistd.h>
+#include <mutex>
+#include <string>
+#include <unordered_map>
 #include "file.h"
 #include "util.h"
 
@@ -21,6 +27,7 @@ struct File_impl {
 	virtual void seek(int off, int whence) = 0;
 	virtual int read(void *ptr, uint32_t len) = 0;
 	virtual int write(const void *ptr, uint32_t len) = 0;
+	virtual const uint8_t *getView(uint32_t offset, uint32_t len) { return 0; }
 };
 
 struct stdFile : File_impl {
@@ -74,6 +81,77 @@ struct stdFile : File_impl {
 	}
 };
 
+// read-only file mapped in memory, the reads are copies from the mapping
+struct mmapFile : File_impl {
+	uint8_t *_ptr;
+	uint32_t _size;
+	uint32_t _pos;
+	mmapFile() : _ptr(0), _size(0), _pos(0) {}
+	bool open(const char *path, const char *mode) {
+		_ioErr = false;
+		const int fd = ::open(path, O_RDONLY);
+		if (fd < 0) {
+			return false;
+		}
+		struct stat st;
+		if (fstat(fd, &st) == 0 && st.st_size > 0) {
+			void *p = mmap(0, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+			if (p != MAP_FAILED) {
+				_ptr = (uint8_t *)p;
+				_size = st.st_size;
+				_pos = 0;
+			}
+		}
+		::close(fd);
+		return (_ptr != 0);
+	}
+	void close() {
+		if (_ptr) {
+			munmap(_ptr, _size);
+			_ptr = 0;
+			_size = 0;
+		}
+	}
+	uint32_t size() {
+		return _size;
+	}
+	void seek(int off, int whence) {
+		switch (whence) {
+		case SEEK_SET:
+			_pos = off;
+			break;
+		case SEEK_CUR:
+			_pos += off;
+			break;
+		case SEEK_END:
+			_pos = _size + off;
+			break;
+		}
+	}
+	int read(void *ptr, uint32_t len) {
+		if (_ptr) {
+			uint32_t r = (_pos < _size) ? MIN(len, _size - _pos) : 0;
+			memcpy(ptr, _ptr + _pos, r);
+			_pos += r;
+			if (r != len) {
+				_ioErr = true;
+			}
+			return r;
+		}
+		return 0;
+	}
+	int write(const void *ptr, uint32_t len) {
+		_ioErr = true;
+		return 0;
+	}
+	const uint8_t *getView(uint32_t offset, uint32_t len) {
+		if (_ptr && offset <= _size && len <= _size - offset) {
+			return _ptr + offset;
+		}
+		return 0;
+	}
+};
+
 File::File() {
 	_impl = new stdFile;
 }
@@ -88,24 +166,63 @@ bool File::open(const char *filepath) {
 	return _impl->open(filepath, "rb");
 }
 
+// lowercase names of the files in a directory, rebuilt when its modification time changes
+struct DirIndex {
+	uint64_t mtime; // ns
+	std::unordered_map<std::string, std::string> names;
+};
+
+static std::mutex _dirIndexMutex;
+static std::unordered_map<std::string, DirIndex> _dirIndex;
+
+static uint64_t getModificationTime(const struct stat &st) {
+#if defined(__APPLE__)
+	return st.st_mtimespec.tv_sec * 1000000000ULL + st.st_mtimespec.tv_nsec;
+#elif defined(__linux__)
+	return st.st_mtim.tv_sec * 1000000000ULL + st.st_mtim.tv_nsec;
+#else
+	return st.st_mtime * 1000000000ULL;
+#endif
+}
+
+static std::string toLower(const char *s) {
+	std::string str(s);
+	for (size_t i = 0; i < str.size(); ++i) {
+		str[i] = tolower((uint8_t)str[i]);
+	}
+	return str;
+}
+
 static bool getFilePathNoCase(const char *filename, const char *path, char *out) {
-	bool ret = false;
-	DIR *d = opendir(path);
-	if (d) {
-		dirent *de;
-		while ((de = readdir(d)) != NULL) {
-			if (de->d_name[0] == '.') {
-				continue;
-			}
-			if (strcasecmp(de->d_name, filename) == 0) {
-				sprintf(out, "%s/%s", path, de->d_name);
-				ret = true;
-				break;
+	struct stat st;
+	if (stat(path, &st) != 0) {
+		return false;
+	}
+	std::lock_guard<std::mutex> lock(_dirIndexMutex);
+	DirIndex &index = _dirIndex[path];
+	const uint64_t mtime = getModificationTime(st);
+	if (index.mtime != mtime) {
+		index.mtime = mtime;
+		index.names.clear();
+		DIR *d = opendir(path);
+		if (d) {
+			dirent *de;
+			while ((de = readdir(d)) != NULL) {
+				if (de->d_name[0] == '.') {
+					continue;
+				}
+				index.names.insert(std::make_pair(toLower(de->d_name), de->d_name));
 			}
+			closedir(d);
 		}
-		closedir(d);
+		debug(DBG_RESOURCE, "Indexed %d files in '%s'", (int)index.names.size(), path);
 	}
-	return ret;
+	std::unordered_map<std::string, std::string>::const_iterator it = index.names.find(toLower(filename));
+	if (it == index.names.end()) {
+		return false;
+	}
+	sprintf(out, "%s/%s", path, it->second.c_str());
+	return true;
 }
 
 bool File::open(const char *filename, const char *path) {
@@ -117,8 +234,32 @@ bool File::open(const char *filename, const char *path) {
 	return false;
 }
 
+bool File::openMapped(const char *filepath) {
+	_impl->close();
+	delete _impl;
+	_impl = new mmapFile;
+	if (_impl->open(filepath, "rb")) {
+		return true;
+	}
+	// fallback to stdio, for empty files or filesystems without mmap support
+	delete _impl;
+	_impl = new stdFile;
+	return _impl->open(filepath, "rb");
+}
+
+bool File::openMapped(const char *filename, const char *path) {
+	char filepath[MAXPATHLEN];
+	if (getFilePathNoCase(filename, path, filepath)) {
+		return openMapped(filepath);
+	}
+	_impl->close();
+	return false;
+}
+
 bool File::openForWriting(const char *filepath) {
 	_impl->close();
+	delete _impl;
+	_impl = new stdFile;
 	return _impl->open(filepath, "wb");
 }
 
@@ -142,6 +283,10 @@ int File::read(void *ptr, uint32_t len) {
 	return _impl->read(ptr, len);
 }
 
+const uint8_t *File::getView(uint32_t offset, uint32_t len) {
+	return _impl->getView(offset, len);
+}
+
 uint8_t File::readByte() {
 	uint8_t b = 0;
 	read(&b, 1);
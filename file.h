@@ -20,12 +20,15 @@ struct File {
 
 	bool open(const char *filepath);
 	bool open(const char *filename, const char *path);
+	bool openMapped(const char *filepath);
+	bool openMapped(const char *filename, const char *path);
 	bool openForWriting(const char *filepath);
 	void close();
 	bool ioErr() const;
 	uint32_t size();
 	void seek(int off, int whence = SEEK_SET);
 	int read(void *ptr, uint32_t len);
+	const uint8_t *getView(uint32_t offset, uint32_t len); // 0 if the file is not mapped
 	uint8_t readByte();
 	uint16_t readUint16LE();
 	uint32_t readUint32LE();
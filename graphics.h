@@ -34,6 +34,7 @@ enum {
 	GFX_H = 200
 };
 
+struct Serializer;
 struct SystemStub;
 
 struct Graphics {
@@ -66,6 +67,8 @@ struct Graphics {
 	virtual void drawBuffer(int num, SystemStub *) = 0;
 	virtual void drawRect(int num, uint8_t color, const Point *pt, int w, int h) = 0;
 	virtual void drawBitmapOverlay(const uint8_t *data, int w, int h, int fmt, SystemStub *stub) = 0;
+	virtual void saveOrLoad(Serializer &ser) {}
+	virtual uint32_t getPageHash(int num) { return 0; }
 };
 
 Graphics *GraphicsGL_create();
@@ -8,6 +8,7 @@
 #include "graphics.h"
 #include "util.h"
 #include "screenshot.h"
+#include "serializer.h"
 #include "systemstub.h"
 
 
@@ -55,6 +56,8 @@ struct GraphicsSoft: Graphics {
 	virtual void drawBuffer(int num, SystemStub *stub);
 	virtual void drawRect(int num, uint8_t color, const Point *pt, int w, int h);
 	virtual void drawBitmapOverlay(const uint8_t *data, int w, int h, int fmt, SystemStub *stub);
+	virtual void saveOrLoad(Serializer &ser);
+	virtual uint32_t getPageHash(int num);
 };
 
 
@@ -473,6 +476,18 @@ void GraphicsSoft::drawBitmapOverlay(const uint8_t *data, int w, int h, int fmt,
 	}
 }
 
+void GraphicsSoft::saveOrLoad(Serializer &ser) {
+	ser.saveOrLoad(_pal);
+	for (int i = 0; i < 4; ++i) {
+		ser.saveOrLoad(_pagePtrs[i], getPageSize());
+	}
+}
+
+uint32_t GraphicsSoft::getPageHash(int num) {
+	const uint32_t hash = HASH_DATA(kHashInit, _pal, sizeof(_pal));
+	return HASH_DATA(hash, getPagePtr(num), getPageSize());
+}
+
 Graphics *GraphicsSoft_create() {
 	return new GraphicsSoft();
 }
@@ -70,6 +70,17 @@ inline void WRITE_LE_UINT32(uint8_t *ptr, uint32_t value) {
 	}
 }
 
+static const uint32_t kHashInit = 0x811C9DC5;
+
+// FNV-1a
+inline uint32_t HASH_DATA(uint32_t hash, const void *ptr, uint32_t len) {
+	const uint8_t *p = (const uint8_t *)ptr;
+	for (uint32_t i = 0; i < len; ++i) {
+		hash = (hash ^ p[i]) * 0x01000193;
+	}
+	return hash;
+}
+
 enum Language {
 	LANG_FR,
 	LANG_US,
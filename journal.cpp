@@ -0,0 +1,141 @@
+
+#include "journal.h"
+#include "systemstub.h"
+#include "util.h"
+
+Journal::Journal()
+	: _recording(false), _replaying(false), _keymask(0), _lastChar(0), _count(0), _frame(0) {
+}
+
+Journal::~Journal() {
+	close();
+}
+
+bool Journal::openForRecording(const char *path, const JournalHeader *hdr) {
+	if (!_f.openForWriting(path)) {
+		warning("Unable to open '%s' for writing", path);
+		return false;
+	}
+	_f.writeUint32BE(kMagic);
+	_f.writeUint16LE(kVersion);
+	_f.writeByte(hdr->dataType);
+	_f.writeByte(hdr->lang);
+	_f.writeByte(hdr->difficulty);
+	_f.writeByte(hdr->remasteredAudio);
+	_f.writeUint16LE(hdr->part);
+	_f.writeUint16LE(hdr->pos);
+	_f.writeUint16LE(hdr->seed);
+	_recording = true;
+	_count = 0;
+	_frame = 0;
+	return true;
+}
+
+bool Journal::openForReplay(const char *path, JournalHeader *hdr) {
+	if (!_f.open(path)) {
+		warning("Unable to open '%s'", path);
+		return false;
+	}
+	const uint32_t magic = _f.readUint32BE();
+	const uint16_t version = _f.readUint16LE();
+	if (magic != kMagic || version != kVersion) {
+		warning("Unhandled input journal '%s' magic 0x%X version %d", path, magic, version);
+		_f.close();
+		return false;
+	}
+	hdr->dataType = _f.readByte();
+	hdr->lang = _f.readByte();
+	hdr->difficulty = _f.readByte();
+	hdr->remasteredAudio = _f.readByte();
+	hdr->part = _f.readUint16LE();
+	hdr->pos = _f.readUint16LE();
+	hdr->seed = _f.readUint16LE();
+	_replaying = true;
+	_count = 0;
+	_frame = 0;
+	return true;
+}
+
+void Journal::close() {
+	if (_recording) {
+		flushRun();
+		debug(DBG_INFO, "Recorded %d frames of inputs", _frame);
+		_recording = false;
+	}
+	_replaying = false;
+	_f.close();
+}
+
+void Journal::flushRun() {
+	if (_count != 0) {
+		_f.writeByte(_keymask);
+		_f.writeByte(_lastChar);
+		_f.writeUint16LE(_count);
+		_count = 0;
+	}
+}
+
+bool Journal::readRun(bool *syncEvent, int16_t *syncValue) {
+	uint8_t buf[4];
+	while (1) {
+		if (_f.read(buf, sizeof(buf)) != sizeof(buf) || _f.ioErr()) {
+			return false;
+		}
+		if ((buf[0] & kSyncEvent) == 0) {
+			break;
+		}
+		*syncEvent = true;
+		*syncValue = (int16_t)READ_LE_UINT16(buf + 2);
+	}
+	_keymask = buf[0];
+	_lastChar = buf[1];
+	_count = READ_LE_UINT16(buf + 2);
+	return _count != 0;
+}
+
+bool Journal::update(PlayerInput *pi, bool *syncEvent, int16_t *syncValue) {
+	if (_recording) {
+		if (*syncEvent) {
+			flushRun();
+			_f.writeByte(kSyncEvent);
+			_f.writeByte(0);
+			_f.writeUint16LE(*syncValue);
+		}
+		uint8_t mask = pi->dirMask & 15;
+		if (pi->action) {
+			mask |= kKeyAction;
+		}
+		if (pi->jump) {
+			mask |= kKeyJump;
+		}
+		if (pi->code) {
+			mask |= kKeyCode;
+		}
+		if (_count != 0 && (mask != _keymask || pi->lastChar != _lastChar || _count == 0xFFFF)) {
+			flushRun();
+		}
+		_keymask = mask;
+		_lastChar = pi->lastChar;
+		++_count;
+		++_frame;
+	} else if (_replaying) {
+		// the events of the audio callback are ignored, the recorded ones replace them
+		*syncEvent = false;
+		if (_count == 0 && !readRun(syncEvent, syncValue)) {
+			debug(DBG_INFO, "End of input journal after %d frames", _frame);
+			_replaying = false;
+			return false;
+		}
+		pi->dirMask = _keymask & 15;
+		pi->action = (_keymask & kKeyAction) != 0;
+		pi->jump = (_keymask & kKeyJump) != 0;
+		pi->code = (_keymask & kKeyCode) != 0;
+		pi->lastChar = _lastChar;
+		// interactive menus are not part of the journal
+		pi->pause = false;
+		pi->back = false;
+		--_count;
+		++_frame;
+	}
+	return true;
+}
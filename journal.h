@@ -0,0 +1,59 @@
+
+#ifndef JOURNAL_H__
+#define JOURNAL_H__
+
+#include "intern.h"
+#include "file.h"
+
+struct PlayerInput;
+
+struct JournalHeader {
+	uint8_t dataType;  // Resource::DataType
+	uint8_t lang;
+	uint8_t difficulty;
+	uint8_t remasteredAudio;
+	uint16_t part;
+	int16_t pos;       // -1 if starting at the beginning of the part
+	uint16_t seed;     // VAR_RANDOM_SEED
+};
+
+// Player inputs captured once per game frame, stored as runs of identical
+// (keymask, lastChar) pairs. This generalizes the DOS 'demo3.joy' format.
+// The music sync events, set by the audio callback, are stored between the
+// runs and applied at the start of the frame they were latched.
+struct Journal {
+	enum {
+		kKeyAction = 1 << 4,
+		kKeyJump   = 1 << 5,
+		kKeyCode   = 1 << 6,
+		kSyncEvent = 1 << 7, // not a run, the music sync value follows
+	};
+
+	static const uint32_t kMagic = 0x524A524E; // 'RJRN'
+	static const uint16_t kVersion = 2;
+
+	File _f;
+	bool _recording;
+	bool _replaying;
+	uint8_t _keymask;
+	char _lastChar;
+	uint16_t _count;
+	uint32_t _frame;
+
+	Journal();
+	~Journal();
+
+	bool openForRecording(const char *path, const JournalHeader *hdr);
+	bool openForReplay(const char *path, JournalHeader *hdr);
+	void close();
+
+	bool isActive() const { return _recording || _replaying; }
+
+	// records or overwrites the inputs and the music sync event for the current frame, returns false at the end of the replay
+	bool update(PlayerInput *pi, bool *syncEvent, int16_t *syncValue);
+
+	void flushRun();
+	bool readRun(bool *syncEvent, int16_t *syncValue);
+};
+
+#endif
@@ -9,7 +9,9 @@
 #include <sys/stat.h>
 #include "engine.h"
 #include "graphics.h"
+#include "resampler.h"
 #include "resource.h"
+#include "sfxplayer.h"
 #include "systemstub.h"
 #include "util.h"
 
@@ -29,6 +31,22 @@ static const char USAGE[] =
 	"  --difficulty=DIFF Difficulty (easy,normal,hard)\n"
 	"  --audio=AUDIO     Audio (original,remastered)\n"
 	"  --mt32            Use MT32 sounds mapping with DOS version\n"
+	"  --rewind[=KB]     Keep a rewind history of KB kilobytes (default 4096)\n"
+	"  --rewind-key=KEY  Key to hold for rewinding (default 'Tab')\n"
+	"  --record=FILE     Record inputs to FILE, state hashes to FILE.hash\n"
+	"  --replay=FILE     Replay inputs from FILE, checking FILE.hash\n"
+	"  --headless        No display and no input, time advances without waiting\n"
+	"  --audio-out=FILE  Render the audio offline with the game clock to a WAV file\n"
+	"  --profile         Print opcodes, tasks and shapes statistics on exit\n"
+	"  --debug=MASK      Debug messages categories (see util.h)\n"
+	"  --cache-dir=PATH  Keep unpacked bank resources in PATH\n"
+	"  --cache-size=MB   Maximum size of the cache directory (default 64)\n"
+	"  --debug-async     Format debug messages in a background thread\n"
+	"  --audio-rate=HZ   Audio output sample rate (default 44100)\n"
+	"  --audio-buffer=N  Audio buffer size in frames (default 4096)\n"
+	"  --audio-stats     Print audio callbacks and latency statistics on exit\n"
+	"  --resampler=NAME  Sounds and music resampling (nearest,linear,sinc)\n"
+	"  --prerender-music Render the modules in the background and stream the samples\n"
 	;
 
 static const struct {
@@ -53,6 +71,16 @@ static const struct {
 	{ 0,  -1 }
 };
 
+static const struct {
+	const char *name;
+	int type;
+} RESAMPLERS[] = {
+	{ "nearest", kResamplerNearest },
+	{ "linear", kResamplerLinear },
+	{ "sinc", kResamplerSinc },
+	{ 0, -1 }
+};
+
 static const struct {
 	const char *name;
 	int difficulty;
@@ -68,6 +96,7 @@ bool Graphics::_use555 = false;
 bool Video::_useEGA = false;
 Difficulty Script::_difficulty = DIFFICULTY_NORMAL;
 bool Script::_useRemasteredAudio = true;
+bool SfxPlayer::_prerender = false;
 
 static Graphics *createGraphics(int type) {
 	switch (type) {
@@ -101,6 +130,16 @@ struct Scaler {
 	int factor;
 };
 
+static bool parseResampler(const char *name) {
+	for (int i = 0; RESAMPLERS[i].name; ++i) {
+		if (strcmp(name, RESAMPLERS[i].name) == 0) {
+			Resampler::setType(RESAMPLERS[i].type);
+			return true;
+		}
+	}
+	return false;
+}
+
 static void parseScaler(char *name, Scaler *s) {
 	char *sep = strchr(name, '@');
 	if (sep) {
@@ -113,6 +152,8 @@ static void parseScaler(char *name, Scaler *s) {
 	}
 }
 
+static const int DEFAULT_REWIND_KB = 4096;
+
 static const int DEFAULT_WINDOW_W = 640;
 static const int DEFAULT_WINDOW_H = 400;
 
@@ -132,6 +173,21 @@ int main(int argc, char *argv[]) {
 	bool defaultGraphics = true;
 	bool demo3JoyInputs = false;
 	bool useMT32 = false;
+	int rewindKb = 0;
+	const char *rewindKey = 0;
+	const char *recordPath = 0;
+	const char *replayPath = 0;
+	bool headless = false;
+	bool profile = false;
+	int debugMask = DBG_INFO;
+	bool debugAsync = false;
+	const char *cacheDir = 0;
+	int cacheSizeMb = 64;
+	int audioRate = Mixer::kDefaultRate;
+	int audioBufferSize = Mixer::kDefaultBufferSize;
+	bool audioStats = false;
+	bool prerenderMusic = false;
+	const char *audioOutPath = 0;
 	if (argc == 2) {
 		// data path as the only command line argument
 		struct stat st;
@@ -154,6 +210,22 @@ int main(int argc, char *argv[]) {
 			{ "difficulty", required_argument, 0, 'i' },
 			{ "audio",    required_argument, 0, 'u' },
 			{ "mt32",       no_argument,     0, 'm' },
+			{ "rewind",     optional_argument, 0, 'b' },
+			{ "rewind-key", required_argument, 0, 'k' },
+			{ "record",   required_argument, 0, 'c' },
+			{ "replay",   required_argument, 0, 'y' },
+			{ "headless",   no_argument,     0, 'n' },
+			{ "profile",    no_argument,     0, 'o' },
+			{ "debug",    required_argument, 0, 'g' },
+			{ "debug-async", no_argument,    0, 'q' },
+			{ "cache-dir", required_argument, 0, 'x' },
+			{ "cache-size", required_argument, 0, 'z' },
+			{ "audio-rate", required_argument, 0, 't' },
+			{ "audio-buffer", required_argument, 0, 'v' },
+			{ "audio-stats", no_argument,    0, 'A' },
+			{ "audio-out", required_argument, 0, 'W' },
+			{ "resampler", required_argument, 0, 'R' },
+			{ "prerender-music", no_argument, 0, 'P' },
 			{ "help",       no_argument,     0, 'h' },
 			{ 0, 0, 0, 0 }
 		};
@@ -224,6 +296,56 @@ int main(int argc, char *argv[]) {
 		case 'm':
 			useMT32 = true;
 			break;
+		case 'b':
+			rewindKb = optarg ? atoi(optarg) : DEFAULT_REWIND_KB;
+			break;
+		case 'k':
+			rewindKey = optarg;
+			break;
+		case 'c':
+			recordPath = optarg;
+			break;
+		case 'y':
+			replayPath = optarg;
+			break;
+		case 'n':
+			headless = true;
+			break;
+		case 'o':
+			profile = true;
+			break;
+		case 'g':
+			debugMask = strtol(optarg, 0, 0);
+			break;
+		case 'q':
+			debugAsync = true;
+			break;
+		case 'x':
+			cacheDir = optarg;
+			break;
+		case 'z':
+			cacheSizeMb = atoi(optarg);
+			break;
+		case 't':
+			audioRate = atoi(optarg);
+			break;
+		case 'v':
+			audioBufferSize = atoi(optarg);
+			break;
+		case 'A':
+			audioStats = true;
+			break;
+		case 'W':
+			audioOutPath = optarg;
+			break;
+		case 'R':
+			if (!parseResampler(optarg)) {
+				warning("Unknown resampler '%s', expected nearest,linear,sinc", optarg);
+			}
+			break;
+		case 'P':
+			prerenderMusic = true;
+			break;
 		case 'h':
 			// fall-through
 		default:
@@ -232,17 +354,54 @@ int main(int argc, char *argv[]) {
 			return 0;
 		}
 	}
-	g_debugMask = DBG_INFO; // | DBG_VIDEO | DBG_SND | DBG_SCRIPT | DBG_BANK | DBG_SER;
+	g_debugMask = debugMask; // DBG_INFO | DBG_VIDEO | DBG_SND | DBG_SCRIPT | DBG_BANK | DBG_SER;
+	if (debugAsync) {
+		debug_startAsync();
+	}
+	if (prerenderMusic && !headless && !audioOutPath) {
+		// the player creates its rendering thread when the engine is created
+		SfxPlayer::_prerender = true;
+	}
 	Engine *e = new Engine(dataPath, part);
+	if (cacheDir) {
+		if (cacheSizeMb < 1 || cacheSizeMb > 4095) {
+			warning("Invalid cache size %d MB", cacheSizeMb);
+			cacheSizeMb = 64;
+		}
+		e->_res.setBankCache(cacheDir, (uint32_t)cacheSizeMb << 20);
+	}
+	if (audioRate < 8000 || audioRate > 96000) {
+		warning("Invalid audio rate %d", audioRate);
+		audioRate = Mixer::kDefaultRate;
+	}
+	if (audioBufferSize < 64 || audioBufferSize > 16384) {
+		warning("Invalid audio buffer size %d", audioBufferSize);
+		audioBufferSize = Mixer::kDefaultBufferSize;
+	}
+	e->_mix.setAudioFormat(audioRate, audioBufferSize);
+	e->_mix._printStats = audioStats;
+	if (headless || audioOutPath) {
+		// the samples follow the game clock, the music sync variable is set deterministically
+		e->_mix.setOffline(audioOutPath);
+	}
 	if (defaultGraphics) {
 		// if not set, use original software graphics for 199x and 3DO versions and GL for the anniversary releases
 		graphicsType = getGraphicsType(e->_res.getDataType());
 		dm.opengl = (graphicsType == GRAPHICS_GL);
 	}
+	if (headless && graphicsType == GRAPHICS_GL) {
+		graphicsType = GRAPHICS_SOFTWARE;
+		dm.opengl = false;
+	}
 	if (graphicsType != GRAPHICS_GL && e->_res.getDataType() == Resource::DT_3DO) {
 		graphicsType = GRAPHICS_SOFTWARE;
 		Graphics::_use555 = true;
 	}
+	if (replayPath) {
+		e->setJournal(replayPath, false);
+	} else if (recordPath) {
+		e->setJournal(recordPath, true);
+	}
 	Graphics *graphics = createGraphics(graphicsType);
 	if (e->_res.getDataType() == Resource::DT_20TH_EDITION) {
 		switch (Script::_difficulty) {
@@ -264,12 +423,24 @@ int main(int argc, char *argv[]) {
 			debug(DBG_INFO, "Using original audio");
 		}
 	}
-	SystemStub *stub = SystemStub_SDL_create();
+	SystemStub *stub = headless ? SystemStub_Null_create() : SystemStub_SDL_create();
 	stub->init(e->getGameTitle(lang), &dm);
 	e->setSystemStub(stub, graphics);
+	if (rewindKb > 0 && (recordPath || replayPath)) {
+		warning("Rewind is disabled when recording or replaying inputs");
+	} else if (rewindKb > 0) {
+		debug(DBG_INFO, "Using %d KB rewind buffer", rewindKb);
+		e->setRewindBudget(rewindKb * 1024);
+		if (rewindKey) {
+			stub->setRewindKey(rewindKey);
+		}
+	}
 	if (demo3JoyInputs && e->_res.getDataType() == Resource::DT_DOS) {
 		e->_res.readDemo3Joy();
 	}
+	if (profile) {
+		e->enableProfiler();
+	}
 	e->setup(lang, graphicsType, scaler.name, scaler.factor, useMT32);
 	while (!stub->_pi.quit) {
 		e->run();
@@ -280,5 +451,6 @@ int main(int argc, char *argv[]) {
 	if (dataPath) free(dataPath);
 	stub->fini();
 	delete stub;
+	debug_stopAsync();
 	return 0;
 }
@@ -6,11 +6,19 @@
 
 #include <SDL.h>
 #include <SDL_mixer.h>
-#include <map>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <list>
+#include <mutex>
+#include <thread>
 #include "aifcplayer.h"
+#include "file.h"
 #include "mixer.h"
 #include "mixer_platform.h"
+#include "resampler.h"
 #include "sfxplayer.h"
+#include "systemstub.h"
 #include "util.h"
 
 #ifdef USE_MT32EMU
@@ -40,13 +48,43 @@ static int16_t toS16(int a) {
 	return ((a << 8) | a) - 32768;
 }
 
+struct SoundCacheEntry {
+	enum {
+		kTypeWav,
+		kTypeAiff
+	};
+	uint8_t type;
+	uint16_t num; // resource number
+	const uint8_t *src; // resource data (WAV), the same number may load another variant
+	int len, freq;
+	bool bits16, stereo;
+	int16_t *data; // native 16 bits stereo at the mixing rate (WAV)
+	uint32_t frames;
+	Mix_Chunk *chunk; // AIFF
+	uint32_t size;
+	bool pinned; // preloaded, kept until stopAll()
+	std::atomic<int> refs; // channels and pending commands
+
+	SoundCacheEntry()
+		: src(0), data(0), frames(0), chunk(0), size(0), pinned(false), refs(0) {
+	}
+	~SoundCacheEntry() {
+		free(data);
+		Mix_FreeChunk(chunk);
+	}
+};
+
 struct MixerChannel {
 	const uint8_t *_data;
 	Frac _pos;
 	uint32_t _len;
 	uint32_t _loopLen, _loopPos;
 	int _volume;
-	void (MixerChannel::*_mixWav)(int16_t *sample, int count);
+	void (MixerChannel::*_mixWav)(int32_t *samples, int count);
+	int32_t _volumeTable[256]; // 8 bits samples scaled by _volume
+	int _tableVolume, _tableXor;
+	const int16_t *_sincTable;
+	SoundCacheEntry *_entry; // released when the channel stops
 
 	void initRaw(const uint8_t *data, int freq, int volume, int mixingFreq) {
 		_data = data + 8;
@@ -58,6 +96,7 @@ struct MixerChannel {
 		_len = len;
 
 		_volume = volume;
+		_sincTable = (Resampler::_type == kResamplerSinc) ? Resampler::getSincTable(_pos.inc) : 0;
 	}
 
 	void initMac(const uint8_t *data, int freq, int volume, int mixingFreq) {
@@ -73,6 +112,7 @@ struct MixerChannel {
 		_len = len;
 
 		_volume = volume;
+		_sincTable = (Resampler::_type == kResamplerSinc) ? Resampler::getSincTable(_pos.inc) : 0;
 	}
 
 	void initWav(const uint8_t *data, int freq, int volume, int mixingFreq, int len, bool bits16, bool stereo, bool loop) {
@@ -85,82 +125,182 @@ struct MixerChannel {
 		_volume = volume;
 		_mixWav = bits16 ? (stereo ? &MixerChannel::mixWav<16, true> : &MixerChannel::mixWav<16, false>) : (stereo ? &MixerChannel::mixWav<8, true> : &MixerChannel::mixWav<8, false>);
 	}
-	void mixRaw(int16_t &sample) {
-		if (_data) {
-			uint32_t pos = _pos.getInt();
-			_pos.offset += _pos.inc;
-			if (_loopLen != 0) {
-				if (pos >= _loopPos + _loopLen) {
-					pos = _loopPos;
-					_pos.offset = (_loopPos << Frac::BITS) + _pos.inc;
-				}
-			} else {
-				if (pos >= _len) {
-					_data = 0;
-					return;
-				}
+
+	void initCached(SoundCacheEntry *entry, int volume, bool loop) {
+		_data = (const uint8_t *)entry->data;
+		_pos.offset = 0;
+		_pos.inc = 1 << Frac::BITS;
+		_len = entry->frames;
+		_loopLen = loop ? _len : 0;
+		_loopPos = 0;
+		_volume = volume;
+		_mixWav = &MixerChannel::mixCached;
+		_entry = entry;
+	}
+
+	void release() {
+		if (_entry) {
+			_entry->refs.fetch_sub(1, std::memory_order_release);
+			_entry = 0;
+		}
+	}
+
+	const int32_t *getVolumeTable(int xorMask) {
+		if (_tableVolume != _volume || _tableXor != xorMask) {
+			for (int i = 0; i < 256; ++i) {
+				_volumeTable[i] = toS16(i ^ xorMask) * _volume / 64;
 			}
-			sample = mixS16(sample, toS16(_data[pos] ^ 0x80) * _volume / 64);
+			_tableVolume = _volume;
+			_tableXor = xorMask;
 		}
+		return _volumeTable;
 	}
 
-	void mixMac(int16_t &sample) {
-		if (_data) {
-			uint32_t pos = _pos.getInt();
-			_pos.offset += _pos.inc;
-			if (_loopLen != 0) {
-				if (pos >= _loopPos + _loopLen) {
-					pos = _loopPos;
-					_pos.offset = (_loopPos << Frac::BITS) + _pos.inc;
+	// number of samples before the position reaches 'end'
+	uint32_t getSamplesCount(uint32_t end) const {
+		const uint64_t limit = ((uint64_t)end) << Frac::BITS;
+		if (_pos.offset >= limit) {
+			return 0;
+		}
+		if (_pos.inc == 0) {
+			return 0xFFFFFFFF;
+		}
+		return (limit - _pos.offset + _pos.inc - 1) / _pos.inc;
+	}
+
+	template<int type>
+	int getRawSample(uint32_t pos, uint32_t frac, uint32_t end, const int32_t *table, int xorMask) const {
+		if (type == kResamplerLinear) {
+			uint32_t next = pos + 1;
+			if (next >= end) {
+				next = (_loopLen != 0) ? _loopPos : pos;
+			}
+			return ((int64_t)table[_data[pos]] * (Frac::MASK - frac) + (int64_t)table[_data[next]] * frac) >> Frac::BITS;
+		} else if (type == kResamplerSinc) {
+			const int sum = sincSample(_data, pos, frac, end, _loopPos, _loopLen, _sincTable, xorMask ^ 0x80);
+			return ((sum * 257) >> Resampler::kSincCoeffBits) * _volume / 64;
+		}
+		return table[_data[pos]];
+	}
+
+	// mono, the loop or end position is only checked once per run of samples
+	template<int type>
+	void mixRaw(int32_t *samples, int count, int xorMask) {
+		const int32_t *table = getVolumeTable(xorMask);
+		int i = 0;
+		while (_data && i < count) {
+			const uint32_t end = (_loopLen != 0) ? _loopPos + _loopLen : _len;
+			const uint32_t n = MIN<uint32_t>(getSamplesCount(end), count - i);
+			const uint8_t *data = _data;
+			uint64_t offset = _pos.offset;
+			const uint32_t inc = _pos.inc;
+			if (type == kResamplerNearest) {
+				for (uint32_t j = 0; j < n; ++j) {
+					samples[i + j] += table[data[offset >> Frac::BITS]];
+					offset += inc;
 				}
 			} else {
-				if (pos >= _len) {
+				for (uint32_t j = 0; j < n; ++j) {
+					samples[i + j] += getRawSample<type>(offset >> Frac::BITS, offset & Frac::MASK, end, table, xorMask);
+					offset += inc;
+				}
+			}
+			_pos.offset = offset;
+			i += n;
+			if (i < count) {
+				if (_loopLen != 0) {
+					samples[i++] += getRawSample<type>(_loopPos, 0, end, table, xorMask);
+					_pos.offset = (_loopPos << Frac::BITS) + _pos.inc;
+				} else {
 					_data = 0;
-					return;
 				}
 			}
-			sample = mixS16(sample, toS16(_data[pos]) * _volume / 64);
 		}
 	}
 
+	void mixRaw(int32_t *samples, int count, int xorMask) {
+		switch (Resampler::_type) {
+		case kResamplerLinear:
+			mixRaw<kResamplerLinear>(samples, count, xorMask);
+			break;
+		case kResamplerSinc:
+			mixRaw<kResamplerSinc>(samples, count, xorMask);
+			break;
+		default:
+			mixRaw<kResamplerNearest>(samples, count, xorMask);
+			break;
+		}
+	}
+
+	template<int bits, bool stereo>
+	void mixWavSample(int32_t *samples, uint32_t pos) {
+		if (stereo) {
+			pos *= 2;
+		}
+		int valueL;
+		if (bits == 8) { // U8
+			valueL = toS16(_data[pos]) * _volume / 64;
+		} else { // S16
+			valueL = ((int16_t)READ_LE_UINT16(&_data[pos * sizeof(int16_t)])) * _volume / 64;
+		}
+		samples[0] += valueL;
+		int valueR;
+		if (!stereo) {
+			valueR = valueL;
+		} else {
+			if (bits == 8) { // U8
+				valueR = toS16(_data[pos + 1]) * _volume / 64;
+			} else { // S16
+				valueR = ((int16_t)READ_LE_UINT16(&_data[(pos + 1) * sizeof(int16_t)])) * _volume / 64;
+			}
+		}
+		samples[1] += valueR;
+	}
+
+	// stereo, count is the number of int32_t in samples
 	template<int bits, bool stereo>
-	void mixWav(int16_t *samples, int count) {
-		for (int i = 0; i < count; i += 2) {
-			uint32_t pos = _pos.getInt();
-			_pos.offset += _pos.inc;
-			if (pos >= _len) {
+	void mixWav(int32_t *samples, int count) {
+		int i = 0;
+		while (_data && i < count) {
+			const uint32_t n = MIN<uint32_t>(getSamplesCount(_len), (count - i) / 2);
+			for (uint32_t j = 0; j < n; ++j) {
+				mixWavSample<bits, stereo>(samples + i, _pos.getInt());
+				_pos.offset += _pos.inc;
+				i += 2;
+			}
+			if (i < count) {
 				if (_loopLen != 0) {
-					pos = 0;
+					mixWavSample<bits, stereo>(samples + i, 0);
 					_pos.offset = _pos.inc;
+					i += 2;
 				} else {
 					_data = 0;
-					break;
 				}
 			}
-			if (stereo) {
-				pos *= 2;
-			}
-			int valueL;
-			if (bits == 8) { // U8
-				valueL = toS16(_data[pos]) * _volume / 64;
-			} else { // S16
-				valueL = ((int16_t)READ_LE_UINT16(&_data[pos * sizeof(int16_t)])) * _volume / 64;
-			}
-			*samples = mixS16(*samples, valueL);
-			++samples;
+		}
+	}
 
-			int valueR;
-			if (!stereo) {
-				valueR = valueL;
-			} else {
-				if (bits == 8) { // U8
-					valueR = toS16(_data[pos + 1]) * _volume / 64;
-				} else { // S16
-					valueR = ((int16_t)READ_LE_UINT16(&_data[(pos + 1) * sizeof(int16_t)])) * _volume / 64;
+	// stereo, the samples were converted to the mixing rate when cached
+	void mixCached(int32_t *samples, int count) {
+		const int16_t *data = (const int16_t *)_data;
+		int i = 0;
+		while (_data && i < count) {
+			uint32_t pos = _pos.getInt();
+			const uint32_t n = MIN<uint32_t>(_len - pos, (count - i) / 2);
+			for (uint32_t j = 0; j < n; ++j) {
+				samples[i] += data[pos * 2] * _volume / 64;
+				samples[i + 1] += data[pos * 2 + 1] * _volume / 64;
+				++pos;
+				i += 2;
+			}
+			_pos.offset = ((uint64_t)pos) << Frac::BITS;
+			if (pos == _len) {
+				if (_loopLen != 0) {
+					_pos.offset = 0;
+				} else {
+					_data = 0;
 				}
 			}
-			*samples = mixS16(*samples, valueR);
-			++samples;
 		}
 	}
 };
@@ -228,27 +368,327 @@ static const uint8_t *loadWav(const uint8_t *data, int &freq, int &len, bool &bi
 	return data + offset;
 }
 
-struct Mixer_impl {
+// sounds converted once, shared by the channels playing them. The entries no longer
+// referenced are evicted in least recently used order above the size limit. The WAV
+// entries point to the resources data and are dropped when the resources are released.
+struct SoundCache {
+	enum {
+		kMaxSize = 16 * 1024 * 1024
+	};
+
+	std::list<SoundCacheEntry *> _entries; // most recently used first
+	uint32_t _size;
+	MixerStats *_stats;
 
-#if SDL_VERSIONNUM(SDL_MIXER_MAJOR_VERSION, SDL_MIXER_MINOR_VERSION, SDL_MIXER_PATCHLEVEL) < SDL_VERSIONNUM(2,0,2)
-	static const
+	SoundCache(MixerStats *stats)
+		: _size(0), _stats(stats) {
+	}
+	~SoundCache() {
+		for (std::list<SoundCacheEntry *>::iterator it = _entries.begin(); it != _entries.end(); ++it) {
+			delete *it;
+		}
+	}
+
+	std::list<SoundCacheEntry *>::iterator lookup(int type, uint16_t num, const uint8_t *src = 0, int len = 0, int freq = 0, bool bits16 = false, bool stereo = false) {
+		std::list<SoundCacheEntry *>::iterator it = _entries.begin();
+		for (; it != _entries.end(); ++it) {
+			const SoundCacheEntry *entry = *it;
+			if (entry->type == type && entry->num == num && entry->src == src && entry->len == len && entry->freq == freq && entry->bits16 == bits16 && entry->stereo == stereo) {
+				break;
+			}
+		}
+		return it;
+	}
+
+	SoundCacheEntry *find(int type, uint16_t num, const uint8_t *src = 0, int len = 0, int freq = 0, bool bits16 = false, bool stereo = false) {
+		std::list<SoundCacheEntry *>::iterator it = lookup(type, num, src, len, freq, bits16, stereo);
+		if (it == _entries.end()) {
+			return 0;
+		}
+		_entries.splice(_entries.begin(), _entries, it);
+		++_stats->soundCacheHits;
+		return *it;
+	}
+
+	void add(SoundCacheEntry *entry) {
+		++_stats->soundCacheMisses;
+		_entries.push_front(entry);
+		_size += entry->size;
+		evict();
+		_stats->soundCacheMax = MAX(_stats->soundCacheMax, _size);
+	}
+
+	// the returned entry is referenced, 0 if the sound is not cached
+	SoundCacheEntry *getWav(uint16_t num, const uint8_t *data, int freq, int mixingFreq, int len, bool bits16, bool stereo) {
+		if (len <= 0 || freq <= 0) {
+			return 0;
+		}
+		SoundCacheEntry *entry = find(SoundCacheEntry::kTypeWav, num, data, len, freq, bits16, stereo);
+		if (!entry) {
+			Frac pos;
+			pos.reset(freq, mixingFreq);
+			const uint64_t frames = ((((uint64_t)len) << Frac::BITS) + pos.inc - 1) / pos.inc;
+			if (frames * 2 * sizeof(int16_t) > kMaxSize / 4) {
+				return 0;
+			}
+			entry = new SoundCacheEntry;
+			entry->type = SoundCacheEntry::kTypeWav;
+			entry->num = num;
+			entry->src = data;
+			entry->len = len;
+			entry->freq = freq;
+			entry->bits16 = bits16;
+			entry->stereo = stereo;
+			entry->frames = frames;
+			entry->size = frames * 2 * sizeof(int16_t);
+			entry->data = (int16_t *)malloc(entry->size);
+			if (!entry->data) {
+				delete entry;
+				return 0;
+			}
+			// same positions as MixerChannel::mixWav, without the volume
+			const int channels = stereo ? 2 : 1;
+			for (uint32_t i = 0; i < entry->frames; ++i) {
+				const uint32_t p = pos.getInt() * channels;
+				for (int c = 0; c < 2; ++c) {
+					const uint32_t q = p + ((c < channels) ? c : 0);
+					entry->data[i * 2 + c] = bits16 ? (int16_t)READ_LE_UINT16(data + q * sizeof(int16_t)) : toS16(data[q]);
+				}
+				pos.offset += pos.inc;
+			}
+			add(entry);
+		}
+		entry->refs.fetch_add(1, std::memory_order_relaxed);
+		return entry;
+	}
+
+	// pinned, the sounds are preloaded with the resources and may be played later
+	void preloadAiff(int num, const uint8_t *data) {
+		std::list<SoundCacheEntry *>::iterator it = lookup(SoundCacheEntry::kTypeAiff, num);
+		if (it != _entries.end()) {
+			(*it)->pinned = true;
+			return;
+		}
+		const uint32_t size = READ_BE_UINT32(data + 4) + 8;
+		SDL_RWops *rw = SDL_RWFromConstMem(data, size);
+		Mix_Chunk *chunk = Mix_LoadWAV_RW(rw, 0);
+		rw->close(rw);
+		if (chunk) {
+			SoundCacheEntry *entry = new SoundCacheEntry;
+			entry->type = SoundCacheEntry::kTypeAiff;
+			entry->num = num;
+			entry->len = entry->freq = 0;
+			entry->bits16 = entry->stereo = false;
+			entry->chunk = chunk;
+			entry->size = chunk->alen;
+			entry->pinned = true;
+			add(entry);
+		}
+	}
+
+	// called once the channels are stopped, before the resources are released
+	void releaseResources() {
+		for (std::list<SoundCacheEntry *>::iterator it = _entries.begin(); it != _entries.end(); ) {
+			SoundCacheEntry *entry = *it;
+			entry->pinned = false;
+			if (entry->type == SoundCacheEntry::kTypeWav && entry->refs.load(std::memory_order_acquire) == 0) {
+				_size -= entry->size;
+				it = _entries.erase(it);
+				delete entry;
+				continue;
+			}
+			++it;
+		}
+		evict();
+	}
+
+	void evict() {
+		for (std::list<SoundCacheEntry *>::iterator it = _entries.end(); it != _entries.begin() && _size > kMaxSize; ) {
+			--it;
+			SoundCacheEntry *entry = *it;
+			if (!entry->pinned && entry->refs.load(std::memory_order_acquire) == 0) {
+				debug(DBG_SND, "SoundCache::evict() type %d num %d", entry->type, entry->num);
+				_size -= entry->size;
+				it = _entries.erase(it);
+				delete entry;
+			}
+		}
+	}
+};
+
+// posted by the game thread, applied by the audio callback at the sample matching timeStamp
+struct MixerCommand {
+	enum {
+		kPlayRaw,
+		kPlayMac,
+		kPlayWav,
+		kStop,
+		kSetVolume,
+		kPlayMt32,
+		kStopMt32,
+		kPlaySfx,
+		kSetSfxDelay,
+		kStopSfx
+	};
+	uint8_t type;
+	uint8_t channel;
+	uint8_t volume;
+	bool loop, bits16, stereo;
+	const uint8_t *data;
+	int freq;
+	int len;
+	SfxPlayer *sfx;
+	SoundCacheEntry *entry;
+	SfxMusic *music;
+	uint16_t num, delay;
+	uint8_t pos;
+	uint32_t timeStamp;
+
+	MixerCommand(int t = kStop) {
+		memset(this, 0, sizeof(*this));
+		type = t;
+	}
+};
+
+#ifdef USE_MT32EMU
+// renders the synth on a thread, ahead of the audio callback. The MIDI messages are posted
+// from the callback with the output frame they apply to, one lookahead period later.
+struct Mt32Renderer {
+	enum {
+		kEventsSize = 256, // power of two
+		kRenderFrames = 256
+	};
+
+	struct Event {
+		uint32_t frame;
+		uint32_t msg;
+	};
+
+	mt32emu_context _mt32;
+	int16_t *_ring; // stereo
+	uint32_t _ringFrames; // power of two
+	uint32_t _lookahead;
+	// single producer (render thread), single consumer (audio callback)
+	std::atomic<uint32_t> _readFrame, _writeFrame;
+	// single producer (audio callback or game thread with the audio locked), single consumer (render thread)
+	Event _events[kEventsSize];
+	std::atomic<uint32_t> _eventsHead, _eventsTail;
+	std::atomic<bool> _quit;
+	std::mutex _mutex;
+	std::condition_variable _cond;
+	std::thread _thread;
+
+	Mt32Renderer(mt32emu_context mt32, int lookahead)
+		: _mt32(mt32), _lookahead(lookahead), _readFrame(0), _writeFrame(0), _eventsHead(0), _eventsTail(0), _quit(false) {
+		_ringFrames = kRenderFrames;
+		while (_ringFrames < _lookahead * 2) {
+			_ringFrames *= 2;
+		}
+		_ring = (int16_t *)calloc(_ringFrames * 2, sizeof(int16_t));
+		_thread = std::thread(&Mt32Renderer::run, this);
+	}
+	~Mt32Renderer() {
+		_quit = true;
+		_cond.notify_one();
+		_thread.join();
+		free(_ring);
+	}
+
+	void postMessage(uint32_t msg) {
+		const uint32_t tail = _eventsTail.load(std::memory_order_relaxed);
+		if (tail - _eventsHead.load(std::memory_order_acquire) == kEventsSize) {
+			return;
+		}
+		Event &ev = _events[tail & (kEventsSize - 1)];
+		ev.frame = _readFrame.load(std::memory_order_relaxed) + _lookahead;
+		ev.msg = msg;
+		_eventsTail.store(tail + 1, std::memory_order_release);
+	}
+
+	// returns the number of frames available, the missing ones are left untouched
+	int read(int16_t *samples, int frames) {
+		const uint32_t readFrame = _readFrame.load(std::memory_order_relaxed);
+		const int count = MIN<uint32_t>(frames, _writeFrame.load(std::memory_order_acquire) - readFrame);
+		for (int i = 0; i < count; ++i) {
+			const uint32_t pos = (readFrame + i) & (_ringFrames - 1);
+			samples[i * 2] = _ring[pos * 2];
+			samples[i * 2 + 1] = _ring[pos * 2 + 1];
+		}
+		_readFrame.store(readFrame + count, std::memory_order_release);
+		_cond.notify_one();
+		return count;
+	}
+
+	void run() {
+		while (!_quit) {
+			const uint32_t writeFrame = _writeFrame.load(std::memory_order_relaxed);
+			const uint32_t targetFrame = _readFrame.load(std::memory_order_acquire) + _lookahead;
+			if ((int32_t)(targetFrame - writeFrame) <= 0) {
+				// the timeout covers the notifications sent before waiting
+				std::unique_lock<std::mutex> lock(_mutex);
+				_cond.wait_for(lock, std::chrono::milliseconds(2));
+				continue;
+			}
+			uint32_t count = MIN<uint32_t>(targetFrame - writeFrame, kRenderFrames);
+			uint32_t head = _eventsHead.load(std::memory_order_relaxed);
+			const uint32_t tail = _eventsTail.load(std::memory_order_acquire);
+			for (; head != tail; ++head) {
+				const Event &ev = _events[head & (kEventsSize - 1)];
+				const int32_t delta = ev.frame - writeFrame;
+				if (delta > 0) {
+					count = MIN<uint32_t>(count, delta);
+					break;
+				}
+				mt32emu_play_msg(_mt32, ev.msg);
+			}
+			_eventsHead.store(head, std::memory_order_release);
+			const uint32_t pos = writeFrame & (_ringFrames - 1);
+			count = MIN(count, _ringFrames - pos);
+			mt32emu_render_bit16s(_mt32, _ring + pos * 2, count);
+			_writeFrame.store(writeFrame + count, std::memory_order_release);
+		}
+	}
+};
 #endif
-	int kMixFreq = 44100;
+
+struct Mixer_impl {
+
+	int kMixFreq;
 	static const SDL_AudioFormat kMixFormat = AUDIO_S16SYS;
 	static const int kMixSoundChannels = 2;
-	static const int kMixBufSize = 4096;
 	static const int kMixChannels = 4;
+	static const int kMixBlockSize = 512;
+	static const int kCommandsSize = 256; // power of two
 
 	Mix_Chunk *_sounds[kMixChannels];
 	Mix_Music *_music;
 	MixerChannel _channels[kMixChannels];
+	int32_t _mixBuf[kMixBlockSize * 2]; // accumulators, saturated once per block
 	SfxPlayer *_sfx;
-	std::map<int, Mix_Chunk *> _preloads; // AIFF preloads (3DO)
+	SoundCache *_soundCache; // WAV and AIFF (3DO) sounds, accessed by the game thread
+	SoundCacheEntry *_aiffEntries[kMixChannels];
 	MixerType _mixerType;
 	SDL_AudioDeviceID _audioDevice;
+	// single producer (game thread), single consumer (audio callback)
+	MixerCommand _commands[kCommandsSize];
+	std::atomic<uint32_t> _commandsHead, _commandsTail;
+	uint32_t _callbackTimeStamp;
+	MixerStats _stats; // updated by the audio callback
+	uint64_t _callbackCounter;
+	// offline rendering, driven by the game clock instead of the audio device
+	bool _offline;
+	SystemStub *_stub;
+	uint32_t _offlineTimeStamp;
+	uint64_t _offlineFrames;
+	File *_wavFile;
+	void (*_musicHook)(void *, uint8_t *, int);
+	void *_musicHookData;
+	void (*_postMix)(void *, uint8_t *, int);
+	void *_postMixData;
 
 #ifdef USE_MT32EMU
 	mt32emu_context _mt32;
+	Mt32Renderer *_mt32Renderer;
 #endif
 
 #ifdef USE_LIBADLMIDI
@@ -256,18 +696,37 @@ struct Mixer_impl {
 	bool _adlPlaying;
 #endif
 
-	void init(MixerType mixerType) {
+	void init(MixerType mixerType, int rate, int bufferSize, SystemStub *stub, bool offline, const char *wavPath) {
+		kMixFreq = rate;
+		memset(&_stats, 0, sizeof(_stats));
+		_stats.offlineHash = kHashInit;
+		_callbackCounter = 0;
+		_offline = offline;
+		_stub = stub;
+		_offlineTimeStamp = stub->getTimeStamp();
+		_offlineFrames = 0;
+		_wavFile = 0;
+		_musicHook = 0;
+		_musicHookData = 0;
+		_postMix = 0;
+		_postMixData = 0;
 		memset(_sounds, 0, sizeof(_sounds));
 		_music = 0;
 		memset(_channels, 0, sizeof(_channels));
 		for (int i = 0; i < kMixChannels; ++i) {
 			_channels[i]._mixWav = &MixerChannel::mixWav<8, false>;
+			_channels[i]._tableVolume = -1;
 		}
 		_sfx = 0;
+		_soundCache = new SoundCache(&_stats);
+		memset(_aiffEntries, 0, sizeof(_aiffEntries));
 #ifdef USE_MT32EMU
 		_mt32 = 0;
+		_mt32Renderer = 0;
 #endif
 		_mixerType = mixerType;
+		_commandsHead = _commandsTail = 0;
+		_callbackTimeStamp = SDL_GetTicks();
 
 		int flags = 0;
 		switch (mixerType) {
@@ -287,43 +746,52 @@ struct Mixer_impl {
 			break;
 		}
 		Mix_Init(flags);
+		if (_offline) {
+			_audioDevice = 0;
+			if (wavPath) {
+				openWav(wavPath);
+			}
+			debug(DBG_INFO, "Audio rendered offline at %d Hz", kMixFreq);
+		} else {
 #if SDL_VERSIONNUM(SDL_MIXER_MAJOR_VERSION, SDL_MIXER_MINOR_VERSION, SDL_MIXER_PATCHLEVEL) >= SDL_VERSIONNUM(2,0,2)
-		const SDL_version *link_version = Mix_Linked_Version();
-		if (SDL_VERSIONNUM(link_version->major, link_version->minor, link_version->patch) >= SDL_VERSIONNUM(2,0,2)) {
-			if (Mix_OpenAudioDevice(kMixFreq, kMixFormat, kMixSoundChannels, kMixBufSize, NULL, SDL_AUDIO_ALLOW_ANY_CHANGE & ~(SDL_AUDIO_ALLOW_FORMAT_CHANGE | SDL_AUDIO_ALLOW_CHANNELS_CHANGE)) < 0) {
-				warning("Mix_OpenAudio failed: %s", Mix_GetError());
-			} else {
-				Mix_QuerySpec(&kMixFreq, NULL, NULL);
+			const SDL_version *link_version = Mix_Linked_Version();
+			if (SDL_VERSIONNUM(link_version->major, link_version->minor, link_version->patch) >= SDL_VERSIONNUM(2,0,2)) {
+				if (Mix_OpenAudioDevice(kMixFreq, kMixFormat, kMixSoundChannels, bufferSize, NULL, SDL_AUDIO_ALLOW_ANY_CHANGE & ~(SDL_AUDIO_ALLOW_FORMAT_CHANGE | SDL_AUDIO_ALLOW_CHANNELS_CHANGE)) < 0) {
+					warning("Mix_OpenAudio failed: %s", Mix_GetError());
+				} else {
+					Mix_QuerySpec(&kMixFreq, NULL, NULL);
+				}
 			}
-		}
-		else
+			else
 #endif
-		if (Mix_OpenAudio(kMixFreq, kMixFormat, kMixSoundChannels, kMixBufSize) < 0) {
-			warning("Mix_OpenAudio failed: %s", Mix_GetError());
-		}
-		_audioDevice = 0;
-		for (int i = 16; i >= 1; --i) {
-			if (SDL_GetAudioDeviceStatus(i) != SDL_AUDIO_STOPPED) {
-				_audioDevice = i;
-				break;
+			if (Mix_OpenAudio(kMixFreq, kMixFormat, kMixSoundChannels, bufferSize) < 0) {
+				warning("Mix_OpenAudio failed: %s", Mix_GetError());
 			}
+			_audioDevice = 0;
+			for (int i = 16; i >= 1; --i) {
+				if (SDL_GetAudioDeviceStatus(i) != SDL_AUDIO_STOPPED) {
+					_audioDevice = i;
+					break;
+				}
+			}
+			debug(DBG_INFO, "Audio output %d Hz, %d frames buffer (%d ms)", kMixFreq, bufferSize, bufferSize * 1000 / kMixFreq);
 		}
 		switch (mixerType) {
 		case kMixerTypeRaw:
-			Mix_HookMusic(mixAudio, this);
+			hookMusic(mixAudio, this);
 			break;
 		case kMixerTypeMac:
-			Mix_HookMusic(mixAudioMac, this);
+			hookMusic(mixAudioMac, this);
 			break;
 		case kMixerTypeWavMidi:
 #ifdef USE_LIBADLMIDI
 			initAdlMidi();
-			Mix_HookMusic(mixAudioAdlMidi, this);
+			hookMusic(mixAudioAdlMidi, this);
 #endif
 			/* fall-through */
 		case kMixerTypeWav:
 		case kMixerTypeWavOgg:
-			Mix_SetPostMix(mixAudioWav, this);
+			setPostMix(mixAudioWav, this);
 			break;
 		case kMixerTypeAiff:
 			Mix_AllocateChannels(kMixChannels);
@@ -338,10 +806,16 @@ struct Mixer_impl {
 				mt32emu_set_stereo_output_samplerate(_mt32, kMixFreq);
 				mt32emu_open_synth(_mt32);
 				mt32emu_set_midi_delay_mode(_mt32, MT32EMU_MDM_IMMEDIATE);
+				// rendered on a thread one buffer ahead of the audio callback, which only copies the samples.
+				// Offline, the synth is rendered synchronously and the output does not depend on the threads timing
+				if (_audioDevice) {
+					_mt32Renderer = new Mt32Renderer(_mt32, bufferSize);
+					_stats.mt32Lookahead = bufferSize;
+				}
 			}
-			Mix_HookMusic(mixAudioMt32, this);
+			hookMusic(mixAudioMt32, this);
 #else
-			Mix_HookMusic(mixAudio, this);
+			hookMusic(mixAudio, this);
 #endif
 			break;
 		}
@@ -350,10 +824,20 @@ struct Mixer_impl {
 		stopAll();
 #ifdef USE_MT32EMU
 		if (_mixerType == kMixerTypeMt32) {
+			lockAudio();
+			delete _mt32Renderer;
+			_mt32Renderer = 0;
+			unlockAudio();
 			mt32emu_close_synth(_mt32);
 			mt32emu_free_context(_mt32);
 		}
 #endif
+		if (_offline) {
+			renderOffline(_stub->getTimeStamp());
+			closeWav();
+		}
+		delete _soundCache;
+		_soundCache = 0;
 		Mix_CloseAudio();
 		Mix_Quit();
 #ifdef USE_LIBADLMIDI
@@ -406,17 +890,119 @@ struct Mixer_impl {
 	}
 #endif
 
+	void hookMusic(void (*proc)(void *, uint8_t *, int), void *data) {
+		if (_offline) {
+			lockAudio();
+			_musicHook = proc;
+			_musicHookData = data;
+			unlockAudio();
+		} else {
+			Mix_HookMusic(proc, data);
+		}
+	}
+	void setPostMix(void (*proc)(void *, uint8_t *, int), void *data) {
+		if (_offline) {
+			_postMix = proc;
+			_postMixData = data;
+		} else {
+			Mix_SetPostMix(proc, data);
+		}
+	}
+
+	void openWav(const char *path) {
+		_wavFile = new File;
+		if (!_wavFile->openForWriting(path)) {
+			warning("Unable to write audio to '%s'", path);
+			delete _wavFile;
+			_wavFile = 0;
+			return;
+		}
+		// the sizes are set when closing
+		_wavFile->writeUint32LE(TAG_RIFF);
+		_wavFile->writeUint32LE(0);
+		_wavFile->writeUint32LE(TAG_WAVE);
+		_wavFile->writeUint32LE(TAG_fmt);
+		_wavFile->writeUint32LE(16);
+		_wavFile->writeUint16LE(1); // PCM
+		_wavFile->writeUint16LE(kMixSoundChannels);
+		_wavFile->writeUint32LE(kMixFreq);
+		_wavFile->writeUint32LE(kMixFreq * kMixSoundChannels * sizeof(int16_t));
+		_wavFile->writeUint16LE(kMixSoundChannels * sizeof(int16_t));
+		_wavFile->writeUint16LE(16);
+		_wavFile->writeUint32LE(TAG_data);
+		_wavFile->writeUint32LE(0);
+	}
+	void closeWav() {
+		if (_wavFile) {
+			const uint32_t dataSize = _offlineFrames * kMixSoundChannels * sizeof(int16_t);
+			_wavFile->seek(4);
+			_wavFile->writeUint32LE(36 + dataSize);
+			_wavFile->seek(40);
+			_wavFile->writeUint32LE(dataSize);
+			if (_wavFile->ioErr()) {
+				warning("I/O error writing audio output");
+			}
+			_wavFile->close();
+			delete _wavFile;
+			_wavFile = 0;
+		}
+	}
+
+	// calls the hooks as the audio device does, len is in bytes
+	void mixHooks(int16_t *samples, int len) {
+		memset(samples, 0, len);
+		if (_musicHook) {
+			_musicHook(_musicHookData, (uint8_t *)samples, len);
+		}
+		if (_postMix) {
+			_postMix(_postMixData, (uint8_t *)samples, len);
+		}
+	}
+
+	// renders the samples from the last call up to timeStamp (game clock)
+	void renderOffline(uint32_t timeStamp) {
+		const uint64_t frames = (uint64_t)(timeStamp - _offlineTimeStamp) * kMixFreq / 1000;
+		if (_offlineFrames >= frames) {
+			return;
+		}
+		const uint64_t counter = SDL_GetPerformanceCounter();
+		int16_t samples[kMixBlockSize * kMixSoundChannels];
+		uint8_t le[kMixBlockSize * kMixSoundChannels * sizeof(int16_t)];
+		while (_offlineFrames < frames) {
+			const int count = MIN<uint64_t>(frames - _offlineFrames, kMixBlockSize) * kMixSoundChannels;
+			const int len = count * sizeof(int16_t);
+			mixHooks(samples, len);
+			for (int i = 0; i < count; ++i) {
+				le[i * 2] = samples[i] & 255;
+				le[i * 2 + 1] = ((uint16_t)samples[i]) >> 8;
+			}
+			_stats.offlineHash = HASH_DATA(_stats.offlineHash, le, len);
+			if (_wavFile) {
+				_wavFile->write(le, len);
+			}
+			_offlineFrames += count / kMixSoundChannels;
+		}
+		_stats.offlineFrames = _offlineFrames;
+		_stats.offlineTotal += (SDL_GetPerformanceCounter() - counter) * 1000000 / SDL_GetPerformanceFrequency();
+	}
+
 	void update() {
 		for (int i = 0; i < kMixChannels; ++i) {
 			if (_sounds[i] && !Mix_Playing(i)) {
 				freeSound(i);
 			}
+			if (_aiffEntries[i] && !Mix_Playing(i)) {
+				releaseAiff(i);
+			}
 		}
 	}
 
 	void lockAudio() {
 		if (_audioDevice) {
 			SDL_LockAudioDevice(_audioDevice);
+		} else if (_offline) {
+			// the samples up to now are rendered with the current state
+			renderOffline(_stub->getTimeStamp());
 		}
 	}
 
@@ -426,17 +1012,140 @@ struct Mixer_impl {
 		}
 	}
 
+	bool pushCommand(MixerCommand &cmd) {
+		if (!_audioDevice) {
+			// no callback to consume the queue
+			lockAudio();
+			applyCommand(cmd);
+			unlockAudio();
+			return true;
+		}
+		const uint32_t tail = _commandsTail.load(std::memory_order_relaxed);
+		if (tail - _commandsHead.load(std::memory_order_acquire) == kCommandsSize) {
+			warning("Mixer command queue is full, dropping command %d", cmd.type);
+			return false;
+		}
+		cmd.timeStamp = SDL_GetTicks();
+		_commands[tail & (kCommandsSize - 1)] = cmd;
+		_commandsTail.store(tail + 1, std::memory_order_release);
+		return true;
+	}
+
+	void applyCommand(const MixerCommand &cmd) {
+		switch (cmd.type) {
+		case MixerCommand::kPlayRaw:
+			_channels[cmd.channel].release();
+			_channels[cmd.channel].initRaw(cmd.data, cmd.freq, cmd.volume, kMixFreq);
+			break;
+		case MixerCommand::kPlayMac:
+			_channels[cmd.channel].release();
+			_channels[cmd.channel].initMac(cmd.data, cmd.freq, cmd.volume, kMixFreq);
+			break;
+		case MixerCommand::kPlayWav:
+			_channels[cmd.channel].release();
+			if (cmd.entry) {
+				// the reference taken by playSoundWav() is now held by the channel
+				_channels[cmd.channel].initCached(cmd.entry, cmd.volume, cmd.loop);
+			} else {
+				_channels[cmd.channel].initWav(cmd.data, cmd.freq, cmd.volume, kMixFreq, cmd.len, cmd.bits16, cmd.stereo, cmd.loop);
+			}
+			break;
+		case MixerCommand::kStop:
+			_channels[cmd.channel]._data = 0;
+			_channels[cmd.channel].release();
+			break;
+		case MixerCommand::kSetVolume:
+			_channels[cmd.channel]._volume = cmd.volume;
+			break;
+		case MixerCommand::kPlayMt32:
+			playSoundMt32(cmd.num);
+			break;
+		case MixerCommand::kStopMt32:
+			stopSoundMt32();
+			break;
+		case MixerCommand::kPlaySfx:
+			_sfx = cmd.sfx;
+			// the music loaded by playSfxMusic() is now owned by the player
+			_sfx->play(kMixFreq, cmd.music);
+			break;
+		case MixerCommand::kSetSfxDelay:
+			cmd.sfx->setEventsDelay(cmd.delay);
+			break;
+		case MixerCommand::kStopSfx:
+			if (_sfx) {
+				_sfx->stop();
+				_sfx = 0;
+			}
+			break;
+		}
+	}
+
+	// renders the buffer in runs, each command is applied at the offset of its timestamp in the
+	// previous callback period : the latency is one buffer but the spacing of the sounds is kept
+	void mixCommands(int16_t *samples, int count, void (Mixer_impl::*mixProc)(int16_t *, int)) {
+		if (_offline) {
+			(this->*mixProc)(samples, count);
+			return;
+		}
+		const uint64_t counter = SDL_GetPerformanceCounter();
+		const uint64_t counterFreq = SDL_GetPerformanceFrequency();
+		const uint64_t period = (uint64_t)count / 2 * counterFreq / kMixFreq;
+		if (_callbackCounter != 0 && counter - _callbackCounter > period + period / 2) {
+			// the device most likely ran out of samples
+			++_stats.lateCallbacks;
+		}
+		_callbackCounter = counter;
+		const uint32_t startTimeStamp = _callbackTimeStamp;
+		_callbackTimeStamp = SDL_GetTicks();
+		const int bufferMs = count / 2 * 1000 / kMixFreq;
+		int pos = 0;
+		uint32_t head = _commandsHead.load(std::memory_order_relaxed);
+		const uint32_t tail = _commandsTail.load(std::memory_order_acquire);
+		for (; head != tail; ++head) {
+			const MixerCommand &cmd = _commands[head & (kCommandsSize - 1)];
+			const int delta = (int32_t)(cmd.timeStamp - startTimeStamp);
+			if (delta > 0) {
+				const int offset = MIN<int64_t>((int64_t)delta * kMixFreq / 1000 * 2, count);
+				if (offset > pos) {
+					(this->*mixProc)(samples + pos, offset - pos);
+					pos = offset;
+				}
+			}
+			applyCommand(cmd);
+			_commandsHead.store(head + 1, std::memory_order_release);
+			// the sample is output once the samples queued before this buffer are played
+			const uint32_t latency = _callbackTimeStamp - cmd.timeStamp + (pos / 2) * 1000 / kMixFreq + bufferMs;
+			++_stats.commands;
+			_stats.latencyTotal += latency;
+			_stats.latencyMax = MAX(_stats.latencyMax, latency);
+		}
+		if (pos < count) {
+			(this->*mixProc)(samples + pos, count - pos);
+		}
+		const uint64_t duration = (SDL_GetPerformanceCounter() - counter) * 1000000 / counterFreq;
+		++_stats.callbacks;
+		_stats.callbackTotal += duration;
+		_stats.callbackMax = MAX(_stats.callbackMax, duration);
+		_stats.bufferUs = (uint64_t)count / 2 * 1000000 / kMixFreq;
+	}
+
 	void playSoundRaw(uint8_t channel, const uint8_t *data, int freq, uint8_t volume) {
-		lockAudio();
-		_channels[channel].initRaw(data, freq, volume, kMixFreq);
-		unlockAudio();
+		MixerCommand cmd(MixerCommand::kPlayRaw);
+		cmd.channel = channel;
+		cmd.data = data;
+		cmd.freq = freq;
+		cmd.volume = volume;
+		pushCommand(cmd);
 	}
 	void playSoundMac(uint8_t channel, const uint8_t *data, int freq, uint8_t volume) {
-		lockAudio();
-		_channels[channel].initMac(data, freq, volume, kMixFreq);
-		unlockAudio();
+		MixerCommand cmd(MixerCommand::kPlayMac);
+		cmd.channel = channel;
+		cmd.data = data;
+		cmd.freq = freq;
+		cmd.volume = volume;
+		pushCommand(cmd);
 	}
-	void playSoundWav(uint8_t channel, const uint8_t *data, int freq, uint8_t volume, bool loop) {
+	void playSoundWav(uint8_t channel, uint16_t num, const uint8_t *data, int freq, uint8_t volume, bool loop) {
 		int wavFreq, len;
 		bool bits16, stereo;
 		const uint8_t *wavData = loadWav(data, wavFreq, len, bits16, stereo);
@@ -446,9 +1155,19 @@ struct Mixer_impl {
 			freq = (int)(freq * (wavFreq / 9943.0f));
 		}
 
-		lockAudio();
-		_channels[channel].initWav(wavData, freq, volume, kMixFreq, len, bits16, stereo, loop);
-		unlockAudio();
+		MixerCommand cmd(MixerCommand::kPlayWav);
+		cmd.channel = channel;
+		cmd.data = wavData;
+		cmd.freq = freq;
+		cmd.volume = volume;
+		cmd.len = len;
+		cmd.bits16 = bits16;
+		cmd.stereo = stereo;
+		cmd.loop = loop;
+		cmd.entry = _soundCache->getWav(num, wavData, freq, kMixFreq, len, bits16, stereo);
+		if (!pushCommand(cmd) && cmd.entry) {
+			cmd.entry->refs.fetch_sub(1, std::memory_order_release);
+		}
 	}
 	void playSound(uint8_t channel, int volume, Mix_Chunk *chunk, int loops = 0) {
 		stopSound(channel);
@@ -460,11 +1179,12 @@ struct Mixer_impl {
 	}
 	void stopSound(uint8_t channel) {
 		if (_mixerType == kMixerTypeMt32) {
-			stopSoundMt32();
+			MixerCommand cmd(MixerCommand::kStopMt32);
+			pushCommand(cmd);
 		}
-		lockAudio();
-		_channels[channel]._data = 0;
-		unlockAudio();
+		MixerCommand cmd(MixerCommand::kStop);
+		cmd.channel = channel;
+		pushCommand(cmd);
 		Mix_HaltChannel(channel);
 		freeSound(channel);
 	}
@@ -476,6 +1196,15 @@ struct Mixer_impl {
 		}
 		return 0;
 	}
+#ifdef USE_MT32EMU
+	void playMsgMt32(uint32_t msg) {
+		if (_mt32Renderer) {
+			_mt32Renderer->postMessage(msg);
+		} else {
+			mt32emu_play_msg(_mt32, msg);
+		}
+	}
+#endif
 	void playSoundMt32(int num) {
 #ifdef USE_MT32EMU
 		const uint8_t *data = findMt32Sound(num);
@@ -486,18 +1215,18 @@ struct Mixer_impl {
 				uint32_t noteOn = 0x99;
 				noteOn |= ABS(note) << 8;
 				noteOn |= 0x7f << 16;
-				mt32emu_play_msg(_mt32, noteOn);
+				playMsgMt32(noteOn);
 
 				uint32_t pitchBend = 0xe9;
 				pitchBend |= (READ_LE_UINT16(data) & 0x7f) << 8;
 				pitchBend |= (0x3f80 >> 7) << 16;
-				mt32emu_play_msg(_mt32, pitchBend);
+				playMsgMt32(pitchBend);
 
 				if (note < 0) {
 					uint32_t noteVel = 0x99;
 					noteVel |= ABS(note) << 8;
 					noteVel |= 0 << 16;
-					mt32emu_play_msg(_mt32, noteVel);
+					playMsgMt32(noteVel);
 				}
 			}
 		}
@@ -508,7 +1237,7 @@ struct Mixer_impl {
 		uint32_t controlChange = 0xb9;
 		controlChange |= 0x7b << 8;
 		controlChange |= 0 << 16;
-		mt32emu_play_msg(_mt32, controlChange);
+		playMsgMt32(controlChange);
 #endif
 	}
 	void freeSound(int channel) {
@@ -516,9 +1245,10 @@ struct Mixer_impl {
 		_sounds[channel] = 0;
 	}
 	void setChannelVolume(uint8_t channel, uint8_t volume) {
-		lockAudio();
-		_channels[channel]._volume = volume;
-		unlockAudio();
+		MixerCommand cmd(MixerCommand::kSetVolume);
+		cmd.channel = channel;
+		cmd.volume = volume;
+		pushCommand(cmd);
 		Mix_Volume(channel, volume * MIX_MAX_VOLUME / 63);
 	}
 
@@ -538,6 +1268,10 @@ struct Mixer_impl {
 			return;
 		}
 #endif
+		if (_offline) {
+			debug(DBG_SND, "Music '%s' is not rendered offline", path);
+			return;
+		}
 		_music = Mix_LoadMUS(path);
 		if (_music) {
 			if (_mixerType == kMixerTypeWavMidi) {
@@ -571,150 +1305,239 @@ struct Mixer_impl {
 		((AifcPlayer *)data)->readSamples((int16_t *)s16buf, len / 2);
 	}
 	void playAifcMusic(AifcPlayer *aifc) {
-		Mix_HookMusic(mixAifcPlayer, aifc);
+		hookMusic(mixAifcPlayer, aifc);
 	}
 	void stopAifcMusic() {
-		Mix_HookMusic(0, 0);
+		hookMusic(0, 0);
 	}
 
-	void playSfxMusic(SfxPlayer *sfx) {
-		lockAudio();
-		_sfx = sfx;
-		_sfx->play(kMixFreq);
-		unlockAudio();
+	void playSfxMusic(SfxPlayer *sfx, int num, uint16_t delay, uint8_t pos) {
+		// the resources are read here, not in the audio callback
+		SfxMusic *music = sfx->loadSfxModule(num, delay, pos, kMixFreq);
+		if (!music) {
+			stopSfxMusic();
+			return;
+		}
+		MixerCommand cmd(MixerCommand::kPlaySfx);
+		cmd.sfx = sfx;
+		cmd.music = music;
+		if (!pushCommand(cmd)) {
+			sfx->releaseMusic(music);
+		}
+	}
+	void setSfxMusicDelay(SfxPlayer *sfx, uint16_t delay) {
+		MixerCommand cmd(MixerCommand::kSetSfxDelay);
+		cmd.sfx = sfx;
+		cmd.delay = delay;
+		pushCommand(cmd);
 	}
 	void stopSfxMusic() {
-		lockAudio();
-		if (_sfx) {
-			_sfx->stop();
-			_sfx = 0;
-		}
-		unlockAudio();
+		MixerCommand cmd(MixerCommand::kStopSfx);
+		pushCommand(cmd);
 	}
 
-	void mixChannels(int16_t *samples, int count) {
-		if (kAmigaStereoChannels) {
-			for (int i = 0; i < count; i += 2) {
-				_channels[0].mixRaw(*samples);
-				_channels[3].mixRaw(*samples);
-				++samples;
-				_channels[1].mixRaw(*samples);
-				_channels[2].mixRaw(*samples);
-				++samples;
+	void mixChannels(int16_t *samples, int count, int xorMask = 0x80) {
+		// each channel renders a block of samples before the next one
+		while (count > 0) {
+			const int len = MIN(count / 2, (int)kMixBlockSize);
+			if (len <= 0) {
+				break;
 			}
-		}  else {
-			for (int i = 0; i < count; i += 2) {
+			if (kAmigaStereoChannels) {
+				int32_t *left = _mixBuf;
+				int32_t *right = _mixBuf + kMixBlockSize;
+				for (int i = 0; i < len; ++i) {
+					left[i] = samples[i * 2];
+					right[i] = samples[i * 2 + 1];
+				}
+				_channels[0].mixRaw(left, len, xorMask);
+				_channels[3].mixRaw(left, len, xorMask);
+				_channels[1].mixRaw(right, len, xorMask);
+				_channels[2].mixRaw(right, len, xorMask);
+				for (int i = 0; i < len; ++i) {
+					samples[i * 2] = mixS16(left[i], 0);
+					samples[i * 2 + 1] = mixS16(right[i], 0);
+				}
+			} else {
+				for (int i = 0; i < len; ++i) {
+					_mixBuf[i] = samples[i * 2];
+				}
 				for (int j = 0; j < kMixChannels; ++j) {
-					_channels[j].mixRaw(samples[i]);
+					_channels[j].mixRaw(_mixBuf, len, xorMask);
 				}
-				samples[i + 1] = samples[i];
+				packS16Mono(_mixBuf, samples, len);
 			}
+			samples += len * 2;
+			count -= len * 2;
+		}
+	}
+
+	void mixChannelsRaw(int16_t *samples, int count) {
+		mixChannels(samples, count);
+		if (_sfx) {
+			_sfx->readSamples(samples, count);
 		}
 	}
 
 	static void mixAudio(void *data, uint8_t *s16buf, int len) {
 		memset(s16buf, 0, len);
 		Mixer_impl *mixer = (Mixer_impl *)data;
-		mixer->mixChannels((int16_t *)s16buf, len / sizeof(int16_t));
-		if (mixer->_sfx) {
-			mixer->_sfx->readSamples((int16_t *)s16buf, len / sizeof(int16_t));
-		}
+		mixer->mixCommands((int16_t *)s16buf, len / sizeof(int16_t), &Mixer_impl::mixChannelsRaw);
 	}
 
 	void mixChannelsMac(int16_t *samples, int count) {
-		for (int i = 0; i < count; i += 2) {
-			for (int j = 0; j < kMixChannels; ++j) {
-				_channels[j].mixMac(samples[i]);
-			}
-			samples[i + 1] = samples[i];
+		mixChannels(samples, count, 0);
+		if (_sfx) {
+			_sfx->readSamples(samples, count);
 		}
 	}
 
 	static void mixAudioMac(void *data, uint8_t *s16buf, int len) {
 		memset(s16buf, 0, len);
 		Mixer_impl *mixer = (Mixer_impl *)data;
-		mixer->mixChannelsMac((int16_t *)s16buf, len / sizeof(int16_t));
-		if (mixer->_sfx) {
-			mixer->_sfx->readSamples((int16_t *)s16buf, len / sizeof(int16_t));
-		}
+		mixer->mixCommands((int16_t *)s16buf, len / sizeof(int16_t), &Mixer_impl::mixChannelsMac);
 	}
 
 	void mixChannelsWav(int16_t *samples, int count) {
-		for (int i = 0; i < kMixChannels; ++i) {
-			if (_channels[i]._data) {
-				(_channels[i].*_channels[i]._mixWav)(samples, count);
+		while (count > 0) {
+			const int len = MIN(count, (int)kMixBlockSize * 2);
+			unpackS16(samples, _mixBuf, len);
+			for (int i = 0; i < kMixChannels; ++i) {
+				if (_channels[i]._data) {
+					(_channels[i].*_channels[i]._mixWav)(_mixBuf, len);
+					if (!_channels[i]._data) {
+						_channels[i].release();
+					}
+				}
 			}
+			packS16(_mixBuf, samples, len);
+			samples += len;
+			count -= len;
 		}
 	}
 
 	static void mixAudioWav(void *data, uint8_t *s16buf, int len) {
 		Mixer_impl *mixer = (Mixer_impl *)data;
-		mixer->mixChannelsWav((int16_t *)s16buf, len / sizeof(int16_t));
+		mixer->mixCommands((int16_t *)s16buf, len / sizeof(int16_t), &Mixer_impl::mixChannelsWav);
 	}
 
 #ifdef USE_MT32EMU
+	void mixChannelsMt32(int16_t *samples, int count) {
+		if (_mt32Renderer) {
+			const int frames = _mt32Renderer->read(samples, count / 2);
+			if (frames < count / 2) {
+				memset(samples + frames * 2, 0, (count - frames * 2) * sizeof(int16_t));
+				++_stats.mt32Underruns;
+			}
+		} else {
+			mt32emu_render_bit16s(_mt32, samples, count / 2);
+		}
+		mixChannelsRaw(samples, count);
+	}
+
 	static void mixAudioMt32(void *data, uint8_t *s16buf, int len) {
 		Mixer_impl *mixer = (Mixer_impl *)data;
-		mt32emu_render_bit16s(mixer->_mt32, (int16_t *)s16buf, len / (2 * sizeof(int16_t)));
-		mixer->mixChannels((int16_t *)s16buf, len / sizeof(int16_t));
-		if (mixer->_sfx) {
-			mixer->_sfx->readSamples((int16_t *)s16buf, len / sizeof(int16_t));
-		}
+		mixer->mixCommands((int16_t *)s16buf, len / sizeof(int16_t), &Mixer_impl::mixChannelsMt32);
 	}
 #endif
 
 	void stopAll() {
+		// synchronous, the resources are released right after : the pending commands are discarded
+		lockAudio();
+		uint32_t head = _commandsHead.load(std::memory_order_relaxed);
+		const uint32_t tail = _commandsTail.load(std::memory_order_relaxed);
+		for (; head != tail; ++head) {
+			const MixerCommand &cmd = _commands[head & (kCommandsSize - 1)];
+			if (cmd.entry) {
+				cmd.entry->refs.fetch_sub(1, std::memory_order_release);
+			}
+			if (cmd.music) {
+				cmd.sfx->releaseMusic(cmd.music);
+			}
+		}
+		_commandsHead.store(tail, std::memory_order_release);
 		for (int i = 0; i < kMixChannels; ++i) {
-			stopSound(i);
+			_channels[i]._data = 0;
+			_channels[i].release();
 		}
+		if (_sfx) {
+			_sfx->stop();
+			_sfx = 0;
+		}
+		if (_mixerType == kMixerTypeMt32) {
+			stopSoundMt32();
+		}
+		unlockAudio();
+		for (int i = 0; i < kMixChannels; ++i) {
+			Mix_HaltChannel(i);
+			freeSound(i);
+			releaseAiff(i);
+		}
+		_soundCache->releaseResources();
 		stopMusic();
-		stopSfxMusic();
 		if (_mixerType == kMixerTypeAiff) {
 			stopAifcMusic();
 		}
-		for (std::map<int, Mix_Chunk *>::iterator it = _preloads.begin(); it != _preloads.end(); ++it) {
-			debug(DBG_SND, "Flush preload %d", it->first);
-			Mix_FreeChunk(it->second);
+	}
+
+	void releaseAiff(int channel) {
+		if (_aiffEntries[channel]) {
+			_aiffEntries[channel]->refs.fetch_sub(1, std::memory_order_release);
+			_aiffEntries[channel] = 0;
 		}
-		_preloads.clear();
 	}
 
 	void preloadSoundAiff(int num, const uint8_t *data) {
-		if (_preloads.find(num) != _preloads.end()) {
-			warning("AIFF sound %d is already preloaded", num);
-		} else {
-			const uint32_t size = READ_BE_UINT32(data + 4) + 8;
-			SDL_RWops *rw = SDL_RWFromConstMem(data, size);
-			Mix_Chunk *chunk = Mix_LoadWAV_RW(rw, 0);
-			rw->close(rw);
-			_preloads[num] = chunk;
+		if (_offline) {
+			// played by SDL_mixer channels, not rendered offline
+			return;
 		}
+		_soundCache->preloadAiff(num, data);
 	}
 
 	void playSoundAiff(int channel, int num, int volume) {
-		if (_preloads.find(num) == _preloads.end()) {
+		if (_offline) {
+			return;
+		}
+		SoundCacheEntry *entry = _soundCache->find(SoundCacheEntry::kTypeAiff, num);
+		if (!entry) {
 			warning("AIFF sound %d is not preloaded", num);
 		} else {
-			Mix_Chunk *chunk = _preloads[num];
-			Mix_PlayChannelTimed(channel, chunk, 0, -1);
+			Mix_PlayChannelTimed(channel, entry->chunk, 0, -1);
 			Mix_Volume(channel, volume * MIX_MAX_VOLUME / 63);
+			entry->refs.fetch_add(1, std::memory_order_relaxed);
+			releaseAiff(channel);
+			_aiffEntries[channel] = entry;
 		}
 	}
 };
 
 Mixer::Mixer(SfxPlayer *sfx)
-	: _aifc(0), _sfx(sfx) {
+	: _aifc(0), _sfx(sfx), _impl(0), _rate(kDefaultRate), _bufferSize(kDefaultBufferSize), _printStats(false), _offline(false), _wavPath(0) {
+}
+
+void Mixer::setAudioFormat(int rate, int bufferSize) {
+	_rate = rate;
+	_bufferSize = bufferSize;
 }
 
-void Mixer::init(MixerType mixerType) {
+void Mixer::setOffline(const char *wavPath) {
+	_offline = true;
+	_wavPath = wavPath;
+}
+
+void Mixer::init(MixerType mixerType, SystemStub *stub) {
 	_impl = new Mixer_impl();
-	_impl->init(mixerType);
+	_impl->init(mixerType, _rate, _bufferSize, stub, _offline, _wavPath);
 }
 
 void Mixer::quit() {
 	stopAll();
 	if (_impl) {
 		_impl->quit();
+		if (_printStats) {
+			dumpStats(&_impl->_stats);
+		}
 		delete _impl;
 	}
 	delete _aifc;
@@ -723,7 +1546,37 @@ void Mixer::quit() {
 void Mixer::update() {
 	if (_impl) {
 		_impl->update();
+		if (_impl->_offline) {
+			_impl->renderOffline(_impl->_stub->getTimeStamp());
+		}
+	}
+}
+
+void Mixer::mixSamples(int16_t *buf, int len) {
+	if (_impl && _impl->_offline) {
+		_impl->mixHooks(buf, len * sizeof(int16_t));
+	}
+}
+
+void Mixer::dumpStats(const MixerStats *stats) {
+	// the device rate, SDL_mixer may not open the requested one
+	fprintf(stdout, "Audio %d Hz, buffer %d frames (%llu us)\n", _impl->kMixFreq, _bufferSize, (unsigned long long)stats->bufferUs);
+	if (stats->callbacks != 0) {
+		fprintf(stdout, "  callbacks %u, average %llu us, max %llu us, late %u\n", stats->callbacks, (unsigned long long)(stats->callbackTotal / stats->callbacks), (unsigned long long)stats->callbackMax, stats->lateCallbacks);
+	}
+	if (stats->offlineFrames != 0) {
+		fprintf(stdout, "  offline %llu frames, rendered in %llu us, hash 0x%08X\n", (unsigned long long)stats->offlineFrames, (unsigned long long)stats->offlineTotal, stats->offlineHash);
+	}
+	if (stats->soundCacheHits + stats->soundCacheMisses != 0) {
+		fprintf(stdout, "  sounds cache %u hits, %u misses, max %u KB\n", stats->soundCacheHits, stats->soundCacheMisses, stats->soundCacheMax / 1024);
+	}
+	if (stats->mt32Lookahead != 0) {
+		fprintf(stdout, "  mt32 lookahead %u frames, underruns %u\n", stats->mt32Lookahead, stats->mt32Underruns);
+	}
+	if (stats->commands != 0) {
+		fprintf(stdout, "  commands %u, trigger to output latency average %llu ms, max %u ms\n", stats->commands, (unsigned long long)(stats->latencyTotal / stats->commands), stats->latencyMax);
 	}
+	fflush(stdout);
 }
 
 bool Mixer::hasMt32() const {
@@ -748,10 +1601,10 @@ void Mixer::playSoundMac(uint8_t channel, const uint8_t *data, uint16_t freq, ui
 	}
 }
 
-void Mixer::playSoundWav(uint8_t channel, const uint8_t *data, uint16_t freq, uint8_t volume, uint8_t loop) {
-	debug(DBG_SND, "Mixer::playSoundWav(%d, %d, %d)", channel, volume, loop);
+void Mixer::playSoundWav(uint8_t channel, uint16_t num, const uint8_t *data, uint16_t freq, uint8_t volume, uint8_t loop) {
+	debug(DBG_SND, "Mixer::playSoundWav(%d, %d, %d, %d)", channel, num, volume, loop);
 	if (_impl) {
-		return _impl->playSoundWav(channel, data, freq, volume, loop);
+		return _impl->playSoundWav(channel, num, data, freq, volume, loop);
 	}
 }
 
@@ -765,7 +1618,9 @@ void Mixer::stopSound(uint8_t channel) {
 void Mixer::playSoundMt32(int num) {
 	debug(DBG_SND, "Mixer::playSoundMt32(%d)", num);
 	if (_impl) {
-		return _impl->playSoundMt32(num);
+		MixerCommand cmd(MixerCommand::kPlayMt32);
+		cmd.num = num;
+		_impl->pushCommand(cmd);
 	}
 }
 
@@ -811,10 +1666,17 @@ void Mixer::stopAifcMusic() {
 	}
 }
 
-void Mixer::playSfxMusic(int num) {
-	debug(DBG_SND, "Mixer::playSfxMusic(%d)", num);
+void Mixer::playSfxMusic(int num, uint16_t delay, uint8_t pos) {
+	debug(DBG_SND, "Mixer::playSfxMusic(%d, %d, %d)", num, delay, pos);
+	if (_impl && _sfx) {
+		return _impl->playSfxMusic(_sfx, num, delay, pos);
+	}
+}
+
+void Mixer::setSfxMusicDelay(uint16_t delay) {
+	debug(DBG_SND, "Mixer::setSfxMusicDelay(%d)", delay);
 	if (_impl && _sfx) {
-		return _impl->playSfxMusic(_sfx);
+		return _impl->setSfxMusicDelay(_sfx, delay);
 	}
 }
 
@@ -11,6 +11,7 @@
 
 struct AifcPlayer;
 struct SfxPlayer;
+struct SystemStub;
 struct Mixer_impl;
 
 enum MixerType {
@@ -23,24 +24,55 @@ enum MixerType {
 	kMixerTypeMt32,
 };
 
+struct MixerStats {
+	uint32_t callbacks;
+	uint64_t callbackTotal, callbackMax; // us
+	uint32_t lateCallbacks; // started more than half a buffer after the expected time
+	uint64_t bufferUs;
+	uint32_t commands;
+	uint64_t latencyTotal; // ms
+	uint32_t latencyMax;
+	uint64_t offlineFrames;
+	uint64_t offlineTotal; // us
+	uint32_t offlineHash; // of the 16 bits little endian samples
+	uint32_t mt32Lookahead; // frames rendered ahead of the callback
+	uint32_t mt32Underruns;
+	uint32_t soundCacheHits, soundCacheMisses;
+	uint32_t soundCacheMax; // bytes
+};
+
 struct Mixer {
+	enum {
+		kDefaultRate = 44100,
+		kDefaultBufferSize = 4096 // frames
+	};
+
 	static const uint8_t _mt32SoundsTable[196];
 
 	AifcPlayer *_aifc;
 	SfxPlayer *_sfx;
 	Mixer_impl *_impl;
+	int _rate;
+	int _bufferSize;
+	bool _printStats;
+	bool _offline;
+	const char *_wavPath;
 
 	Mixer(SfxPlayer *sfx);
-	void init(MixerType mixerType);
+	void setAudioFormat(int rate, int bufferSize);
+	void setOffline(const char *wavPath);
+	void init(MixerType mixerType, SystemStub *stub);
 	void quit();
 	void update();
+	void mixSamples(int16_t *buf, int len); // offline only, stereo samples as requested by the audio device
+	void dumpStats(const MixerStats *stats);
 
 	bool hasMt32() const;
 	bool hasMt32SoundMapping(int num);
 
 	void playSoundRaw(uint8_t channel, const uint8_t *data, uint16_t freq, uint8_t volume);
 	void playSoundMac(uint8_t channel, const uint8_t *data, uint16_t freq, uint8_t volume);
-	void playSoundWav(uint8_t channel, const uint8_t *data, uint16_t freq, uint8_t volume, uint8_t loop);
+	void playSoundWav(uint8_t channel, uint16_t num, const uint8_t *data, uint16_t freq, uint8_t volume, uint8_t loop);
 	void stopSound(uint8_t channel);
 	void playSoundMt32(int num);
 	void setChannelVolume(uint8_t channel, uint8_t volume);
@@ -48,7 +80,8 @@ struct Mixer {
 	void stopMusic();
 	void playAifcMusic(const char *path, uint32_t offset);
 	void stopAifcMusic();
-	void playSfxMusic(int num);
+	void playSfxMusic(int num, uint16_t delay, uint8_t pos);
+	void setSfxMusicDelay(uint16_t delay);
 	void stopSfxMusic();
 	void stopAll();
 	void preloadSoundAiff(uint8_t num, const uint8_t *data);
@@ -36,6 +36,17 @@
 #include <arm_acle.h>
 #endif
 
+// the block functions only use the intrinsics also available on ARMv7
+#if defined(ARMV8) || defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define MIXER_NEON 1
+#endif
+
+#if defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#define MIXER_SSE2 1
+#endif
+
 static inline int16_t mixS16(int sample1, int sample2) {
 #if defined(ARMV8)
 	return vqmovns_s32(sample1 + sample2);
@@ -51,4 +62,104 @@ static inline int16_t mixS16(int sample1, int sample2) {
 #endif
 }
 
+// saturates the 32 bits accumulators to 16 bits samples
+static inline void packS16(const int32_t *src, int16_t *dst, int count) {
+	int i = 0;
+#if defined(MIXER_NEON)
+	for (; i + 8 <= count; i += 8) {
+		const int16x4_t lo = vqmovn_s32(vld1q_s32(src + i));
+		const int16x4_t hi = vqmovn_s32(vld1q_s32(src + i + 4));
+		vst1q_s16(dst + i, vcombine_s16(lo, hi));
+	}
+#elif defined(MIXER_SSE2)
+	for (; i + 8 <= count; i += 8) {
+		const __m128i lo = _mm_loadu_si128((const __m128i *)(src + i));
+		const __m128i hi = _mm_loadu_si128((const __m128i *)(src + i + 4));
+		_mm_storeu_si128((__m128i *)(dst + i), _mm_packs_epi32(lo, hi));
+	}
+#endif
+	for (; i < count; ++i) {
+		dst[i] = mixS16(src[i], 0);
+	}
+}
+
+// same as packS16, each mono sample is written to both stereo channels
+static inline void packS16Mono(const int32_t *src, int16_t *dst, int frames) {
+	int i = 0;
+#if defined(MIXER_NEON)
+	for (; i + 8 <= frames; i += 8) {
+		const int16x4_t lo = vqmovn_s32(vld1q_s32(src + i));
+		const int16x4_t hi = vqmovn_s32(vld1q_s32(src + i + 4));
+		const int16x8_t s = vcombine_s16(lo, hi);
+		const int16x8x2_t z = vzipq_s16(s, s);
+		vst1q_s16(dst + i * 2, z.val[0]);
+		vst1q_s16(dst + i * 2 + 8, z.val[1]);
+	}
+#elif defined(MIXER_SSE2)
+	for (; i + 8 <= frames; i += 8) {
+		const __m128i lo = _mm_loadu_si128((const __m128i *)(src + i));
+		const __m128i hi = _mm_loadu_si128((const __m128i *)(src + i + 4));
+		const __m128i s = _mm_packs_epi32(lo, hi);
+		_mm_storeu_si128((__m128i *)(dst + i * 2), _mm_unpacklo_epi16(s, s));
+		_mm_storeu_si128((__m128i *)(dst + i * 2 + 8), _mm_unpackhi_epi16(s, s));
+	}
+#endif
+	for (; i < frames; ++i) {
+		dst[i * 2] = dst[i * 2 + 1] = mixS16(src[i], 0);
+	}
+}
+
+// widens 16 bits samples to the 32 bits accumulators
+static inline void unpackS16(const int16_t *src, int32_t *dst, int count) {
+	int i = 0;
+#if defined(MIXER_NEON)
+	for (; i + 8 <= count; i += 8) {
+		const int16x8_t s = vld1q_s16(src + i);
+		vst1q_s32(dst + i, vmovl_s16(vget_low_s16(s)));
+		vst1q_s32(dst + i + 4, vmovl_s16(vget_high_s16(s)));
+	}
+#elif defined(MIXER_SSE2)
+	for (; i + 8 <= count; i += 8) {
+		const __m128i s = _mm_loadu_si128((const __m128i *)(src + i));
+		const __m128i sign = _mm_srai_epi16(s, 15);
+		_mm_storeu_si128((__m128i *)(dst + i), _mm_unpacklo_epi16(s, sign));
+		_mm_storeu_si128((__m128i *)(dst + i + 4), _mm_unpackhi_epi16(s, sign));
+	}
+#endif
+	for (; i < count; ++i) {
+		dst[i] = src[i];
+	}
+}
+
+// dot product of 16 signed 8 bits samples (xored with flip) and 16 coefficients
+static inline int dotS8x16(const uint8_t *p, const int16_t *coeffs, uint8_t flip) {
+#if defined(MIXER_NEON)
+	const int8x16_t b = veorq_s8(vreinterpretq_s8_u8(vld1q_u8(p)), vdupq_n_s8(flip));
+	const int16x8_t lo = vmovl_s8(vget_low_s8(b));
+	const int16x8_t hi = vmovl_s8(vget_high_s8(b));
+	int32x4_t sum = vmull_s16(vget_low_s16(lo), vld1_s16(coeffs));
+	sum = vmlal_s16(sum, vget_high_s16(lo), vld1_s16(coeffs + 4));
+	sum = vmlal_s16(sum, vget_low_s16(hi), vld1_s16(coeffs + 8));
+	sum = vmlal_s16(sum, vget_high_s16(hi), vld1_s16(coeffs + 12));
+	int32x2_t sum2 = vadd_s32(vget_low_s32(sum), vget_high_s32(sum));
+	sum2 = vpadd_s32(sum2, sum2);
+	return vget_lane_s32(sum2, 0);
+#elif defined(MIXER_SSE2)
+	const __m128i b = _mm_xor_si128(_mm_loadu_si128((const __m128i *)p), _mm_set1_epi8(flip));
+	const __m128i sign = _mm_cmplt_epi8(b, _mm_setzero_si128());
+	const __m128i lo = _mm_madd_epi16(_mm_unpacklo_epi8(b, sign), _mm_loadu_si128((const __m128i *)coeffs));
+	const __m128i hi = _mm_madd_epi16(_mm_unpackhi_epi8(b, sign), _mm_loadu_si128((const __m128i *)(coeffs + 8)));
+	__m128i sum = _mm_add_epi32(lo, hi);
+	sum = _mm_add_epi32(sum, _mm_shuffle_epi32(sum, _MM_SHUFFLE(1, 0, 3, 2)));
+	sum = _mm_add_epi32(sum, _mm_shuffle_epi32(sum, _MM_SHUFFLE(2, 3, 0, 1)));
+	return _mm_cvtsi128_si32(sum);
+#else
+	int sum = 0;
+	for (int i = 0; i < 16; ++i) {
+		sum += (int8_t)(p[i] ^ flip) * coeffs[i];
+	}
+	return sum;
+#endif
+}
+
 #endif
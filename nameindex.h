@@ -0,0 +1,70 @@
+
+#ifndef NAMEINDEX_H__
+#define NAMEINDEX_H__
+
+#include "intern.h"
+#include <ctype.h>
+#include <strings.h>
+#include <vector>
+
+// Open addressing hash table of the indexes of an entries array, T has a 'name' member.
+template <typename T, bool kNoCase>
+struct NameIndex {
+	std::vector<int> _slots; // -1 if free
+	uint32_t _mask;
+
+	NameIndex() : _mask(0) {}
+
+	static uint32_t hashName(const char *name) {
+		uint32_t hash = kHashInit;
+		for (; *name; ++name) {
+			const uint8_t c = kNoCase ? tolower((uint8_t)*name) : *name;
+			hash = (hash ^ c) * 0x01000193;
+		}
+		return hash;
+	}
+	static bool equals(const char *a, const char *b) {
+		return (kNoCase ? strcasecmp(a, b) : strcmp(a, b)) == 0;
+	}
+
+	void build(const T *entries, int count) {
+		uint32_t size = 16;
+		while (size < (uint32_t)count * 2) {
+			size <<= 1;
+		}
+		_mask = size - 1;
+		_slots.assign(size, -1);
+		for (int i = 0; i < count; ++i) {
+			if (entries[i].name[0] == 0) {
+				continue;
+			}
+			uint32_t slot = hashName(entries[i].name) & _mask;
+			while (_slots[slot] >= 0) {
+				if (equals(entries[_slots[slot]].name, entries[i].name)) {
+					break; // the first entry is kept for duplicates
+				}
+				slot = (slot + 1) & _mask;
+			}
+			if (_slots[slot] < 0) {
+				_slots[slot] = i;
+			}
+		}
+	}
+
+	const T *find(const T *entries, const char *name) const {
+		if (_slots.empty()) {
+			return 0;
+		}
+		uint32_t slot = hashName(name) & _mask;
+		while (_slots[slot] >= 0) {
+			const T *e = &entries[_slots[slot]];
+			if (equals(e->name, name)) {
+				return e;
+			}
+			slot = (slot + 1) & _mask;
+		}
+		return 0;
+	}
+};
+
+#endif
@@ -32,17 +32,14 @@ Pak::~Pak() {
 }
 
 void Pak::open(const char *dataPath) {
-	_f.open(FILENAME, dataPath);
+	_f.openMapped(FILENAME, dataPath);
 }
 
 void Pak::close() {
 	free(_entries);
 	_entries = 0;
 	_entriesCount = 0;
-}
-
-static int comparePakEntry(const void *a, const void *b) {
-	return strcasecmp(((PakEntry *)a)->name, ((PakEntry *)b)->name);
+	_index._slots.clear();
 }
 
 void Pak::readEntries() {
@@ -59,27 +56,29 @@ void Pak::readEntries() {
 	_entriesCount = entriesSize / 0x40;
 	debug(DBG_PAK, "Pak::readEntries() entries count %d", _entriesCount);
 	_entries = (PakEntry *)calloc(_entriesCount, sizeof(PakEntry));
-	if (!_entries) {
+	uint8_t *buf = (uint8_t *)malloc(_entriesCount * 0x40);
+	if (!_entries || !buf) {
+		free(buf);
+		free(_entries);
+		_entries = 0;
 		_entriesCount = 0;
 		return;
 	}
-	for (int i = 0; i < _entriesCount; ++i) {
-		uint8_t buf[0x40];
-		_f.read(buf, sizeof(buf));
-		if (_f.ioErr()) {
-			break;
-		}
-		const char *name = (const char *)buf;
+	// the directory is read at once
+	const int count = _f.read(buf, _entriesCount * 0x40) / 0x40;
+	for (int i = 0; i < count; ++i) {
+		const char *name = (const char *)buf + i * 0x40;
 		if (strncmp(name, "dlx/", 4) != 0) {
 			continue;
 		}
 		PakEntry *e = &_entries[i];
 		strcpy(e->name, name + 4);
-		e->offset = READ_LE_UINT32(buf + 0x38);
-		e->size = READ_LE_UINT32(buf + 0x3C);
+		e->offset = READ_LE_UINT32(buf + i * 0x40 + 0x38);
+		e->size = READ_LE_UINT32(buf + i * 0x40 + 0x3C);
 		debug(DBG_PAK, "Pak::readEntries() buf '%s' size %d", e->name, e->size);
 	}
-	qsort(_entries, _entriesCount, sizeof(PakEntry), comparePakEntry);
+	free(buf);
+	_index.build(_entries, _entriesCount);
 	// the original executable descrambles the (ke)y.txt file and check the last 4 bytes.
 	// this has been disabled in later re-releases and a key is bundled in the data files
 	if (0) {
@@ -97,9 +96,7 @@ void Pak::readEntries() {
 
 const PakEntry *Pak::find(const char *name) {
 	debug(DBG_PAK, "Pak::find() '%s'", name);
-	PakEntry tmp;
-	strcpy(tmp.name, name);
-	return (const PakEntry *)bsearch(&tmp, _entries, _entriesCount, sizeof(PakEntry), comparePakEntry);
+	return _index.find(_entries, name);
 }
 
 void Pak::loadData(const PakEntry *e, uint8_t *buf, uint32_t *size) {
@@ -124,3 +121,14 @@ void Pak::loadData(const PakEntry *e, uint8_t *buf, uint32_t *size) {
 		*size = e->size;
 	}
 }
+
+const uint8_t *Pak::getData(const PakEntry *e, uint32_t *size) {
+	// the encoded entries need a copy to be descrambled
+	const uint8_t *p = _f.getView(e->offset, e->size);
+	if (p && !(e->size > 5 && memcmp(p, "TooDC", 5) == 0)) {
+		debug(DBG_PAK, "Pak::getData() %d bytes from 0x%x", e->size, e->offset);
+		*size = e->size;
+		return p;
+	}
+	return 0;
+}
@@ -4,6 +4,7 @@
 
 #include "intern.h"
 #include "file.h"
+#include "nameindex.h"
 
 struct PakEntry {
 	char name[32];
@@ -17,6 +18,7 @@ struct Pak {
 	File _f;
 	PakEntry *_entries;
 	int _entriesCount;
+	NameIndex<PakEntry, true> _index;
 
 	Pak();
 	~Pak();
@@ -27,6 +29,7 @@ struct Pak {
 	void readEntries();
 	const PakEntry *find(const char *name);
 	void loadData(const PakEntry *e, uint8_t *buf, uint32_t *size);
+	const uint8_t *getData(const PakEntry *e, uint32_t *size);
 };
 
 #endif
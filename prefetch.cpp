@@ -0,0 +1,113 @@
+
+#include "prefetch.h"
+#include "resource.h"
+#include "util.h"
+
+PartPrefetch::PartPrefetch(Resource *res)
+	: _res(res), _quit(false), _busy(false), _requestedPart(0), _part(0) {
+	memset(_requestedEntries, 0, sizeof(_requestedEntries));
+	memset(_buffers, 0, sizeof(_buffers));
+	_thread = std::thread(&PartPrefetch::run, this);
+}
+
+PartPrefetch::~PartPrefetch() {
+	{
+		std::lock_guard<std::mutex> lock(_mutex);
+		_quit = true;
+	}
+	_cond.notify_all();
+	_thread.join();
+	freeBuffers(_buffers);
+}
+
+void PartPrefetch::request(int part, MemEntry **entries) {
+	std::lock_guard<std::mutex> lock(_mutex);
+	if (part == _requestedPart || (part == _part && !_busy)) {
+		return;
+	}
+	debug(DBG_BANK, "PartPrefetch::request() part %d", part);
+	_requestedPart = part;
+	memcpy(_requestedEntries, entries, sizeof(_requestedEntries));
+	_cond.notify_all();
+}
+
+bool PartPrefetch::take(int part, uint8_t **buffers) {
+	std::unique_lock<std::mutex> lock(_mutex);
+	// a load in progress for that part is still quicker than starting over
+	while (_busy && _requestedPart == part) {
+		_cond.wait(lock);
+	}
+	if (_requestedPart == part) {
+		_requestedPart = 0;
+	}
+	if (_part != part) {
+		return false;
+	}
+	memcpy(buffers, _buffers, sizeof(_buffers));
+	memset(_buffers, 0, sizeof(_buffers));
+	_part = 0;
+	return true;
+}
+
+void PartPrefetch::freeBuffers(uint8_t **buffers) {
+	for (int i = 0; i < kSegmentsCount; ++i) {
+		free(buffers[i]);
+		buffers[i] = 0;
+	}
+}
+
+void PartPrefetch::run() {
+	std::unique_lock<std::mutex> lock(_mutex);
+	while (1) {
+		while (!_quit && _requestedPart == 0) {
+			_cond.wait(lock);
+		}
+		if (_quit) {
+			break;
+		}
+		const int part = _requestedPart;
+		MemEntry entries[kSegmentsCount];
+		for (int i = 0; i < kSegmentsCount; ++i) {
+			if (_requestedEntries[i]) {
+				// the bank fields are not modified after Resource::readEntries
+				entries[i] = *_requestedEntries[i];
+			} else {
+				entries[i].bankNum = 0;
+			}
+		}
+		freeBuffers(_buffers);
+		_part = 0;
+		_busy = true;
+		lock.unlock();
+
+		uint8_t *buffers[kSegmentsCount];
+		memset(buffers, 0, sizeof(buffers));
+		bool ret = true;
+		for (int i = 0; i < kSegmentsCount && ret; ++i) {
+			const MemEntry *me = &entries[i];
+			if (me->bankNum == 0) {
+				continue;
+			}
+			// the packed data is read at the start of the buffer and unpacked in place
+			buffers[i] = (uint8_t *)malloc(MAX(me->packedSize, me->unpackedSize));
+			ret = buffers[i] && _res->readBank(me, buffers[i]);
+		}
+
+		lock.lock();
+		_busy = false;
+		if (ret && _requestedPart == part) {
+			memcpy(_buffers, buffers, sizeof(_buffers));
+			_part = part;
+			_requestedPart = 0;
+		} else {
+			if (!ret) {
+				warning("Unable to prefetch part %d", part);
+				if (_requestedPart == part) {
+					_requestedPart = 0;
+				}
+			}
+			freeBuffers(buffers);
+		}
+		_cond.notify_all();
+	}
+}
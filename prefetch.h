@@ -0,0 +1,40 @@
+
+#ifndef PREFETCH_H__
+#define PREFETCH_H__
+
+#include "intern.h"
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+
+struct MemEntry;
+struct Resource;
+
+// Reads and unpacks the segments of a game part on a worker thread,
+// the buffers are handed over to Resource::setupPart.
+struct PartPrefetch {
+	enum {
+		kSegmentsCount = 4 // palette, bytecode, video1, video2
+	};
+
+	Resource *_res;
+	std::thread _thread;
+	std::mutex _mutex;
+	std::condition_variable _cond;
+	bool _quit;
+	bool _busy;
+	int _requestedPart;
+	MemEntry *_requestedEntries[kSegmentsCount];
+	int _part; // part of the staged buffers
+	uint8_t *_buffers[kSegmentsCount];
+
+	PartPrefetch(Resource *res);
+	~PartPrefetch();
+
+	void request(int part, MemEntry **entries);
+	bool take(int part, uint8_t **buffers);
+	void freeBuffers(uint8_t **buffers);
+	void run();
+};
+
+#endif
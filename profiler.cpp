@@ -0,0 +1,120 @@
+
+#include <algorithm>
+#include <vector>
+#include "profiler.h"
+
+static const char *_opcodesNames[] = {
+	/* 0x00 */
+	"movConst", "mov", "add", "addConst",
+	/* 0x04 */
+	"call", "ret", "yieldTask", "jmp",
+	/* 0x08 */
+	"installTask", "jmpIfVar", "condJmp", "setPalette",
+	/* 0x0C */
+	"changeTasksState", "selectPage", "fillPage", "copyPage",
+	/* 0x10 */
+	"updateDisplay", "removeTask", "drawString", "sub",
+	/* 0x14 */
+	"and", "or", "shl", "shr",
+	/* 0x18 */
+	"playSound", "updateResources", "playMusic", "drawString3DO",
+	/* 0x1C */
+	"jmpIfZero3DO", "jmpIfNotZero3DO", "printTime3DO"
+};
+
+static const int kMaxShapes = 20;
+
+Profiler::Profiler()
+	: _current(&_parts[0]), _opcode(-1), _opStart(0), _taskStart(0), _taskSlot(0), _shape(0) {
+	for (int i = 0; i < kPartsCount; ++i) {
+		PartStats *p = &_parts[i];
+		p->frames = 0;
+		memset(p->opCount, 0, sizeof(p->opCount));
+		memset(p->opTicks, 0, sizeof(p->opTicks));
+		memset(p->taskCount, 0, sizeof(p->taskCount));
+		memset(p->taskTicks, 0, sizeof(p->taskTicks));
+	}
+}
+
+void Profiler::beginFrame(int part) {
+	const int num = part - kPartCopyProtection;
+	_current = &_parts[(num >= 0 && num < kPartsCount) ? num : 0];
+	_current->frames++;
+}
+
+static const char *getOpcodeName(int opcode, char *buf, int bufSize) {
+	if (opcode == 0x40 || opcode == 0x80) {
+		snprintf(buf, bufSize, "drawShape(0x%02X)", opcode);
+		return buf;
+	}
+	if (opcode < (int)ARRAYSIZE(_opcodesNames)) {
+		return _opcodesNames[opcode];
+	}
+	snprintf(buf, bufSize, "op_%02X", opcode);
+	return buf;
+}
+
+template <typename T>
+struct SortByTicks {
+	const T *_ticks;
+	SortByTicks(const T *ticks) : _ticks(ticks) {}
+	bool operator()(int a, int b) const { return _ticks[a] > _ticks[b]; }
+};
+
+static bool compareShapes(const std::pair<uint32_t, Profiler::ShapeStats> &a, const std::pair<uint32_t, Profiler::ShapeStats> &b) {
+	return a.second.ticks > b.second.ticks;
+}
+
+void Profiler::dump() {
+	for (int i = 0; i < kPartsCount; ++i) {
+		const PartStats *p = &_parts[i];
+		if (p->frames == 0) {
+			continue;
+		}
+		uint64_t total = 0;
+		for (int j = 0; j < kTasksCount; ++j) {
+			total += p->taskTicks[j];
+		}
+		fprintf(stdout, "Part %d : %d frames, %llu ticks (updateDisplay includes the frame pacing)\n", kPartCopyProtection + i, p->frames, (unsigned long long)total);
+
+		std::vector<int> order;
+		for (int j = 0; j < kOpcodesCount; ++j) {
+			if (p->opCount[j] != 0) {
+				order.push_back(j);
+			}
+		}
+		std::sort(order.begin(), order.end(), SortByTicks<uint64_t>(p->opTicks));
+		fprintf(stdout, "  %-20s %12s %16s %10s\n", "opcode", "count", "ticks", "ticks/op");
+		for (size_t j = 0; j < order.size(); ++j) {
+			const int op = order[j];
+			char name[32];
+			fprintf(stdout, "  %-20s %12llu %16llu %10llu\n", getOpcodeName(op, name, sizeof(name)), (unsigned long long)p->opCount[op], (unsigned long long)p->opTicks[op], (unsigned long long)(p->opTicks[op] / p->opCount[op]));
+		}
+
+		order.clear();
+		for (int j = 0; j < kTasksCount; ++j) {
+			if (p->taskCount[j] != 0) {
+				order.push_back(j);
+			}
+		}
+		std::sort(order.begin(), order.end(), SortByTicks<uint64_t>(p->taskTicks));
+		fprintf(stdout, "  %-20s %12s %16s %10s\n", "task", "count", "ticks", "ticks/run");
+		for (size_t j = 0; j < order.size(); ++j) {
+			const int slot = order[j];
+			fprintf(stdout, "  0x%02X %15s %12llu %16llu %10llu\n", slot, "", (unsigned long long)p->taskCount[slot], (unsigned long long)p->taskTicks[slot], (unsigned long long)(p->taskTicks[slot] / p->taskCount[slot]));
+		}
+
+		std::vector<std::pair<uint32_t, ShapeStats> > shapes(p->shapes.begin(), p->shapes.end());
+		std::sort(shapes.begin(), shapes.end(), compareShapes);
+		if (shapes.size() > (size_t)kMaxShapes) {
+			shapes.resize(kMaxShapes);
+		}
+		fprintf(stdout, "  %-20s %12s %16s %10s\n", "shape", "count", "ticks", "ticks/draw");
+		for (size_t j = 0; j < shapes.size(); ++j) {
+			const uint32_t key = shapes[j].first;
+			const ShapeStats &s = shapes[j].second;
+			fprintf(stdout, "  %s:0x%04X %9s %12u %16llu %10llu\n", (key & 0x10000) ? "video2" : "video1", key & 0xFFFF, "", s.count, (unsigned long long)s.ticks, (unsigned long long)(s.ticks / s.count));
+		}
+	}
+	fflush(stdout);
+}
@@ -0,0 +1,101 @@
+
+#ifndef PROFILER_H__
+#define PROFILER_H__
+
+#include "intern.h"
+#include <map>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#elif !defined(__aarch64__)
+#include <time.h>
+#endif
+
+// Counts the executions and the time spent per opcode and per task slot,
+// and the shapes drawn by the scripts, for each game part.
+struct Profiler {
+	enum {
+		kPartsCount = 10, // 16000-16009
+		kTasksCount = 64,
+		kOpcodesCount = 256
+	};
+
+	struct ShapeStats {
+		uint32_t count;
+		uint64_t ticks;
+	};
+
+	struct PartStats {
+		uint32_t frames;
+		uint64_t opCount[kOpcodesCount];
+		uint64_t opTicks[kOpcodesCount];
+		uint64_t taskCount[kTasksCount];
+		uint64_t taskTicks[kTasksCount];
+		std::map<uint32_t, ShapeStats> shapes; // (segment << 16) | offset
+	};
+
+	PartStats _parts[kPartsCount];
+	PartStats *_current;
+	int _opcode;
+	uint64_t _opStart;
+	uint64_t _taskStart;
+	int _taskSlot;
+	ShapeStats *_shape;
+
+	Profiler();
+
+	static uint64_t readTicks() {
+#if defined(__x86_64__) || defined(__i386__)
+		return __rdtsc();
+#elif defined(__aarch64__)
+		uint64_t t;
+		asm volatile("mrs %0, cntvct_el0" : "=r" (t));
+		return t;
+#else
+		struct timespec ts;
+		clock_gettime(CLOCK_MONOTONIC, &ts);
+		return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+#endif
+	}
+
+	void beginFrame(int part);
+
+	void beginTask(int slot) {
+		_taskSlot = slot;
+		_opcode = -1;
+		_taskStart = _opStart = readTicks();
+	}
+	void endTask() {
+		const uint64_t t = readTicks();
+		endOpcode(t);
+		_current->taskCount[_taskSlot]++;
+		_current->taskTicks[_taskSlot] += t - _taskStart;
+	}
+
+	// the time of an opcode runs until the next one is fetched
+	void beginOpcode(uint8_t opcode) {
+		const uint64_t t = readTicks();
+		endOpcode(t);
+		_opcode = (opcode & 0x80) ? 0x80 : ((opcode & 0x40) ? 0x40 : opcode);
+		_opStart = t;
+	}
+	void endOpcode(uint64_t t) {
+		if (_opcode >= 0) {
+			_current->opCount[_opcode]++;
+			_current->opTicks[_opcode] += t - _opStart;
+			if (_shape) {
+				_shape->ticks += t - _opStart;
+				_shape = 0;
+			}
+		}
+	}
+
+	void countShape(uint16_t offset, bool segVideo2) {
+		_shape = &_current->shapes[(segVideo2 ? 0x10000 : 0) | offset];
+		_shape->count++;
+	}
+
+	void dump();
+};
+
+#endif
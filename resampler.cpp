@@ -0,0 +1,70 @@
+
+#include <math.h>
+#include <atomic>
+#include <mutex>
+#include "resampler.h"
+
+int Resampler::_type = kResamplerDefault;
+
+static std::atomic<int16_t *> _sincTables[Resampler::kSincCutoffSteps + 1];
+static std::mutex _sincTablesMutex;
+
+static double blackman(double x) {
+	return 0.42 + 0.5 * cos(M_PI * x) + 0.08 * cos(2 * M_PI * x);
+}
+
+static void buildSincTable(int16_t *table, double cutoff) {
+	static const int kCenter = Resampler::kSincTaps / 2 - 1;
+	for (int p = 0; p < Resampler::kSincPhases; ++p) {
+		const double frac = p / (double)Resampler::kSincPhases;
+		double coeffs[Resampler::kSincTaps];
+		double sum = 0;
+		for (int i = 0; i < Resampler::kSincTaps; ++i) {
+			const double x = i - kCenter - frac;
+			const double s = (x == 0) ? 1. : sin(M_PI * cutoff * x) / (M_PI * cutoff * x);
+			coeffs[i] = cutoff * s * blackman(x / (Resampler::kSincTaps / 2));
+			sum += coeffs[i];
+		}
+		// unity gain for each phase, the rounding error goes to the center tap
+		int16_t *dst = table + p * Resampler::kSincTaps;
+		int total = 0;
+		for (int i = 0; i < Resampler::kSincTaps; ++i) {
+			dst[i] = (int16_t)lrint(coeffs[i] / sum * (1 << Resampler::kSincCoeffBits));
+			total += dst[i];
+		}
+		dst[kCenter] += (1 << Resampler::kSincCoeffBits) - total;
+	}
+}
+
+static const int16_t *getSincTableStep(int step) {
+	int16_t *table = _sincTables[step].load(std::memory_order_acquire);
+	if (!table) {
+		std::lock_guard<std::mutex> lock(_sincTablesMutex);
+		table = _sincTables[step].load(std::memory_order_relaxed);
+		if (!table) {
+			table = (int16_t *)malloc(Resampler::kSincPhases * Resampler::kSincTaps * sizeof(int16_t));
+			buildSincTable(table, 0.95 * step / Resampler::kSincCutoffSteps);
+			_sincTables[step].store(table, std::memory_order_release);
+		}
+	}
+	return table;
+}
+
+void Resampler::setType(int type) {
+	_type = type;
+	if (type == kResamplerSinc) {
+		// the channels get their table from the audio callback, build them all beforehand
+		for (int step = 1; step <= kSincCutoffSteps; ++step) {
+			getSincTableStep(step);
+		}
+	}
+}
+
+const int16_t *Resampler::getSincTable(uint32_t inc) {
+	// upsampling keeps the source bandwidth, downsampling cuts at the output Nyquist frequency
+	int step = kSincCutoffSteps;
+	if (inc > (1U << Frac::BITS)) {
+		step = MAX<int>(1, ((uint64_t)kSincCutoffSteps << Frac::BITS) / inc);
+	}
+	return getSincTableStep(step);
+}
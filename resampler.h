@@ -0,0 +1,57 @@
+
+#ifndef RESAMPLER_H__
+#define RESAMPLER_H__
+
+#include "intern.h"
+#include "mixer_platform.h"
+
+enum {
+	kResamplerDefault, // nearest for the sounds, linear for the module music
+	kResamplerNearest,
+	kResamplerLinear,
+	kResamplerSinc
+};
+
+struct Resampler {
+	enum {
+		kSincTaps = 16, // samples [pos - 7, pos + 8]
+		kSincPhaseBits = 8,
+		kSincPhases = 1 << kSincPhaseBits,
+		kSincCoeffBits = 14,
+		kSincCutoffSteps = 32
+	};
+
+	static int _type;
+
+	// builds the sinc tables when selected
+	static void setType(int type);
+
+	// windowed sinc coefficients for each fractional position, inc is the 16.16 source step per output sample
+	static const int16_t *getSincTable(uint32_t inc);
+};
+
+// Q14 sum of the signed 8 bits samples around pos, the samples outside [0,end) are zero or wrapped in the loop
+static inline int sincSample(const uint8_t *data, int pos, uint32_t frac, uint32_t end, uint32_t loopPos, uint32_t loopLen, const int16_t *table, uint8_t flip) {
+	const int16_t *coeffs = table + (frac >> (Frac::BITS - Resampler::kSincPhaseBits)) * Resampler::kSincTaps;
+	const int start = pos - (Resampler::kSincTaps / 2 - 1);
+	if (start >= 0 && (uint32_t)(start + Resampler::kSincTaps) <= end) {
+		return dotS8x16(data + start, coeffs, flip);
+	}
+	int sum = 0;
+	for (int i = 0; i < Resampler::kSincTaps; ++i) {
+		int j = start + i;
+		if (j < 0) {
+			continue;
+		}
+		if ((uint32_t)j >= end) {
+			if (loopLen == 0) {
+				break;
+			}
+			j = loopPos + (j - end) % loopLen;
+		}
+		sum += (int8_t)(data[j] ^ flip) * coeffs[i];
+	}
+	return sum;
+}
+
+#endif
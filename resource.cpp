@@ -4,13 +4,20 @@
  * Copyright (C) 2004-2005 Gregory Montoir (cyx@users.sourceforge.net)
  */
 
+#include <algorithm>
+#include <vector>
 #include "resource.h"
+#include "bankcache.h"
+#include "bitmapcache.h"
 #include "file.h"
+#include "graphics.h"
 #include "pak.h"
+#include "prefetch.h"
 #include "resource_nth.h"
 #include "resource_win31.h"
 #include "resource_3do.h"
 #include "resource_mac.h"
+#include "serializer.h"
 #include "unpack.h"
 #include "util.h"
 #include "video.h"
@@ -18,7 +25,7 @@
 static const char *atariDemo = "aw.tos";
 
 Resource::Resource(Video *vid, const char *dataDir)
-	: _vid(vid), _dataDir(dataDir), _currentPart(0), _nextPart(0), _dataType(DT_DOS), _nth(0), _win31(0), _3do(0), _mac(0) {
+	: _vid(vid), _dataDir(dataDir), _currentPart(0), _nextPart(0), _dataType(DT_DOS), _nth(0), _win31(0), _3do(0), _mac(0), _bankCache(0), _prefetch(0), _bitmapCache(0) {
 	_bankPrefix = "bank";
 	_hasPasswordScreen = true;
 	memset(_memList, 0, sizeof(_memList));
@@ -33,26 +40,68 @@ Resource::Resource(Video *vid, const char *dataDir)
 
 Resource::~Resource() {
 	free(_demo3Joy.bufPtr);
+	delete _bitmapCache;
 	delete _nth;
 	delete _win31;
 	delete _3do;
 	delete _mac;
+	delete _prefetch;
+	delete _bankCache;
 }
 
-bool Resource::readBank(const MemEntry *me, uint8_t *dstBuf) {
-	bool ret = false;
+void Resource::setBankCache(const char *dir, uint32_t maxSize) {
+	delete _bankCache;
+	_bankCache = new BankCache(dir, maxSize);
+}
+
+bool Resource::openBank(File &f, int bankNum) {
 	char name[10];
-	snprintf(name, sizeof(name), "%s%02x", _bankPrefix, me->bankNum);
+	snprintf(name, sizeof(name), "%s%02x", _bankPrefix, bankNum);
+	return f.open(name, _dataDir) || (_dataType == DT_ATARI_DEMO && f.open(atariDemo, _dataDir));
+}
+
+// only reads the crc at the end of the packed stream, the cached data is used without reading the resource
+bool Resource::readBankCache(File &f, const MemEntry *me, uint8_t *dstBuf) {
+	if (!_bankCache || me->packedSize == me->unpackedSize || me->packedSize < 8) {
+		return false;
+	}
+	uint8_t crc[4];
+	f.seek(me->bankPos + me->packedSize - 8);
+	if (f.read(crc, sizeof(crc)) != (int)sizeof(crc)) {
+		return false;
+	}
+	return _bankCache->read(me->bankNum, me->bankPos, me->packedSize, READ_BE_UINT32(crc), dstBuf, me->unpackedSize);
+}
+
+bool Resource::unpackBank(const MemEntry *me, uint8_t *buf) {
+	if (me->packedSize == me->unpackedSize) {
+		return true;
+	}
+	uint32_t crc = 0;
+	if (_bankCache && me->packedSize >= 8) {
+		// the packed stream ends with its crc and unpacked size
+		crc = READ_BE_UINT32(buf + me->packedSize - 8);
+	}
+	if (!bytekiller_unpack(buf, me->unpackedSize, buf, me->packedSize)) {
+		return false;
+	}
+	if (_bankCache) {
+		_bankCache->write(me->bankNum, me->bankPos, me->packedSize, crc, buf, me->unpackedSize);
+	}
+	return true;
+}
+
+bool Resource::readBank(const MemEntry *me, uint8_t *dstBuf) {
 	File f;
-	if (f.open(name, _dataDir) || (_dataType == DT_ATARI_DEMO && f.open(atariDemo, _dataDir))) {
+	if (openBank(f, me->bankNum)) {
+		if (readBankCache(f, me, dstBuf)) {
+			return true;
+		}
 		f.seek(me->bankPos);
 		const size_t count = f.read(dstBuf, me->packedSize);
-		ret = (count == me->packedSize);
-		if (ret && me->packedSize != me->unpackedSize) {
-			ret = bytekiller_unpack(dstBuf, me->unpackedSize, dstBuf, me->packedSize);
-		}
+		return count == me->packedSize && unpackBank(me, dstBuf);
 	}
-	return ret;
+	return false;
 }
 
 static bool check15th(File &f, const char *dataDir) {
@@ -336,62 +385,128 @@ uint8_t getBitmapPalette(int resNum) {
 	}
 }
 
-void Resource::load() {
-	while (1) {
-		MemEntry *me = 0;
+struct PendingEntry {
+	MemEntry *me;
+	uint8_t *dst;
+};
 
-		// get resource with max rankNum
-		uint8_t maxNum = 0;
-		for (int i = 0; i < _numMemList; ++i) {
-			MemEntry *it = &_memList[i];
-			if (it->status == STATUS_TOLOAD && maxNum <= it->rankNum) {
-				maxNum = it->rankNum;
-				me = it;
-			}
-		}
-		if (me == 0) {
-			break; // no entry found
+static bool compareByRank(const MemEntry *a, const MemEntry *b) {
+	// the last entry of the list comes first for equal ranks
+	if (a->rankNum != b->rankNum) {
+		return a->rankNum > b->rankNum;
+	}
+	return a > b;
+}
+
+static bool compareByBankPos(const PendingEntry &a, const PendingEntry &b) {
+	if (a.me->bankNum != b.me->bankNum) {
+		return a.me->bankNum < b.me->bankNum;
+	}
+	return a.me->bankPos < b.me->bankPos;
+}
+
+void Resource::load() {
+	std::vector<MemEntry *> pending;
+	for (int i = 0; i < _numMemList; ++i) {
+		if (_memList[i].status == STATUS_TOLOAD) {
+			pending.push_back(&_memList[i]);
 		}
+	}
+	if (pending.empty()) {
+		return;
+	}
+	std::sort(pending.begin(), pending.end(), compareByRank);
 
+	// the entries are placed in the memory block by decreasing rank, then read in the bank files order
+	File *banks[256];
+	memset(banks, 0, sizeof(banks));
+	bool bankOpened[256];
+	std::vector<PendingEntry> reads;
+	uint8_t *scriptPtr = _scriptCurPtr;
+	for (size_t i = 0; i < pending.size(); ++i) {
+		MemEntry *me = pending[i];
 		const int resourceNum = me - _memList;
-
-		uint8_t *memPtr = 0;
+		if (me->bankNum == 0) {
+			warning("Resource::load() ec=0x%X (me->bankNum == 0)", 0xF00);
+			me->status = STATUS_NULL;
+			continue;
+		}
 		if (me->type == RT_BITMAP) {
-			memPtr = _vidCurPtr;
-		} else {
-			memPtr = _scriptCurPtr;
-			const uint32_t avail = uint32_t(_vidCurPtr - _scriptCurPtr);
-			if (me->unpackedSize > avail) {
-				warning("Resource::load() not enough memory, available=%d", avail);
-				me->status = STATUS_NULL;
-				continue;
+			// decoded to the video pages, one at a time
+			debug(DBG_BANK, "Resource::load() bufPos=0x%X size=%d type=%d pos=0x%X bankNum=%d", _vidCurPtr - _memPtrStart, me->packedSize, me->type, me->bankPos, me->bankNum);
+			if (!readBank(me, _vidCurPtr)) {
+				error("Unable to read resource %d from bank %d", resourceNum, me->bankNum);
 			}
+			_vid->copyBitmapPtr(_vidCurPtr, me->unpackedSize, getBitmapPalette(resourceNum));
+			me->status = STATUS_NULL;
+			continue;
 		}
-		if (me->bankNum == 0) {
-			warning("Resource::load() ec=0x%X (me->bankNum == 0)", 0xF00);
+		if (!banks[me->bankNum]) {
+			banks[me->bankNum] = new File;
+			bankOpened[me->bankNum] = openBank(*banks[me->bankNum], me->bankNum);
+		}
+		if (_dataType == DT_DOS && me->bankNum == 12 && me->type == RT_BANK && !bankOpened[me->bankNum]) {
+			// DOS demo version does not have the bank for this resource
+			// this should be safe to ignore as the resource does not appear to be used by the game code
+			me->status = STATUS_NULL;
+			continue;
+		}
+		const uint32_t avail = uint32_t(_vidCurPtr - scriptPtr);
+		if (me->unpackedSize > avail) {
+			warning("Resource::load() not enough memory, available=%d", avail);
 			me->status = STATUS_NULL;
+			continue;
+		}
+		debug(DBG_BANK, "Resource::load() bufPos=0x%X size=%d type=%d pos=0x%X bankNum=%d", scriptPtr - _memPtrStart, me->packedSize, me->type, me->bankPos, me->bankNum);
+		PendingEntry pe;
+		pe.me = me;
+		pe.dst = scriptPtr;
+		scriptPtr += me->unpackedSize;
+		if (readBankCache(*banks[me->bankNum], me, pe.dst)) {
+			me->bufPtr = pe.dst;
+			me->status = STATUS_LOADED;
+			continue;
+		}
+		reads.push_back(pe);
+	}
+	std::sort(reads.begin(), reads.end(), compareByBankPos);
+
+	std::vector<uint8_t> buf;
+	for (size_t i = 0; i < reads.size(); ) {
+		// entries stored next to each other are read at once
+		size_t j = i + 1;
+		while (j < reads.size() && reads[j].me->bankNum == reads[i].me->bankNum && reads[j].me->bankPos == reads[j - 1].me->bankPos + reads[j - 1].me->packedSize) {
+			++j;
+		}
+		File *f = banks[reads[i].me->bankNum];
+		const uint32_t pos = reads[i].me->bankPos;
+		const uint32_t size = reads[j - 1].me->bankPos + reads[j - 1].me->packedSize - pos;
+		bool ret;
+		if (j == i + 1) {
+			f->seek(pos);
+			ret = (f->read(reads[i].dst, size) == (int)size);
 		} else {
-			debug(DBG_BANK, "Resource::load() bufPos=0x%X size=%d type=%d pos=0x%X bankNum=%d", memPtr - _memPtrStart, me->packedSize, me->type, me->bankPos, me->bankNum);
-			if (readBank(me, memPtr)) {
-				if (me->type == RT_BITMAP) {
-					_vid->copyBitmapPtr(_vidCurPtr, me->unpackedSize, getBitmapPalette(resourceNum));
-					me->status = STATUS_NULL;
-				} else {
-					me->bufPtr = memPtr;
-					me->status = STATUS_LOADED;
-					_scriptCurPtr += me->unpackedSize;
-				}
-			} else {
-				if (_dataType == DT_DOS && me->bankNum == 12 && me->type == RT_BANK) {
-					// DOS demo version does not have the bank for this resource
-					// this should be safe to ignore as the resource does not appear to be used by the game code
-					me->status = STATUS_NULL;
-					continue;
-				}
-				error("Unable to read resource %d from bank %d", resourceNum, me->bankNum);
+			buf.resize(size);
+			f->seek(pos);
+			ret = (f->read(buf.data(), size) == (int)size);
+			for (size_t k = i; ret && k < j; ++k) {
+				memcpy(reads[k].dst, buf.data() + reads[k].me->bankPos - pos, reads[k].me->packedSize);
+			}
+		}
+		for (; i < j; ++i) {
+			MemEntry *me = reads[i].me;
+			if (!ret || !unpackBank(me, reads[i].dst)) {
+				error("Unable to read resource %d from bank %d", int(me - _memList), me->bankNum);
 			}
+			me->bufPtr = reads[i].dst;
+			me->status = STATUS_LOADED;
 		}
 	}
+	_scriptCurPtr = scriptPtr;
+
+	for (int i = 0; i < 256; ++i) {
+		delete banks[i];
+	}
 }
 
 void Resource::invalidateRes() {
@@ -471,6 +586,7 @@ static const int _memListBmp[] = {
 void Resource::update(uint16_t num, PreloadSoundProc preloadSound, void *data) {
 	if (num > 16000) {
 		_nextPart = num;
+		prefetchPart(num);
 		return;
 	}
 	switch (_dataType) {
@@ -528,14 +644,37 @@ void Resource::loadBmp(int num) {
 	uint8_t *p = 0;
 	switch (_dataType) {
 	case DT_15TH_EDITION:
-	case DT_20TH_EDITION:
-		p = _nth->loadBmp(num);
+	case DT_20TH_EDITION: {
+			if (!Graphics::_is1991) {
+				if (!_bitmapCache) {
+					_bitmapCache = new BitmapCache(_nth);
+				}
+				int w, h;
+				const uint8_t *rgb = _bitmapCache->get(num, &w, &h);
+				if (rgb) {
+					_vid->copyBitmapRGB(rgb, w, h);
+					return;
+				}
+			}
+			const uint8_t *view = _nth->getBmpView(num);
+			if (view) {
+				_vid->copyBitmapPtr(view, 0, getBitmapPalette(num));
+				return;
+			}
+			p = _nth->loadBmp(num);
+		}
 		break;
 	case DT_WIN31:
 		p = _win31->loadFile(num, 0, &size);
 		break;
-	case DT_3DO:
-		p = _3do->loadFile(num, 0, &size);
+	case DT_3DO: {
+			const uint8_t *view = _3do->getFileView(num, &size);
+			if (view) {
+				_vid->copyBitmapPtr(view, size, getBitmapPalette(num));
+				return;
+			}
+			p = _3do->loadFile(num, 0, &size);
+		}
 		break;
 	case DT_MAC:
 		p = _mac->loadFile(num, 0, &size);
@@ -583,6 +722,11 @@ uint8_t *Resource::loadDat(int num) {
 
 void Resource::loadFont() {
 	if (_nth) {
+		const uint8_t *view = _nth->getView("font.bmp");
+		if (view) {
+			_vid->setFont(view);
+			return;
+		}
 		uint8_t *p = _nth->load("font.bmp");
 		if (p) {
 			_vid->setFont(p);
@@ -593,6 +737,11 @@ void Resource::loadFont() {
 
 void Resource::loadHeads() {
 	if (_nth) {
+		const uint8_t *view = _nth->getView("heads.bmp");
+		if (view) {
+			_vid->setHeads(view);
+			return;
+		}
 		uint8_t *p = _nth->load("heads.bmp");
 		if (p) {
 			_vid->setHeads(p);
@@ -715,10 +864,17 @@ void Resource::setupPart(int ptrId) {
 						// HD assets
 						_nth->preloadDat(ptrId - 16000, i, num);
 					}
+					uint8_t *p = _scriptCurPtr;
 					*segments[i] = loadDat(num);
 					if (!*segments[i]) {
 						error("Unable to read resource %d in part %d", num, ptrId);
 					}
+					if (segments[i] == &_segCode && _nth && !Graphics::_is1991) {
+						if (!_bitmapCache) {
+							_bitmapCache = new BitmapCache(_nth);
+						}
+						_bitmapCache->setReferences(_segCode, _scriptCurPtr - p);
+					}
 				}
 			}
 			_currentPart = ptrId;
@@ -746,13 +902,15 @@ void Resource::setupPart(int ptrId) {
 				error("Resource::setupPart() ec=0x%X invalid part", 0xF07);
 			}
 			invalidateAll();
-			_memList[ipal].status = STATUS_TOLOAD;
-			_memList[icod].status = STATUS_TOLOAD;
-			_memList[ivd1].status = STATUS_TOLOAD;
-			if (ivd2 != 0) {
-				_memList[ivd2].status = STATUS_TOLOAD;
+			if (!loadPrefetchedPart(ptrId)) {
+				_memList[ipal].status = STATUS_TOLOAD;
+				_memList[icod].status = STATUS_TOLOAD;
+				_memList[ivd1].status = STATUS_TOLOAD;
+				if (ivd2 != 0) {
+					_memList[ivd2].status = STATUS_TOLOAD;
+				}
+				load();
 			}
-			load();
 			_segVideoPal = _memList[ipal].bufPtr;
 			_segCode = _memList[icod].bufPtr;
 			_segVideo1 = _memList[ivd1].bufPtr;
@@ -760,12 +918,75 @@ void Resource::setupPart(int ptrId) {
 				_segVideo2 = _memList[ivd2].bufPtr;
 			}
 			_currentPart = ptrId;
+			// the parts are played in sequence, the password screens can jump anywhere
+			if (ptrId >= kPartCopyProtection && ptrId < kPartFinal) {
+				prefetchPart(ptrId + 1);
+			}
 		}
 		_scriptBakPtr = _scriptCurPtr;
 		break;
 	}
 }
 
+void Resource::prefetchPart(int part) {
+	switch (_dataType) {
+	case DT_AMIGA:
+	case DT_ATARI:
+	case DT_ATARI_DEMO:
+	case DT_DOS:
+		break;
+	default:
+		return;
+	}
+	if (part < 16000 || part > 16009 || part == _currentPart) {
+		return;
+	}
+	if (!_prefetch) {
+		_prefetch = new PartPrefetch(this);
+	}
+	MemEntry *entries[PartPrefetch::kSegmentsCount];
+	for (int i = 0; i < PartPrefetch::kSegmentsCount; ++i) {
+		const int num = _memListParts[part - 16000][i];
+		entries[i] = (num != 0) ? &_memList[num] : 0;
+	}
+	_prefetch->request(part, entries);
+}
+
+bool Resource::loadPrefetchedPart(int part) {
+	uint8_t *buffers[PartPrefetch::kSegmentsCount];
+	if (!_prefetch || !_prefetch->take(part, buffers)) {
+		return false;
+	}
+	debug(DBG_BANK, "Resource::loadPrefetchedPart() part %d", part);
+	// copy the segments in the order Resource::load() places them
+	std::vector<MemEntry *> pending;
+	for (int i = 0; i < PartPrefetch::kSegmentsCount; ++i) {
+		const int num = _memListParts[part - 16000][i];
+		if (num != 0 && buffers[i]) {
+			pending.push_back(&_memList[num]);
+		}
+	}
+	std::sort(pending.begin(), pending.end(), compareByRank);
+	for (size_t i = 0; i < pending.size(); ++i) {
+		MemEntry *me = pending[i];
+		int index = 0;
+		while (_memListParts[part - 16000][index] != me - _memList) {
+			++index;
+		}
+		const uint32_t avail = uint32_t(_vidCurPtr - _scriptCurPtr);
+		if (me->unpackedSize > avail) {
+			warning("Resource::loadPrefetchedPart() not enough memory, available=%d", avail);
+			continue;
+		}
+		memcpy(_scriptCurPtr, buffers[index], me->unpackedSize);
+		me->bufPtr = _scriptCurPtr;
+		me->status = STATUS_LOADED;
+		_scriptCurPtr += me->unpackedSize;
+	}
+	_prefetch->freeBuffers(buffers);
+	return true;
+}
+
 void Resource::allocMemBlock() {
 	_memPtrStart = (uint8_t *)malloc(MEM_BLOCK_SIZE);
 	_scriptBakPtr = _scriptCurPtr = _memPtrStart;
@@ -798,3 +1019,33 @@ void Resource::readDemo3Joy() {
 		warning("Unable to open '%s'", filename);
 	}
 }
+
+void Resource::saveOrLoad(Serializer &ser) {
+	uint16_t part = _currentPart;
+	ser.saveOrLoad(part);
+	if (ser.isLoading() && part != _currentPart) {
+		setupPart(part);
+	}
+	ser.saveOrLoad(_nextPart);
+	ser.saveOrLoad(_useSegVideo2);
+	ser.saveOrLoadPtr(_scriptBakPtr, _memPtrStart);
+	ser.saveOrLoadPtr(_scriptCurPtr, _memPtrStart);
+	for (int i = 0; i < _numMemList; ++i) {
+		MemEntry *me = &_memList[i];
+		uint8_t status = me->status;
+		uint8_t allocated = me->allocated;
+		uint8_t *bufPtr = allocated ? 0 : me->bufPtr;
+		ser.saveOrLoad(status);
+		ser.saveOrLoad(allocated);
+		ser.saveOrLoadPtr(bufPtr, _memPtrStart);
+		if (ser.isLoading() && !me->allocated) {
+			// sounds allocated outside of the memory block are reloaded on demand
+			me->status = allocated ? STATUS_NULL : status;
+			me->bufPtr = bufPtr;
+		}
+	}
+	// resources loaded after the part setup
+	uint32_t size = _scriptCurPtr - _scriptBakPtr;
+	ser.saveOrLoad(size);
+	ser.saveOrLoad(_scriptBakPtr, size);
+}
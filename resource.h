@@ -60,7 +60,12 @@ struct DemoJoy {
 	}
 };
 
+struct BankCache;
+struct BitmapCache;
+struct File;
+struct PartPrefetch;
 struct ResourceNth;
+struct Serializer;
 struct ResourceWin31;
 struct Resource3do;
 struct ResourceMac;
@@ -131,6 +136,9 @@ struct Resource {
 	Language _lang;
 	const AmigaMemEntry *_amigaMemList;
 	DemoJoy _demo3Joy;
+	BankCache *_bankCache;
+	PartPrefetch *_prefetch;
+	BitmapCache *_bitmapCache;
 
 	Resource(Video *vid, const char *dataDir);
 	~Resource();
@@ -138,6 +146,10 @@ struct Resource {
 	DataType getDataType() const { return _dataType; }
 	void detectVersion();
 	const char *getGameTitle(Language lang) const;
+	void setBankCache(const char *dir, uint32_t maxSize);
+	bool openBank(File &f, int bankNum);
+	bool readBankCache(File &f, const MemEntry *me, uint8_t *dstBuf);
+	bool unpackBank(const MemEntry *me, uint8_t *buf);
 	bool readBank(const MemEntry *me, uint8_t *dstBuf);
 	void readEntries();
 	void readEntriesAmiga(const AmigaMemEntry *entries, int count);
@@ -154,10 +166,13 @@ struct Resource {
 	const char *getString(int num);
 	const char *getMusicPath(int num, char *buf, int bufSize, uint32_t *offset = 0);
 	const uint8_t *getInstrument(int num, uint32_t *offset);
+	void prefetchPart(int part);
+	bool loadPrefetchedPart(int part);
 	void setupPart(int part);
 	void allocMemBlock();
 	void freeMemBlock();
 	void readDemo3Joy();
+	void saveOrLoad(Serializer &ser);
 };
 
 #endif
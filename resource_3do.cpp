@@ -1,6 +1,7 @@
 
 #include <sys/stat.h>
 #include <unistd.h>
+#include "nameindex.h"
 #include "resource_3do.h"
 #include "util.h"
 
@@ -12,25 +13,16 @@ struct OperaIsoEntry {
 	uint32_t size;
 };
 
-static int compareOperaIsoEntry(const void *a, const void *b) {
-	const OperaIsoEntry *entry1 = (const OperaIsoEntry *)a;
-	const OperaIsoEntry *entry2 = (const OperaIsoEntry *)b;
-	return strcmp(entry1->name, entry2->name);
-}
-
-static int compareOperaIsoEntryName(const void *name, const void *p) {
-	const OperaIsoEntry *entry = (const OperaIsoEntry *)p;
-	return strcmp((const char *)name, entry->name);
-}
-
 struct OperaIso {
 	File _f;
 	OperaIsoEntry *_entries;
 	int _entriesCount;
+	int _entriesCapacity;
+	NameIndex<OperaIsoEntry, false> _index;
 
 	OperaIso(const char *filePath)
-		: _entries(0), _entriesCount(0) {
-		_f.open(filePath);
+		: _entries(0), _entriesCount(0), _entriesCapacity(0) {
+		_f.openMapped(filePath);
 	}
 	~OperaIso() {
 		free(_entries);
@@ -48,23 +40,36 @@ struct OperaIso {
 		}
 		const int block = READ_BE_UINT32(buf + 100);
 		readTocEntry(block);
-		qsort(_entries, _entriesCount, sizeof(OperaIsoEntry), compareOperaIsoEntry);
+		_index.build(_entries, _entriesCount);
 	}
 	void readTocEntry(int block) {
 		uint32_t attr = 0;
 		do {
-			_f.seek(block * ISO_BLOCK_SIZE + 20, SEEK_SET);
+			// the directory blocks are read at once
+			uint8_t blockBuf[ISO_BLOCK_SIZE];
+			_f.seek(block * ISO_BLOCK_SIZE, SEEK_SET);
+			if (_f.read(blockBuf, ISO_BLOCK_SIZE) != ISO_BLOCK_SIZE) {
+				warning("Failed to read ISO directory block %d", block);
+				return;
+			}
+			uint32_t pos = 20;
 			do {
-				uint8_t buf[72];
-				_f.read(buf, sizeof(buf));
+				if (pos + 72 > ISO_BLOCK_SIZE) {
+					warning("Unexpected ISO directory entry offset %d", pos);
+					return;
+				}
+				const uint8_t *buf = blockBuf + pos;
 				attr = READ_BE_UINT32(buf);
 				const char *name = (const char *)buf + 32;
 				const uint32_t count = READ_BE_UINT32(buf + 64);
 				const uint32_t offset = READ_BE_UINT32(buf + 68);
-				_f.seek(count * 4, SEEK_CUR);
+				pos += 72 + count * 4;
 				switch (attr & 255) {
 				case 2:
-					_entries = (OperaIsoEntry *)realloc(_entries, (_entriesCount + 1) * sizeof(OperaIsoEntry));
+					if (_entriesCount == _entriesCapacity) {
+						_entriesCapacity = _entriesCapacity ? _entriesCapacity * 2 : 64;
+						_entries = (OperaIsoEntry *)realloc(_entries, _entriesCapacity * sizeof(OperaIsoEntry));
+					}
 					if (_entries) {
 						OperaIsoEntry *e = &_entries[_entriesCount];
 						strncpy(e->name, name, sizeof(e->name) - 1);
@@ -85,7 +90,7 @@ struct OperaIso {
 		} while ((attr >> 24) == 0x40);
 	}
 	const OperaIsoEntry *find(const char *name) const {
-		return (const OperaIsoEntry *)bsearch(name, _entries, _entriesCount, sizeof(OperaIsoEntry), compareOperaIsoEntryName);
+		return _index.find(_entries, name);
 	}
 };
 
@@ -204,6 +209,45 @@ bool Resource3do::readEntries() {
 	return true;
 }
 
+static const uint8_t kLzssSignature[] = { 0x00, 0xF4, 0x01, 0x00 };
+
+static bool isLzss(const uint8_t *p, uint32_t size) {
+	return size >= 4 && memcmp(p, kLzssSignature, 4) == 0;
+}
+
+static uint8_t *decodeLzssFile(const uint8_t *src, uint32_t *size) {
+	static const int SZ = 64000 * 2;
+	uint8_t *tmp = (uint8_t *)calloc(1, SZ);
+	if (!tmp) {
+		warning("Unable to allocate %d bytes", SZ);
+		return 0;
+	}
+	const int decodedSize = decodeLzss(src + 4, *size - 4, tmp);
+	if (decodedSize != SZ) {
+		warning("Unexpected LZSS decoded size %d", decodedSize);
+		free(tmp);
+		return 0;
+	}
+	*size = decodedSize;
+	return tmp;
+}
+
+const uint8_t *Resource3do::getFileView(int num, uint32_t *size) {
+	if (_iso) {
+		char name[16];
+		snprintf(name, sizeof(name), "File%d", num);
+		const OperaIsoEntry *e = _iso->find(name);
+		if (e) {
+			const uint8_t *p = _iso->_f.getView(e->offset, e->size);
+			if (p && !isLzss(p, e->size)) {
+				*size = e->size;
+				return p;
+			}
+		}
+	}
+	return 0;
+}
+
 uint8_t *Resource3do::loadFile(int num, uint8_t *dst, uint32_t *size) {
 	uint8_t *in = dst;
 	if (_iso) {
@@ -211,6 +255,12 @@ uint8_t *Resource3do::loadFile(int num, uint8_t *dst, uint32_t *size) {
 		snprintf(name, sizeof(name), "File%d", num);
 		const OperaIsoEntry *e = _iso->find(name);
 		if (e) {
+			const uint8_t *p = _iso->_f.getView(e->offset, e->size);
+			if (p && isLzss(p, e->size)) {
+				// decoded from the mapped image, the packed data is not copied
+				*size = e->size;
+				return decodeLzssFile(p, size);
+			}
 			if (!dst) {
 				dst = (uint8_t *)malloc(e->size);
 				if (!dst) {
@@ -245,22 +295,9 @@ uint8_t *Resource3do::loadFile(int num, uint8_t *dst, uint32_t *size) {
 			return 0;
 		}
 	}
-	if (dst && memcmp(dst, "\x00\xf4\x01\x00", 4) == 0) {
-		static const int SZ = 64000 * 2;
-		uint8_t *tmp = (uint8_t *)calloc(1, SZ);
-		if (!tmp) {
-			warning("Unable to allocate %d bytes", SZ);
-			if (in != dst) free(dst);
-			return 0;
-		}
-		const int decodedSize = decodeLzss(dst + 4, *size - 4, tmp);
+	if (dst && isLzss(dst, *size)) {
+		uint8_t *tmp = decodeLzssFile(dst, size);
 		if (in != dst) free(dst);
-		if (decodedSize != SZ) {
-			warning("Unexpected LZSS decoded size %d", decodedSize);
-			free(tmp);
-			return 0;
-		}
-		*size = decodedSize;
 		return tmp;
 	}
 	return dst;
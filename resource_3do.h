@@ -19,6 +19,7 @@ struct Resource3do {
 
 	bool readEntries();
 
+	const uint8_t *getFileView(int num, uint32_t *size);
 	uint8_t *loadFile(int num, uint8_t *dst, uint32_t *size);
 	uint16_t *loadShape555(const char *name, int *w, int *h);
 	const char *getMusicName(int num, uint32_t *offset);
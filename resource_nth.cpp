@@ -2,6 +2,7 @@
 #include <time.h>
 #include <sys/stat.h>
 #include <zlib.h>
+#include "bitmap.h"
 #include "pak.h"
 #include "resource_nth.h"
 #include "util.h"
@@ -64,16 +65,63 @@ struct Resource15th: ResourceNth {
 		return buf;
 	}
 
-	virtual uint8_t *loadBmp(int num) {
-		char name[32];
+	static void getBmpName(int num, char *name, int nameSize) {
 		if (num >= 3000) {
-			snprintf(name, sizeof(name), "e%04d.bmp", num);
+			snprintf(name, nameSize, "e%04d.bmp", num);
 		} else {
-			snprintf(name, sizeof(name), "file%03d.bmp", (int16_t)num);
+			snprintf(name, nameSize, "file%03d.bmp", (int16_t)num);
 		}
+	}
+
+	virtual uint8_t *loadBmp(int num) {
+		char name[32];
+		getBmpName(num, name, sizeof(name));
 		return load(name);
 	}
 
+	virtual const uint8_t *getView(const char *name) {
+		const PakEntry *e = _pak.find(name);
+		if (e) {
+			uint32_t size;
+			return _pak.getData(e, &size);
+		}
+		return 0;
+	}
+
+	virtual const uint8_t *getBmpView(int num) {
+		char name[32];
+		getBmpName(num, name, sizeof(name));
+		return getView(name);
+	}
+
+	struct MemoryReader {
+		const uint8_t *p;
+		uint32_t pos, size;
+
+		static uint32_t readProc(void *userdata, uint8_t *dst, uint32_t len) {
+			MemoryReader *r = (MemoryReader *)userdata;
+			const uint32_t count = MIN(len, r->size - r->pos);
+			memcpy(dst, r->p + r->pos, count);
+			r->pos += count;
+			return count;
+		}
+	};
+
+	virtual uint8_t *decodeBmp(int num, int *w, int *h, uint8_t **buf, uint32_t *bufSize) {
+		char name[32];
+		getBmpName(num, name, sizeof(name));
+		const PakEntry *e = _pak.find(name);
+		if (e) {
+			MemoryReader r;
+			r.p = _pak.getData(e, &r.size);
+			if (r.p) {
+				r.pos = 0;
+				return decode_bitmap_stream(MemoryReader::readProc, &r, false, -1, w, h, buf, bufSize);
+			}
+		}
+		return 0;
+	}
+
 	virtual uint8_t *loadDat(int num, uint8_t *dst, uint32_t *size) {
 		char name[32];
 		snprintf(name, sizeof(name), "file%03d.dat", num);
@@ -212,48 +260,94 @@ struct Resource15th: ResourceNth {
 	}
 };
 
-static uint8_t *inflateGzip(const char *filepath) {
-	File f;
-	if (!f.open(filepath)) {
-		warning("Unable to open '%s'", filepath);
-		return 0;
+// inflates a .bgz/.wgz file in chunks, with a fixed size input buffer
+struct GzipReader {
+	File _f;
+	z_stream _str;
+	bool _init;
+	int _err;
+	uint32_t _dataSize; // uncompressed size, from the gzip trailer
+	Bytef _buf[1 << 14];
+
+	GzipReader() : _init(false), _err(Z_OK), _dataSize(0) {
 	}
-	const uint16_t sig = f.readUint16LE();
-	if (sig != 0x8B1F) {
-		warning("Unexpected file signature 0x%x for '%s'", sig, filepath);
-		return 0;
+	~GzipReader() {
+		if (_init) {
+			inflateEnd(&_str);
+		}
 	}
-	f.seek(-4, SEEK_END);
-	const uint32_t dataSize = f.readUint32LE();
-	uint8_t *out = (uint8_t *)malloc(dataSize);
-	if (!out) {
-		warning("Failed to allocate %d bytes", dataSize);
-		return 0;
+
+	bool open(const char *filepath) {
+		if (!_f.open(filepath)) {
+			warning("Unable to open '%s'", filepath);
+			return false;
+		}
+		const uint16_t sig = _f.readUint16LE();
+		if (sig != 0x8B1F) {
+			warning("Unexpected file signature 0x%x for '%s'", sig, filepath);
+			return false;
+		}
+		_f.seek(-4, SEEK_END);
+		_dataSize = _f.readUint32LE();
+		_f.seek(0);
+		memset(&_str, 0, sizeof(_str));
+		if (inflateInit2(&_str, MAX_WBITS + 16) != Z_OK) {
+			return false;
+		}
+		_init = true;
+		_str.next_in = _buf;
+		_str.avail_in = 0;
+		return true;
 	}
-	f.seek(0);
-	z_stream str;
-	memset(&str, 0, sizeof(str));
-	int err = inflateInit2(&str, MAX_WBITS + 16);
-	if (err == Z_OK) {
-		Bytef buf[1 << MAX_WBITS];
-		str.next_in = buf;
-		str.avail_in = 0;
-		str.next_out = out;
-		str.avail_out = dataSize;
-		while (err == Z_OK && str.avail_out != 0) {
-			if (str.avail_in == 0 && !f.ioErr()) {
-				str.next_in = buf;
-				str.avail_in = f.read(buf, sizeof(buf));
+
+	uint32_t read(uint8_t *dst, uint32_t len) {
+		_str.next_out = dst;
+		_str.avail_out = len;
+		while (_err == Z_OK && _str.avail_out != 0) {
+			if (_str.avail_in == 0 && !_f.ioErr()) {
+				_str.next_in = _buf;
+				_str.avail_in = _f.read(_buf, sizeof(_buf));
+			}
+			_err = inflate(&_str, Z_NO_FLUSH);
+			if (_err == Z_BUF_ERROR && _str.avail_in == 0 && _f.ioErr()) {
+				break;
 			}
-			err = inflate(&str, Z_NO_FLUSH);
 		}
-		inflateEnd(&str);
-		if (err == Z_STREAM_END) {
-			return out;
+		return len - _str.avail_out;
+	}
+
+	// inflates up to the gzip trailer, the stream end is only reported once its crc and size are verified
+	bool end() {
+		uint8_t tmp[256];
+		while (_err == Z_OK && read(tmp, sizeof(tmp)) != 0) {
 		}
+		if (_err != Z_STREAM_END) {
+			warning("Corrupt or truncated gzip stream, err %d", _err);
+			return false;
+		}
+		return true;
 	}
-	free(out);
-	return 0;
+
+	static uint32_t readProc(void *userdata, uint8_t *dst, uint32_t len) {
+		return ((GzipReader *)userdata)->read(dst, len);
+	}
+};
+
+static uint8_t *inflateGzip(const char *filepath) {
+	GzipReader gz;
+	if (!gz.open(filepath)) {
+		return 0;
+	}
+	uint8_t *out = (uint8_t *)malloc(gz._dataSize);
+	if (!out) {
+		warning("Failed to allocate %d bytes", gz._dataSize);
+		return 0;
+	}
+	if (gz.read(out, gz._dataSize) != gz._dataSize || !gz.end()) {
+		free(out);
+		return 0;
+	}
+	return out;
 }
 
 struct Resource20th: ResourceNth {
@@ -325,16 +419,35 @@ struct Resource20th: ResourceNth {
 		return 0;
 	}
 
-	virtual uint8_t *loadBmp(int num) {
-		char path[MAXPATHLEN];
+	void getBmpPath(int num, char *path, int pathSize) {
 		if (num >= 3000 && _bitmapSize) {
-			snprintf(path, sizeof(path), "%s/game/BGZ/data%s/%s_e%04d.bgz", _dataPath, _bitmapSize, _bitmapSize, num);
+			snprintf(path, pathSize, "%s/game/BGZ/data%s/%s_e%04d.bgz", _dataPath, _bitmapSize, _bitmapSize, num);
 		} else {
-			snprintf(path, sizeof(path), "%s/game/BGZ/file%03d.bgz", _dataPath, num);
+			snprintf(path, pathSize, "%s/game/BGZ/file%03d.bgz", _dataPath, num);
 		}
+	}
+
+	virtual uint8_t *loadBmp(int num) {
+		char path[MAXPATHLEN];
+		getBmpPath(num, path, sizeof(path));
 		return inflateGzip(path);
 	}
 
+	virtual uint8_t *decodeBmp(int num, int *w, int *h, uint8_t **buf, uint32_t *bufSize) {
+		char path[MAXPATHLEN];
+		getBmpPath(num, path, sizeof(path));
+		struct stat st;
+		if (stat(path, &st) != 0) {
+			return 0;
+		}
+		GzipReader gz;
+		if (!gz.open(path)) {
+			return 0;
+		}
+		uint8_t *p = decode_bitmap_stream(GzipReader::readProc, &gz, false, -1, w, h, buf, bufSize);
+		return (p && gz.end()) ? p : 0;
+	}
+
 	void preloadDat(int part, int type, int num) {
 		static const char *names[] = {
 			"INTRO", "EAU", "PRI", "CITE", "arene", "LUXE", "FINAL", 0
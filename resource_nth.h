@@ -11,6 +11,11 @@ struct ResourceNth {
 	virtual bool init() = 0;
 	virtual uint8_t *load(const char *name) = 0;
 	virtual uint8_t *loadBmp(int num) = 0;
+	// read-only data, without copy, for the uncompressed files
+	virtual const uint8_t *getView(const char *name) { return 0; }
+	virtual const uint8_t *getBmpView(int num) { return 0; }
+	// RGB pixels, the buffer is reallocated if too small, can be called from any thread
+	virtual uint8_t *decodeBmp(int num, int *w, int *h, uint8_t **buf, uint32_t *bufSize) { return 0; }
 	virtual void preloadDat(int part, int type, int num) {}
 	virtual uint8_t *loadDat(int num, uint8_t *dst, uint32_t *size) = 0;
 	virtual uint8_t *loadWav(int num, uint8_t *dst, uint32_t *size) = 0;
@@ -0,0 +1,202 @@
+
+#include "rewind.h"
+#include "util.h"
+
+// runs of zero bytes shorter than this are kept in the literals
+static const int kMinZeroRun = 4;
+
+// record layout : payload size (4 bytes), snapshot size (4 bytes), payload, payload size (4 bytes)
+static const int kRecordOverhead = 12;
+
+static uint8_t *writeVarint(uint8_t *p, uint32_t value) {
+	while (value >= 0x80) {
+		*p++ = (value & 0x7F) | 0x80;
+		value >>= 7;
+	}
+	*p++ = value;
+	return p;
+}
+
+static const uint8_t *readVarint(const uint8_t *p, uint32_t *value) {
+	uint32_t v = 0;
+	int shift = 0;
+	do {
+		v |= (*p & 0x7F) << shift;
+		shift += 7;
+	} while (*p++ & 0x80);
+	*value = v;
+	return p;
+}
+
+static inline uint8_t xorByte(const uint8_t *a, uint32_t aSize, const uint8_t *b, uint32_t bSize, uint32_t i) {
+	return (i < aSize ? a[i] : 0) ^ (i < bSize ? b[i] : 0);
+}
+
+// encodes 'a' XOR 'b' as a sequence of (zeros count, literals count, literals)
+static uint32_t encodeDelta(const uint8_t *a, uint32_t aSize, const uint8_t *b, uint32_t bSize, uint8_t *dst) {
+	uint8_t *p = dst;
+	const uint32_t size = MAX(aSize, bSize);
+	uint32_t i = 0;
+	while (i < size) {
+		const uint32_t zeroStart = i;
+		while (i < size && xorByte(a, aSize, b, bSize, i) == 0) {
+			++i;
+		}
+		if (i == size) {
+			break;
+		}
+		const uint32_t litStart = i;
+		uint32_t zeros = 0;
+		while (i < size) {
+			if (xorByte(a, aSize, b, bSize, i) == 0) {
+				++zeros;
+				if (zeros >= kMinZeroRun) {
+					break;
+				}
+			} else {
+				zeros = 0;
+			}
+			++i;
+		}
+		const uint32_t litEnd = (i < size) ? i + 1 - zeros : size - zeros;
+		p = writeVarint(p, litStart - zeroStart);
+		p = writeVarint(p, litEnd - litStart);
+		for (uint32_t j = litStart; j < litEnd; ++j) {
+			*p++ = xorByte(a, aSize, b, bSize, j);
+		}
+		i = litEnd;
+	}
+	return p - dst;
+}
+
+// rebuilds the older snapshot 'dst' from the newer one 'src'
+static void decodeDelta(const uint8_t *delta, uint32_t deltaSize, const uint8_t *src, uint32_t srcSize, uint8_t *dst, uint32_t dstSize) {
+	const uint32_t size = MIN(srcSize, dstSize);
+	memcpy(dst, src, size);
+	if (dstSize > size) {
+		memset(dst + size, 0, dstSize - size);
+	}
+	const uint8_t *p = delta;
+	const uint8_t *end = delta + deltaSize;
+	uint32_t pos = 0;
+	while (p < end) {
+		uint32_t zeros, count;
+		p = readVarint(p, &zeros);
+		p = readVarint(p, &count);
+		pos += zeros;
+		for (uint32_t i = 0; i < count; ++i, ++pos) {
+			if (pos < dstSize) {
+				dst[pos] ^= p[i];
+			}
+		}
+		p += count;
+	}
+}
+
+RewindBuffer::RewindBuffer(uint32_t budget)
+	: _ringSize(budget), _ref(0), _refSize(0), _out(0), _tmp(0), _bufSize(0) {
+	_ring = (uint8_t *)malloc(_ringSize);
+	if (!_ring) {
+		error("Unable to allocate rewind buffer (%d bytes)", _ringSize);
+	}
+	clear();
+}
+
+RewindBuffer::~RewindBuffer() {
+	free(_ring);
+	free(_ref);
+	free(_out);
+	free(_tmp);
+}
+
+void RewindBuffer::clear() {
+	_head = _tail = _used = 0;
+	_count = 0;
+	_refSize = 0;
+}
+
+void RewindBuffer::reserve(uint32_t size) {
+	if (size > _bufSize) {
+		_ref = (uint8_t *)realloc(_ref, size);
+		_out = (uint8_t *)realloc(_out, size);
+		// worst case for the delta encoding is below twice the input size
+		_tmp = (uint8_t *)realloc(_tmp, size * 2 + kRecordOverhead + 16);
+		if (!_ref || !_out || !_tmp) {
+			error("Unable to allocate rewind snapshot (%d bytes)", size);
+		}
+		_bufSize = size;
+	}
+}
+
+void RewindBuffer::readRing(uint32_t pos, uint8_t *dst, uint32_t len) const {
+	const uint32_t count = MIN(len, _ringSize - pos);
+	memcpy(dst, _ring + pos, count);
+	if (count < len) {
+		memcpy(dst + count, _ring, len - count);
+	}
+}
+
+void RewindBuffer::writeRing(uint32_t pos, const uint8_t *src, uint32_t len) {
+	const uint32_t count = MIN(len, _ringSize - pos);
+	memcpy(_ring + pos, src, count);
+	if (count < len) {
+		memcpy(_ring, src + count, len - count);
+	}
+}
+
+void RewindBuffer::dropOldest() {
+	assert(_count > 0);
+	uint32_t len;
+	readRing(_tail, (uint8_t *)&len, sizeof(len));
+	_tail = (_tail + len + kRecordOverhead) % _ringSize;
+	_used -= len + kRecordOverhead;
+	--_count;
+}
+
+void RewindBuffer::push(const uint8_t *data, uint32_t size) {
+	reserve(size);
+	if (_refSize != 0) {
+		const uint32_t len = encodeDelta(_ref, _refSize, data, size, _tmp + 8);
+		const uint32_t recordSize = len + kRecordOverhead;
+		if (recordSize > _ringSize) {
+			warning("RewindBuffer::push() delta too large %d, budget %d", recordSize, _ringSize);
+			clear();
+		} else {
+			while (_ringSize - _used < recordSize) {
+				dropOldest();
+			}
+			memcpy(_tmp, &len, 4);
+			memcpy(_tmp + 4, &_refSize, 4);
+			memcpy(_tmp + 8 + len, &len, 4);
+			writeRing(_head, _tmp, recordSize);
+			_head = (_head + recordSize) % _ringSize;
+			_used += recordSize;
+			++_count;
+		}
+	}
+	memcpy(_ref, data, size);
+	_refSize = size;
+}
+
+const uint8_t *RewindBuffer::pop(uint32_t *size) {
+	if (_refSize == 0) {
+		return 0;
+	}
+	memcpy(_out, _ref, _refSize);
+	*size = _refSize;
+	if (_count > 0) {
+		uint32_t len;
+		readRing((_head + _ringSize - 4) % _ringSize, (uint8_t *)&len, 4);
+		const uint32_t start = (_head + _ringSize - (len + kRecordOverhead)) % _ringSize;
+		uint32_t refSize;
+		readRing((start + 4) % _ringSize, (uint8_t *)&refSize, 4);
+		reserve(refSize);
+		readRing((start + 8) % _ringSize, _tmp, len);
+		decodeDelta(_tmp, len, _out, *size, _ref, refSize);
+		_refSize = refSize;
+		_head = start;
+		_used -= len + kRecordOverhead;
+		--_count;
+	}
+	return _out;
+}
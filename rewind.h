@@ -0,0 +1,37 @@
+
+#ifndef REWIND_H__
+#define REWIND_H__
+
+#include "intern.h"
+
+// Ring buffer of engine state snapshots bounded by a byte budget. Only the
+// most recent snapshot is kept in full, older ones are stored as XOR deltas
+// against their successor and run length encoded.
+struct RewindBuffer {
+
+	uint8_t *_ring;
+	uint32_t _ringSize;
+	uint32_t _head, _tail, _used;
+	int _count;
+
+	uint8_t *_ref; // most recent snapshot
+	uint32_t _refSize;
+	uint8_t *_out;
+	uint8_t *_tmp;
+	uint32_t _bufSize;
+
+	RewindBuffer(uint32_t budget);
+	~RewindBuffer();
+
+	void clear();
+	void push(const uint8_t *data, uint32_t size);
+	const uint8_t *pop(uint32_t *size);
+	bool isEmpty() const { return _refSize == 0; }
+
+	void reserve(uint32_t size);
+	void readRing(uint32_t pos, uint8_t *dst, uint32_t len) const;
+	void writeRing(uint32_t pos, const uint8_t *src, uint32_t len);
+	void dropOldest();
+};
+
+#endif
@@ -6,17 +6,21 @@
 
 #include <ctime>
 #include "graphics.h"
+#include "journal.h"
 #include "script.h"
 #include "mixer.h"
+#include "profiler.h"
 #include "resource.h"
 #include "video.h"
+#include "serializer.h"
 #include "sfxplayer.h"
+#include "statehash.h"
 #include "systemstub.h"
 #include "util.h"
 
 
 Script::Script(Mixer *mix, Resource *res, SfxPlayer *ply, Video *vid)
-	: _mix(mix), _res(res), _ply(ply), _vid(vid), _stub(0) {
+	: _mix(mix), _res(res), _ply(ply), _vid(vid), _stub(0), _journal(0), _stateHash(0), _profiler(0) {
 }
 
 void Script::init() {
@@ -285,8 +289,10 @@ void Script::op_updateDisplay() {
 		}
 	}
 	_timeStamp = _stub->getTimeStamp();
+	_frameTime += _scriptVars[VAR_PAUSE_SLICES] * 1000 / frameHz;
 	if (_is3DO) {
-		_scriptVars[0xF7] = (_timeStamp - _startTime) * frameHz / 1000;
+		const uint32_t elapsed = _journal ? _frameTime : (_timeStamp - _startTime);
+		_scriptVars[0xF7] = elapsed * frameHz / 1000;
 	} else {
 		_scriptVars[0xF7] = 0;
 	}
@@ -362,8 +368,8 @@ void Script::op_updateResources() {
 	uint16_t num = _scriptPtr.fetchWord();
 	debug(DBG_SCRIPT, "Script::op_updateResources(%d)", num);
 	if (num == 0) {
-		_ply->stop();
 		_mix->stopAll();
+		_ply->stop();
 		_res->invalidateRes();
 	} else {
 		_res->update(num, preloadSoundCb, this);
@@ -379,8 +385,8 @@ void Script::op_playMusic() {
 }
 
 void Script::restartAt(int part, int pos) {
-	_ply->stop();
 	_mix->stopAll();
+	_ply->stop();
 	if (_res->getDataType() == Resource::DT_20TH_EDITION) {
 		_scriptVars[0xBF] = _difficulty; // difficulty (0 to 2)
 		// _scriptVars[0xDB] = 1; // preload sounds (resnum >= 2000)
@@ -414,6 +420,7 @@ void Script::restartAt(int part, int pos) {
 		_scriptVars[0] = pos;
 	}
 	_startTime = _timeStamp = _stub->getTimeStamp();
+	_frameTime = 0;
 	if (part == kPartWater) {
 		if (_res->_demo3Joy.start()) {
 			memset(_scriptVars, 0, sizeof(_scriptVars));
@@ -437,6 +444,9 @@ void Script::setupTasks() {
 }
 
 void Script::runTasks() {
+	if (_profiler) {
+		_profiler->beginFrame(_res->_currentPart);
+	}
 	for (int i = 0; i < 0x40 && !_stub->_pi.quit; ++i) {
 		if (_scriptStates[0][i] == 0) {
 			uint16_t n = _scriptTasks[0][i];
@@ -445,8 +455,21 @@ void Script::runTasks() {
 				_stackPtr = 0;
 				_scriptPaused = false;
 				debug(DBG_SCRIPT, "Script::runTasks() i=0x%02X n=0x%02X", i, n);
-				executeTask();
+				if (_profiler) {
+					_profiler->beginTask(i);
+					executeTask();
+					_profiler->endTask();
+				} else {
+					executeTask();
+				}
 				_scriptTasks[0][i] = _scriptPtr.pc - _res->_segCode;
+				if (_stateHash) {
+					// VAR_MUSIC_SYNC is only set at the start of the frames from the journal, not by the audio callback
+					const uint32_t hash = HASH_DATA(kHashInit, _scriptVars, sizeof(_scriptVars));
+					if (!_stateHash->addTask(i, n, _scriptTasks[0][i], hash, *_opcodePtr, _opcodePtr - _res->_segCode)) {
+						_stub->_pi.quit = true;
+					}
+				}
 				debug(DBG_SCRIPT, "Script::runTasks() i=0x%02X pos=0x%X", i, _scriptTasks[0][i]);
 			}
 		}
@@ -455,7 +478,11 @@ void Script::runTasks() {
 
 void Script::executeTask() {
 	while (!_scriptPaused) {
+		_opcodePtr = _scriptPtr.pc;
 		uint8_t opcode = _scriptPtr.fetchByte();
+		if (_profiler) {
+			_profiler->beginOpcode(opcode);
+		}
 		if (opcode & 0x80) {
 			const uint16_t off = ((opcode << 8) | _scriptPtr.fetchByte()) << 1;
 			_res->_useSegVideo2 = false;
@@ -468,6 +495,9 @@ void Script::executeTask() {
 				pt.x += h;
 			}
 			debug(DBG_VIDEO, "vid_opcd_0x80 : opcode=0x%X off=0x%X x=%d y=%d", opcode, off, pt.x, pt.y);
+			if (_profiler) {
+				_profiler->countShape(off, false);
+			}
 			_vid->setDataBuffer(_res->_segVideo1, off);
 			if (_is3DO) {
 				_vid->drawShape3DO(0xFF, 64, &pt);
@@ -512,6 +542,9 @@ void Script::executeTask() {
 				}
 			}
 			debug(DBG_VIDEO, "vid_opcd_0x40 : off=0x%X x=%d y=%d", off, pt.x, pt.y);
+			if (_profiler) {
+				_profiler->countShape(off, _res->_useSegVideo2);
+			}
 			_vid->setDataBuffer(_res->_useSegVideo2 ? _res->_segVideo2 : _res->_segVideo1, off);
 			if (_is3DO) {
 				_vid->drawShape3DO(0xFF, zoom, &pt);
@@ -592,6 +625,16 @@ void Script::executeTask() {
 
 void Script::updateInput() {
 	_stub->processEvents();
+	if (_journal) {
+		// the music sync variable is latched once per frame to replay identically
+		int16_t syncValue = 0;
+		bool syncEvent = _ply->getSyncEvent(&syncValue);
+		if (!_journal->update(&_stub->_pi, &syncEvent, &syncValue)) {
+			_stub->_pi.quit = true;
+		} else if (syncEvent) {
+			_scriptVars[VAR_MUSIC_SYNC] = syncValue;
+		}
+	}
 	if (_res->_currentPart == kPartPassword) {
 		char c = _stub->_pi.lastChar;
 		if (c == 8 || /*c == 0xD ||*/ c == 0 || (c >= 'a' && c <= 'z')) {
@@ -793,7 +836,7 @@ void Script::snd_playSound(uint16_t resNum, uint8_t freq, uint8_t vol, uint8_t c
 	case Resource::DT_WIN31: {
 			uint8_t *buf = _res->loadWav(resNum);
 			if (buf) {
-				_mix->playSoundWav(channel, buf, getSoundFreq(freq), vol, getWavLooping(resNum));
+				_mix->playSoundWav(channel, resNum, buf, getSoundFreq(freq), vol, getWavLooping(resNum));
 			}
 		}
 		break;
@@ -862,11 +905,9 @@ void Script::snd_playMusic(uint16_t resNum, uint16_t delay, uint8_t pos) {
 		break;
 	default: // DT_AMIGA, DT_ATARI, DT_DOS, DT_MAC
 		if (resNum != 0) {
-			_ply->loadSfxModule(resNum, delay, pos);
-			_ply->start();
-			_mix->playSfxMusic(resNum);
+			_mix->playSfxMusic(resNum, delay, pos);
 		} else if (delay != 0) {
-			_ply->setEventsDelay(delay);
+			_mix->setSfxMusicDelay(delay);
 		} else {
 			_mix->stopSfxMusic();
 		}
@@ -899,3 +940,12 @@ void Script::fixUpPalette_changeScreen(int part, int screen) {
 		_vid->changePal(pal);
 	}
 }
+
+void Script::saveOrLoad(Serializer &ser) {
+	ser.saveOrLoad(_scriptVars);
+	ser.saveOrLoad(_scriptStackCalls);
+	ser.saveOrLoad(_scriptTasks);
+	ser.saveOrLoad(_scriptStates);
+	ser.saveOrLoad(_screenNum);
+	ser.saveOrLoad(_frameTime);
+}
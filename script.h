@@ -9,8 +9,12 @@
 
 #include "intern.h"
 
+struct Journal;
+struct Profiler;
+struct StateHash;
 struct Mixer;
 struct Resource;
+struct Serializer;
 struct SfxPlayer;
 struct SystemStub;
 struct Video;
@@ -54,18 +58,23 @@ struct Script {
 	SfxPlayer *_ply;
 	Video *_vid;
 	SystemStub *_stub;
+	Journal *_journal;
+	StateHash *_stateHash;
+	Profiler *_profiler;
 
 	int16_t _scriptVars[256];
 	uint16_t _scriptStackCalls[64];
 	uint16_t _scriptTasks[2][64];
 	uint8_t _scriptStates[2][64];
 	Ptr _scriptPtr;
+	const uint8_t *_opcodePtr;
 	uint8_t _stackPtr;
 	bool _scriptPaused;
 	bool _fastMode;
 	int _screenNum;
 	bool _is3DO;
 	uint32_t _startTime, _timeStamp;
+	uint32_t _frameTime; // sum of the frame durations, used instead of the timestamps with input journals
 
 	Script(Mixer *mix, Resource *res, SfxPlayer *ply, Video *vid);
 	void init();
@@ -112,6 +121,8 @@ struct Script {
 	void snd_preloadSound(uint16_t resNum, const uint8_t *data);
 
 	void fixUpPalette_changeScreen(int part, int screen);
+
+	void saveOrLoad(Serializer &ser);
 };
 
 #endif
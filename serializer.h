@@ -0,0 +1,62 @@
+
+#ifndef SERIALIZER_H__
+#define SERIALIZER_H__
+
+#include "intern.h"
+
+struct Serializer {
+	enum Mode {
+		SM_SIZE, // only computes the state size
+		SM_SAVE,
+		SM_LOAD
+	};
+
+	Mode _mode;
+	uint8_t *_buf;
+	uint32_t _pos, _size;
+	bool _err;
+
+	Serializer(Mode mode, uint8_t *buf = 0, uint32_t size = 0)
+		: _mode(mode), _buf(buf), _pos(0), _size(size), _err(false) {
+	}
+
+	bool isLoading() const { return _mode == SM_LOAD; }
+
+	void saveOrLoad(void *p, uint32_t len) {
+		switch (_mode) {
+		case SM_SIZE:
+			break;
+		case SM_SAVE:
+			if (_pos + len > _size) {
+				_err = true;
+				return;
+			}
+			memcpy(_buf + _pos, p, len);
+			break;
+		case SM_LOAD:
+			if (_pos + len > _size) {
+				_err = true;
+				return;
+			}
+			memcpy(p, _buf + _pos, len);
+			break;
+		}
+		_pos += len;
+	}
+
+	template<typename T>
+	void saveOrLoad(T &value) {
+		saveOrLoad(&value, sizeof(T));
+	}
+
+	// stores a pointer as an offset relative to 'base', 0xFFFFFFFF for null pointers
+	void saveOrLoadPtr(uint8_t *&ptr, uint8_t *base) {
+		uint32_t offset = ptr ? uint32_t(ptr - base) : 0xFFFFFFFF;
+		saveOrLoad(offset);
+		if (isLoading()) {
+			ptr = (offset == 0xFFFFFFFF) ? 0 : base + offset;
+		}
+	}
+};
+
+#endif
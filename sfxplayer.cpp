@@ -7,22 +7,61 @@
 #include "sfxplayer.h"
 #include "mixer.h"
 #include "mixer_platform.h"
+#include "resampler.h"
 #include "resource.h"
 #include "systemstub.h"
 #include "util.h"
 #include <math.h>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <list>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// loaded on the game thread, retired by the audio callback when the player stops or replaces it
+struct SfxMusic {
+	std::atomic<bool> retired;
+
+	SfxMusic()
+		: retired(false) {
+	}
+	virtual ~SfxMusic() {}
+};
 
 struct SfxPlayer_impl {
-	virtual ~SfxPlayer_impl() {};
+	std::vector<SfxMusic *> _musics; // game thread
+
+	virtual ~SfxPlayer_impl() {
+		freeMusics(true);
+	}
 
 	virtual void setSyncVar(int16_t *syncVar) = 0;
+	virtual void setSyncLatched(bool latched) = 0;
+	virtual bool getSyncEvent(int16_t *value) = 0;
 	virtual void setEventsDelay(uint16_t delay) = 0;
-	virtual void loadSfxModule(uint16_t resNum, uint16_t delay, uint8_t pos) = 0;
-	virtual void play(int rate) = 0;
+	virtual SfxMusic *loadSfxModule(uint16_t resNum, uint16_t delay, uint8_t pos, int rate) = 0;
+	virtual void play(int rate, SfxMusic *music) = 0;
 	virtual void readSamples(int16_t *buf, int len) = 0;
-	virtual void start() = 0;
 	virtual void stop() = 0;
 
+	// the audio callback does not free, the retired musics are deleted with the next load
+	void freeMusics(bool all) {
+		for (size_t i = 0; i < _musics.size(); ) {
+			if (all || _musics[i]->retired.load(std::memory_order_acquire)) {
+				delete _musics[i];
+				_musics[i] = _musics.back();
+				_musics.pop_back();
+			} else {
+				++i;
+			}
+		}
+	}
+	void retireMusic(SfxMusic *music) {
+		music->retired.store(true, std::memory_order_release);
+	}
+
 	static SfxPlayer_impl *create(Resource *res);
 };
 
@@ -47,6 +86,16 @@ void SfxPlayer::setSyncVar(int16_t *syncVar) {
 	}
 }
 
+void SfxPlayer::setSyncLatched(bool latched) {
+	if (_impl) {
+		_impl->setSyncLatched(latched);
+	}
+}
+
+bool SfxPlayer::getSyncEvent(int16_t *value) {
+	return _impl && _impl->getSyncEvent(value);
+}
+
 void SfxPlayer::setEventsDelay(uint16_t delay) {
 	debug(DBG_SND, "SfxPlayer::setEventsDelay(%d)", delay);
 	if (_impl) {
@@ -54,29 +103,26 @@ void SfxPlayer::setEventsDelay(uint16_t delay) {
 	}
 }
 
-void SfxPlayer::loadSfxModule(uint16_t resNum, uint16_t delay, uint8_t pos) {
+SfxMusic *SfxPlayer::loadSfxModule(uint16_t resNum, uint16_t delay, uint8_t pos, int rate) {
 	debug(DBG_SND, "SfxPlayer::loadSfxModule(0x%X, %d, %d)", resNum, delay, pos);
-	if (_impl) {
-		return _impl->loadSfxModule(resNum, delay, pos);
-	}
+	return _impl ? _impl->loadSfxModule(resNum, delay, pos, rate) : 0;
 }
 
-void SfxPlayer::play(int rate) {
+void SfxPlayer::releaseMusic(SfxMusic *music) {
 	if (_impl) {
-		return _impl->play(rate);
+		return _impl->retireMusic(music);
 	}
 }
 
-void SfxPlayer::readSamples(int16_t *buf, int len) {
+void SfxPlayer::play(int rate, SfxMusic *music) {
 	if (_impl) {
-		return _impl->readSamples(buf, len);
+		return _impl->play(rate, music);
 	}
 }
 
-void SfxPlayer::start() {
-	debug(DBG_SND, "SfxPlayer::start()");
+void SfxPlayer::readSamples(int16_t *buf, int len) {
 	if (_impl) {
-		return _impl->start();
+		return _impl->readSamples(buf, len);
 	}
 }
 
@@ -90,6 +136,7 @@ void SfxPlayer::stop() {
 struct SfxInstrument {
 	uint8_t *data;
 	uint16_t volume;
+	uint32_t size;
 };
 
 struct SfxModule {
@@ -119,11 +166,28 @@ struct SfxChannel {
 	uint16_t sampleLoopLen;
 	uint16_t volume;
 	Frac pos;
+	const int16_t *sincTable;
+	int16_t volumeTable[256]; // interpolated 8 bits samples scaled by volume
+	int tableVolume;
 };
 
+struct ModuleCache;
+struct ModuleCacheEntry;
+struct ModuleMusic;
+struct ModuleState;
+struct ModuleSyncEvent;
+
 struct ModulePlayer: SfxPlayer_impl {
 	enum {
-		NUM_CHANNELS = 4
+		NUM_CHANNELS = 4,
+		kMixBlockSize = 512,
+		kCacheBlockFrames = 1024
+	};
+
+	enum {
+		kCacheLive,      // sequencer, switches to the cache when the module is rendered
+		kCacheStreaming, // samples and sync events read from the cache
+		kCacheDetached   // sequencer, restored from a cached state
 	};
 
 	Resource *_res;
@@ -132,70 +196,508 @@ struct ModulePlayer: SfxPlayer_impl {
 	uint16_t _resNum;
 	SfxModule _sfxMod;
 	int16_t *_syncVar;
+	std::atomic<bool> _syncLatched;
+	std::atomic<int32_t> _syncLatch; // last sync event, -1 if none
 	bool _playing;
 	int _rate;
 	int _samplesLeft;
 	SfxChannel _channels[NUM_CHANNELS];
+	int32_t _mixBuf[kMixBlockSize * 2]; // stereo accumulators, saturated once per block
+	uint64_t _frame; // since play()
+	ModuleMusic *_music;
+	std::vector<ModuleSyncEvent> *_syncEvents; // recorded instead of set when rendering
+	bool _muteSync;
+	ModuleCache *_cache;
+	ModuleCacheEntry *_cacheEntry;
+	int _cacheState;
+	uint32_t _syncEventIndex;
+	int16_t _cacheBuf[kCacheBlockFrames * 2];
+	int _cacheBlock;
 
 	ModulePlayer(Resource *res);
+	virtual ~ModulePlayer();
 
 	virtual void setSyncVar(int16_t *syncVar);
+	virtual void setSyncLatched(bool latched);
+	virtual bool getSyncEvent(int16_t *value);
 	virtual void setEventsDelay(uint16_t delay);
-	virtual void loadSfxModule(uint16_t resNum, uint16_t delay, uint8_t pos);
-	void prepareInstruments(const uint8_t *p);
-	virtual void play(int rate);
+	virtual SfxMusic *loadSfxModule(uint16_t resNum, uint16_t delay, uint8_t pos, int rate);
+	bool readModule(uint16_t resNum, uint16_t delay, uint8_t pos, SfxModule *mod, uint16_t *eventsDelay) const;
+	void prepareInstruments(const uint8_t *p, SfxModule *mod) const;
+	virtual void play(int rate, SfxMusic *music);
+	void reset(int rate);
 	void mixSamples(int16_t *buf, int len);
 	virtual void readSamples(int16_t *buf, int len);
-	virtual void start();
 	virtual void stop();
 	void handleEvents();
 	void handlePattern(uint8_t channel, const uint8_t *patternData);
+	void setSync(int16_t value);
+
+	void saveState(ModuleState *state) const;
+	void loadState(const ModuleState *state);
+	void streamSamples(int16_t *buf, int len);
+	void detachCache();
+};
+
+struct ModuleSyncEvent {
+	uint64_t frame;
+	int16_t value;
+};
+
+// SfxChannel without the volume table, rebuilt after the state is loaded
+struct SfxChannelState {
+	uint8_t *sampleData;
+	uint16_t sampleLen;
+	uint16_t sampleLoopPos;
+	uint16_t sampleLoopLen;
+	uint16_t volume;
+	Frac pos;
+	const int16_t *sincTable;
+};
+
+struct ModuleState {
+	uint64_t frame;
+	SfxModule mod;
+	uint16_t delay;
+	int samplesLeft;
+	bool playing;
+	SfxChannelState channels[ModulePlayer::NUM_CHANNELS];
+};
+
+// a module rendered from its start, the copies of the module and instruments data
+// are not affected by the resources loaded afterwards
+struct ModuleCacheEntry {
+	uint16_t resNum, delay;
+	uint8_t pos;
+	int rate;
+	uint8_t *data;
+	SfxModule mod; // pointers to data
+	uint16_t eventsDelay;
+	std::vector<uint8_t> pcm;
+	std::vector<uint32_t> blocksOffset;
+	std::vector<ModuleSyncEvent> syncEvents;
+	std::vector<ModuleState> states; // every kStateBlocks blocks and at the end
+	uint64_t frames;
+	std::atomic<bool> done;
+	std::atomic<int> refs; // loaded musics
+
+	ModuleCacheEntry()
+		: data(0), frames(0), done(false), refs(0) {
+	}
+	~ModuleCacheEntry() {
+		free(data);
+	}
+};
+
+struct ModuleMusic: SfxMusic {
+	uint16_t resNum;
+	SfxModule mod;
+	uint16_t eventsDelay;
+	ModuleCacheEntry *cacheEntry; // referenced
+
+	ModuleMusic()
+		: cacheEntry(0) {
+	}
+	~ModuleMusic() {
+		if (cacheEntry) {
+			cacheEntry->refs.fetch_sub(1, std::memory_order_release);
+		}
+	}
+};
+
+// stereo blocks, each channel stores the first sample followed by the deltas
+// (zigzag encoded) packed with the bits count of the largest
+static void encodeCacheBlock(const int16_t *samples, int frames, std::vector<uint8_t> &out) {
+	for (int c = 0; c < 2; ++c) {
+		uint32_t mask = 0;
+		for (int i = 1; i < frames; ++i) {
+			const int d = samples[i * 2 + c] - samples[(i - 1) * 2 + c];
+			mask |= ((uint32_t)d << 1) ^ (uint32_t)(d >> 31);
+		}
+		int bits = 0;
+		while ((mask >> bits) != 0) {
+			++bits;
+		}
+		out.push_back(samples[c] & 255);
+		out.push_back(((uint16_t)samples[c]) >> 8);
+		out.push_back(bits);
+		uint32_t acc = 0;
+		int accBits = 0;
+		for (int i = 1; i < frames; ++i) {
+			const int d = samples[i * 2 + c] - samples[(i - 1) * 2 + c];
+			acc |= (((uint32_t)d << 1) ^ (uint32_t)(d >> 31)) << accBits;
+			accBits += bits;
+			while (accBits >= 8) {
+				out.push_back(acc & 255);
+				acc >>= 8;
+				accBits -= 8;
+			}
+		}
+		if (accBits > 0) {
+			out.push_back(acc);
+		}
+	}
+}
+
+static void decodeCacheBlock(const uint8_t *p, int16_t *samples, int frames) {
+	for (int c = 0; c < 2; ++c) {
+		int prev = (int16_t)(p[0] | (p[1] << 8));
+		const int bits = p[2];
+		p += 3;
+		samples[c] = prev;
+		const uint32_t mask = (1 << bits) - 1;
+		uint32_t acc = 0;
+		int accBits = 0;
+		for (int i = 1; i < frames; ++i) {
+			while (accBits < bits) {
+				acc |= *p++ << accBits;
+				accBits += 8;
+			}
+			const uint32_t z = acc & mask;
+			acc >>= bits;
+			accBits -= bits;
+			prev += (int)(z >> 1) ^ -(int)(z & 1);
+			samples[i * 2 + c] = prev;
+		}
+	}
+}
+
+// renders the modules on a background thread. The entries are looked up and evicted on the game
+// thread, the audio callback only reads the referenced ones.
+struct ModuleCache {
+	enum {
+		kStateBlocks = 4, // the sequencer catch-up after a delay change mixes less than 4096 frames
+		kMaxFrames = 44100 * 60 * 15,
+		kMaxSize = 48 * 1024 * 1024,
+		kMaxEntrySize = kMaxSize / 4 // the end of longer modules is played by the sequencer
+	};
+
+	std::list<ModuleCacheEntry *> _entries; // most recently used first
+	std::deque<ModuleCacheEntry *> _queue;
+	std::mutex _mutex;
+	std::condition_variable _cond;
+	std::thread _thread;
+	std::atomic<bool> _quit;
+	std::atomic<uint32_t> _size; // all the entries, increased by the rendering thread
+
+	ModuleCache()
+		: _quit(false), _size(0) {
+		_thread = std::thread(&ModuleCache::run, this);
+	}
+	~ModuleCache() {
+		{
+			std::lock_guard<std::mutex> lock(_mutex);
+			_quit = true;
+		}
+		_cond.notify_one();
+		_thread.join();
+		for (std::list<ModuleCacheEntry *>::iterator it = _entries.begin(); it != _entries.end(); ++it) {
+			delete *it;
+		}
+	}
+
+	// the returned entry is referenced
+	ModuleCacheEntry *request(uint16_t resNum, uint16_t delay, uint8_t pos, int rate, const SfxModule &mod, uint16_t eventsDelay, const MemEntry *me) {
+		for (std::list<ModuleCacheEntry *>::iterator it = _entries.begin(); it != _entries.end(); ++it) {
+			ModuleCacheEntry *entry = *it;
+			if (entry->resNum == resNum && entry->delay == delay && entry->pos == pos && entry->rate == rate) {
+				_entries.splice(_entries.begin(), _entries, it);
+				entry->refs.fetch_add(1, std::memory_order_relaxed);
+				return entry;
+			}
+		}
+		ModuleCacheEntry *entry = new ModuleCacheEntry;
+		entry->resNum = resNum;
+		entry->delay = delay;
+		entry->pos = pos;
+		entry->rate = rate;
+		entry->eventsDelay = eventsDelay;
+		uint32_t size = me->unpackedSize;
+		for (int i = 0; i < 15; ++i) {
+			size += mod.samples[i].size;
+		}
+		entry->data = (uint8_t *)malloc(size);
+		if (!entry->data) {
+			delete entry;
+			return 0;
+		}
+		memcpy(entry->data, me->bufPtr, me->unpackedSize);
+		entry->mod = mod;
+		entry->mod.data = entry->data + (mod.data - me->bufPtr);
+		entry->mod.orderTable = entry->data + (mod.orderTable - me->bufPtr);
+		uint8_t *p = entry->data + me->unpackedSize;
+		for (int i = 0; i < 15; ++i) {
+			SfxInstrument *ins = &entry->mod.samples[i];
+			if (ins->data) {
+				memcpy(p, ins->data, ins->size);
+				ins->data = p;
+				p += ins->size;
+			}
+		}
+		entry->refs.fetch_add(1, std::memory_order_relaxed);
+		_entries.push_front(entry);
+		evict();
+		{
+			std::lock_guard<std::mutex> lock(_mutex);
+			_queue.push_back(entry);
+		}
+		_cond.notify_one();
+		return entry;
+	}
+
+	static uint32_t getSize(const ModuleCacheEntry *entry) {
+		return entry->pcm.size() + entry->blocksOffset.size() * sizeof(uint32_t) + entry->states.size() * sizeof(ModuleState);
+	}
+
+	// leaves room for rendering a new entry, the ones being rendered or played are kept
+	void evict() {
+		std::list<ModuleCacheEntry *>::iterator it = _entries.end();
+		while (it != _entries.begin() && _size.load(std::memory_order_relaxed) > kMaxSize - kMaxEntrySize) {
+			--it;
+			ModuleCacheEntry *entry = *it;
+			if (entry->done.load(std::memory_order_acquire) && entry->refs.load(std::memory_order_acquire) == 0) {
+				debug(DBG_SND, "ModuleCache::evict() module 0x%X", entry->resNum);
+				_size.fetch_sub(getSize(entry), std::memory_order_relaxed);
+				it = _entries.erase(it);
+				delete entry;
+			}
+		}
+	}
+
+	void run() {
+		while (1) {
+			ModuleCacheEntry *entry = 0;
+			{
+				std::unique_lock<std::mutex> lock(_mutex);
+				while (!_quit && _queue.empty()) {
+					_cond.wait(lock);
+				}
+				if (_quit) {
+					break;
+				}
+				entry = _queue.front();
+				_queue.pop_front();
+			}
+			render(entry);
+		}
+	}
+
+	void render(ModuleCacheEntry *entry) {
+		ModulePlayer player(0);
+		player.reset(entry->rate);
+		player._sfxMod = entry->mod;
+		player._delay = entry->eventsDelay;
+		player._syncEvents = &entry->syncEvents;
+		int16_t samples[ModulePlayer::kCacheBlockFrames * 2];
+		const uint64_t maxFrames = (uint64_t)kMaxFrames * entry->rate / 44100;
+		uint32_t size = 0;
+		for (int block = 0; player._playing && player._frame < maxFrames && !_quit; ++block) {
+			if (size >= kMaxEntrySize || _size.load(std::memory_order_relaxed) >= kMaxSize) {
+				debug(DBG_SND, "ModuleCache::render() module 0x%X, cache full", entry->resNum);
+				break;
+			}
+			if ((block % kStateBlocks) == 0) {
+				entry->states.push_back(ModuleState());
+				player.saveState(&entry->states.back());
+			}
+			memset(samples, 0, sizeof(samples));
+			player.mixSamples(samples, ModulePlayer::kCacheBlockFrames);
+			entry->blocksOffset.push_back(entry->pcm.size());
+			encodeCacheBlock(samples, ModulePlayer::kCacheBlockFrames, entry->pcm);
+			const uint32_t blockSize = getSize(entry) - size;
+			_size.fetch_add(blockSize, std::memory_order_relaxed);
+			size += blockSize;
+		}
+		entry->states.push_back(ModuleState());
+		player.saveState(&entry->states.back());
+		_size.fetch_add(getSize(entry) - size, std::memory_order_relaxed);
+		entry->frames = player._frame;
+		debug(DBG_SND, "ModuleCache::render() module 0x%X, %d frames, %d bytes", entry->resNum, (int)entry->frames, (int)entry->pcm.size());
+		entry->done.store(true, std::memory_order_release);
+	}
 };
 
 ModulePlayer::ModulePlayer(Resource *res)
-	: _res(res), _delay(0) {
+	: _res(res), _delay(0), _resNum(0), _frame(0), _music(0), _syncEvents(0), _muteSync(false), _cache(0), _cacheEntry(0), _cacheState(kCacheLive) {
+	_syncLatched = false;
+	_syncLatch = -1;
 	_playing = false;
+	if (SfxPlayer::_prerender && _res) {
+		_cache = new ModuleCache;
+	}
+}
+
+ModulePlayer::~ModulePlayer() {
+	// the musics reference the cache entries
+	freeMusics(true);
+	delete _cache;
+}
+
+void ModulePlayer::saveState(ModuleState *state) const {
+	state->frame = _frame;
+	state->mod = _sfxMod;
+	state->delay = _delay;
+	state->samplesLeft = _samplesLeft;
+	state->playing = _playing;
+	for (int i = 0; i < NUM_CHANNELS; ++i) {
+		const SfxChannel *ch = &_channels[i];
+		SfxChannelState *s = &state->channels[i];
+		s->sampleData = ch->sampleData;
+		s->sampleLen = ch->sampleLen;
+		s->sampleLoopPos = ch->sampleLoopPos;
+		s->sampleLoopLen = ch->sampleLoopLen;
+		s->volume = ch->volume;
+		s->pos = ch->pos;
+		s->sincTable = ch->sincTable;
+	}
+}
+
+void ModulePlayer::loadState(const ModuleState *state) {
+	_frame = state->frame;
+	_sfxMod = state->mod;
+	_delay = state->delay;
+	_samplesLeft = state->samplesLeft;
+	_playing = state->playing;
+	for (int i = 0; i < NUM_CHANNELS; ++i) {
+		const SfxChannelState *s = &state->channels[i];
+		SfxChannel *ch = &_channels[i];
+		ch->sampleData = s->sampleData;
+		ch->sampleLen = s->sampleLen;
+		ch->sampleLoopPos = s->sampleLoopPos;
+		ch->sampleLoopLen = s->sampleLoopLen;
+		ch->volume = s->volume;
+		ch->pos = s->pos;
+		ch->sincTable = s->sincTable;
+		ch->tableVolume = -1;
+	}
+}
+
+// continues with the sequencer from the last cached state before the current position
+void ModulePlayer::detachCache() {
+	const uint64_t frame = _frame;
+	const ModuleState *state = &_cacheEntry->states[0];
+	for (size_t i = 1; i < _cacheEntry->states.size() && _cacheEntry->states[i].frame <= frame; ++i) {
+		state = &_cacheEntry->states[i];
+	}
+	loadState(state);
+	_muteSync = true;
+	while (_frame < frame) {
+		const int count = MIN<uint64_t>(frame - _frame, kCacheBlockFrames);
+		memset(_cacheBuf, 0, count * 2 * sizeof(int16_t));
+		mixSamples(_cacheBuf, count);
+	}
+	_muteSync = false;
+	_cacheState = kCacheDetached;
+}
+
+void ModulePlayer::streamSamples(int16_t *buf, int len) {
+	const std::vector<ModuleSyncEvent> &events = _cacheEntry->syncEvents;
+	while (len > 0) {
+		const int block = _frame / kCacheBlockFrames;
+		if (block != _cacheBlock) {
+			decodeCacheBlock(&_cacheEntry->pcm[_cacheEntry->blocksOffset[block]], _cacheBuf, kCacheBlockFrames);
+			_cacheBlock = block;
+		}
+		const int offset = _frame % kCacheBlockFrames;
+		const int count = MIN(len, kCacheBlockFrames - offset);
+		// set at the start of the ticks, as the sequencer does
+		for (; _syncEventIndex < events.size() && events[_syncEventIndex].frame < _frame + count; ++_syncEventIndex) {
+			setSync(events[_syncEventIndex].value);
+		}
+		const int16_t *src = _cacheBuf + offset * 2;
+		for (int i = 0; i < count * 2; ++i) {
+			buf[i] = mixS16(buf[i], src[i]);
+		}
+		buf += count * 2;
+		len -= count;
+		_frame += count;
+	}
 }
 
 void ModulePlayer::setSyncVar(int16_t *syncVar) {
 	_syncVar = syncVar;
 }
 
+void ModulePlayer::setSyncLatched(bool latched) {
+	_syncLatch = -1;
+	_syncLatched = latched;
+}
+
+bool ModulePlayer::getSyncEvent(int16_t *value) {
+	const int32_t latch = _syncLatch.exchange(-1);
+	if (latch < 0) {
+		return false;
+	}
+	*value = (int16_t)latch;
+	return true;
+}
+
+void ModulePlayer::setSync(int16_t value) {
+	if (_syncLatched) {
+		_syncLatch = (uint16_t)value;
+	} else {
+		*_syncVar = value;
+	}
+}
+
 void ModulePlayer::setEventsDelay(uint16_t delay) {
+	// the cached samples were rendered with the previous delay
+	if (_cacheState == kCacheStreaming) {
+		detachCache();
+	}
+	_cacheState = kCacheDetached;
 	_delay = delay;
 }
 
-void ModulePlayer::loadSfxModule(uint16_t resNum, uint16_t delay, uint8_t pos) {
+SfxMusic *ModulePlayer::loadSfxModule(uint16_t resNum, uint16_t delay, uint8_t pos, int rate) {
+	freeMusics(false);
+	ModuleMusic *music = new ModuleMusic;
+	if (!readModule(resNum, delay, pos, &music->mod, &music->eventsDelay)) {
+		warning("ModulePlayer::loadSfxModule() ec=0x%X", 0xF8);
+		delete music;
+		return 0;
+	}
+	music->resNum = resNum;
+	if (_cache && music->eventsDelay != 0) {
+		// copied and queued for rendering here, not in the audio callback
+		music->cacheEntry = _cache->request(resNum, delay, pos, rate, music->mod, music->eventsDelay, &_res->_memList[resNum]);
+	}
+	_musics.push_back(music);
+	return music;
+}
+
+bool ModulePlayer::readModule(uint16_t resNum, uint16_t delay, uint8_t pos, SfxModule *mod, uint16_t *eventsDelay) const {
 	MemEntry *me = &_res->_memList[resNum];
-	if (me->status == Resource::STATUS_LOADED && me->type == Resource::RT_MUSIC) {
-		memset(&_sfxMod, 0, sizeof(SfxModule));
-		_sfxMod.curOrder = pos;
-		_sfxMod.numOrder = me->bufPtr[0x3F];
-		debug(DBG_SND, "ModulePlayer::loadSfxModule() curOrder = 0x%X numOrder = 0x%X", _sfxMod.curOrder, _sfxMod.numOrder);
-		_sfxMod.orderTable = me->bufPtr + 0x40;
-		if (delay == 0) {
-			_delay = READ_BE_UINT16(me->bufPtr);
-		} else {
-			_delay = delay;
-		}
-		_sfxMod.data = me->bufPtr + 0xC0;
-		debug(DBG_SND, "ModulePlayer::loadSfxModule() eventDelay = %d ms", _delay);
-		prepareInstruments(me->bufPtr + 2);
+	if (me->status != Resource::STATUS_LOADED || me->type != Resource::RT_MUSIC) {
+		return false;
+	}
+	memset(mod, 0, sizeof(SfxModule));
+	mod->curOrder = pos;
+	mod->numOrder = me->bufPtr[0x3F];
+	debug(DBG_SND, "ModulePlayer::readModule() curOrder = 0x%X numOrder = 0x%X", mod->curOrder, mod->numOrder);
+	mod->orderTable = me->bufPtr + 0x40;
+	if (delay == 0) {
+		*eventsDelay = READ_BE_UINT16(me->bufPtr);
 	} else {
-		warning("ModulePlayer::loadSfxModule() ec=0x%X", 0xF8);
+		*eventsDelay = delay;
 	}
+	mod->data = me->bufPtr + 0xC0;
+	debug(DBG_SND, "ModulePlayer::readModule() eventDelay = %d ms", *eventsDelay);
+	prepareInstruments(me->bufPtr + 2, mod);
+	return true;
 }
 
-void ModulePlayer::prepareInstruments(const uint8_t *p) {
-	memset(_sfxMod.samples, 0, sizeof(_sfxMod.samples));
+void ModulePlayer::prepareInstruments(const uint8_t *p, SfxModule *mod) const {
+	memset(mod->samples, 0, sizeof(mod->samples));
 	for (int i = 0; i < 15; ++i) {
-		SfxInstrument *ins = &_sfxMod.samples[i];
+		SfxInstrument *ins = &mod->samples[i];
 		uint16_t resNum = READ_BE_UINT16(p); p += 2;
 		if (resNum != 0) {
 			ins->volume = READ_BE_UINT16(p);
 			MemEntry *me = &_res->_memList[resNum];
 			if (me->status == Resource::STATUS_LOADED && me->type == Resource::RT_SOUND) {
 				ins->data = me->bufPtr;
+				ins->size = me->unpackedSize;
 				debug(DBG_SND, "Loaded instrument 0x%X n=%d volume=%d", resNum, i, ins->volume);
 			} else {
 				error("Error loading instrument 0x%X", resNum);
@@ -205,11 +707,38 @@ void ModulePlayer::prepareInstruments(const uint8_t *p) {
 	}
 }
 
-void ModulePlayer::play(int rate) {
+// audio callback, the music was loaded by the game thread
+void ModulePlayer::play(int rate, SfxMusic *music) {
+	if (_music) {
+		retireMusic(_music);
+	}
+	_music = (ModuleMusic *)music;
+	reset(rate);
+	if (!_music) {
+		_playing = false;
+		_delay = 0;
+		return;
+	}
+	_resNum = _music->resNum;
+	_sfxMod = _music->mod;
+	_sfxMod.curPos = 0;
+	_delay = _music->eventsDelay;
+	_cacheEntry = _music->cacheEntry;
+	_cacheState = _cacheEntry ? kCacheLive : kCacheDetached;
+}
+
+void ModulePlayer::reset(int rate) {
 	_playing = true;
 	_rate = rate;
 	_samplesLeft = 0;
 	memset(_channels, 0, sizeof(_channels));
+	for (int i = 0; i < NUM_CHANNELS; ++i) {
+		_channels[i].tableVolume = -1;
+	}
+	_frame = 0;
+	_cacheEntry = 0;
+	_cacheState = kCacheDetached;
+	_cacheBlock = -1;
 }
 
 static int16_t toS16(int a) {
@@ -223,11 +752,24 @@ static int16_t toS16(int a) {
 	}
 }
 
-static void mixChannel(int16_t &s, SfxChannel *ch) {
-	if (ch->sampleLen == 0) {
-		return;
+static const int16_t *getVolumeTable(SfxChannel *ch) {
+	if (ch->tableVolume != ch->volume) {
+		for (int i = 0; i < 256; ++i) {
+			ch->volumeTable[i] = toS16((i - 128) * ch->volume / 64);
+		}
+		ch->tableVolume = ch->volume;
 	}
+	return ch->volumeTable;
+}
+
+static int getSincValue(int sum, int volume) {
+	return ((sum * 257) >> Resampler::kSincCoeffBits) * volume / 64;
+}
+
+// returns false once the sample has ended
+static bool readChannelSample(SfxChannel *ch, int *value) {
 	int pos1 = ch->pos.offset >> Frac::BITS;
+	const uint32_t frac = ch->pos.getFrac();
 	ch->pos.offset += ch->pos.inc;
 	int pos2 = pos1 + 1;
 	if (ch->sampleLoopLen != 0) {
@@ -238,11 +780,75 @@ static void mixChannel(int16_t &s, SfxChannel *ch) {
 	} else {
 		if (pos1 >= ch->sampleLen - 1) {
 			ch->sampleLen = 0;
-			return;
+			return false;
+		}
+	}
+	int sample;
+	switch (Resampler::_type) {
+	case kResamplerNearest:
+		sample = (int8_t)ch->sampleData[pos1];
+		break;
+	case kResamplerSinc: {
+			const uint32_t end = (ch->sampleLoopLen != 0) ? ch->sampleLoopPos + ch->sampleLoopLen : ch->sampleLen;
+			*value = getSincValue(sincSample(ch->sampleData, pos1, frac, end, ch->sampleLoopPos, ch->sampleLoopLen, ch->sincTable, 0), ch->volume);
+		}
+		return true;
+	default:
+		sample = ch->pos.interpolate((int8_t)ch->sampleData[pos1], (int8_t)ch->sampleData[pos2]);
+		break;
+	}
+	*value = getVolumeTable(ch)[sample + 128];
+	return true;
+}
+
+// mixes 'count' samples to every other int32_t of dst, the loop and end positions are
+// only checked for the last sample of each run
+static void mixChannel(int32_t *dst, int count, SfxChannel *ch) {
+	const int16_t *table = getVolumeTable(ch);
+	int i = 0;
+	while (i < count && ch->sampleLen != 0) {
+		const uint32_t end = (ch->sampleLoopLen != 0) ? ch->sampleLoopPos + ch->sampleLoopLen : ch->sampleLen;
+		const uint64_t limit = ((uint64_t)(end - 1)) << Frac::BITS;
+		const uint32_t inc = ch->pos.inc;
+		uint64_t offset = ch->pos.offset;
+		uint32_t n = 0;
+		if (offset < limit) {
+			n = (inc == 0) ? count - i : MIN<uint64_t>((limit - offset + inc - 1) / inc, count - i);
+		}
+		const int8_t *data = (const int8_t *)ch->sampleData;
+		int32_t *p = dst + i * 2;
+		switch (Resampler::_type) {
+		case kResamplerNearest:
+			for (uint32_t j = 0; j < n; ++j) {
+				p[j * 2] += table[data[offset >> Frac::BITS] + 128];
+				offset += inc;
+			}
+			break;
+		case kResamplerSinc:
+			for (uint32_t j = 0; j < n; ++j) {
+				p[j * 2] += getSincValue(sincSample(ch->sampleData, offset >> Frac::BITS, offset & Frac::MASK, end, ch->sampleLoopPos, ch->sampleLoopLen, ch->sincTable, 0), ch->volume);
+				offset += inc;
+			}
+			break;
+		default:
+			for (uint32_t j = 0; j < n; ++j) {
+				const uint32_t pos = offset >> Frac::BITS;
+				offset += inc;
+				const int fp = offset & Frac::MASK;
+				p[j * 2] += table[((data[pos] * (Frac::MASK - fp) + data[pos + 1] * fp) >> Frac::BITS) + 128];
+			}
+			break;
+		}
+		ch->pos.offset = offset;
+		i += n;
+		if (i < count) {
+			int value;
+			if (readChannelSample(ch, &value)) {
+				dst[i * 2] += value;
+			}
+			++i;
 		}
 	}
-	int sample = ch->pos.interpolate((int8_t)ch->sampleData[pos1], (int8_t)ch->sampleData[pos2]);
-	s = mixS16(s, toS16(sample * ch->volume / 64));
 }
 
 void ModulePlayer::mixSamples(int16_t *buf, int len) {
@@ -256,31 +862,60 @@ void ModulePlayer::mixSamples(int16_t *buf, int len) {
 		if (count > len) {
 			count = len;
 		}
+		if (count > kMixBlockSize) {
+			count = kMixBlockSize;
+		}
 		_samplesLeft -= count;
 		len -= count;
-		for (int i = 0; i < count; ++i) {
-			mixChannel(*buf, &_channels[0]);
-			mixChannel(*buf, &_channels[3]);
-			++buf;
-			mixChannel(*buf, &_channels[1]);
-			mixChannel(*buf, &_channels[2]);
-			++buf;
-		}
+		_frame += count;
+		unpackS16(buf, _mixBuf, count * 2);
+		mixChannel(_mixBuf, count, &_channels[0]);
+		mixChannel(_mixBuf, count, &_channels[3]);
+		mixChannel(_mixBuf + 1, count, &_channels[1]);
+		mixChannel(_mixBuf + 1, count, &_channels[2]);
+		packS16(_mixBuf, buf, count * 2);
+		buf += count * 2;
 	}
 }
 
 void ModulePlayer::readSamples(int16_t *buf, int len) {
-	if (_delay != 0) {
-		mixSamples(buf, len / 2);
+	if (_delay == 0) {
+		return;
 	}
-}
-
-void ModulePlayer::start() {
-	_sfxMod.curPos = 0;
+	len /= 2;
+	if (_cacheState == kCacheLive && _cacheEntry->done.load(std::memory_order_acquire)) {
+		if (_frame < _cacheEntry->frames) {
+			_cacheState = kCacheStreaming;
+			_syncEventIndex = 0;
+			while (_syncEventIndex < _cacheEntry->syncEvents.size() && _cacheEntry->syncEvents[_syncEventIndex].frame < _frame) {
+				++_syncEventIndex;
+			}
+		} else {
+			_cacheState = kCacheDetached;
+		}
+	}
+	if (_cacheState == kCacheStreaming) {
+		const int count = MIN<uint64_t>(len, _cacheEntry->frames - _frame);
+		streamSamples(buf, count);
+		buf += count * 2;
+		len -= count;
+		if (len == 0) {
+			return;
+		}
+		// end of the rendered module
+		detachCache();
+	}
+	mixSamples(buf, len);
 }
 
 void ModulePlayer::stop() {
 	_playing = false;
+	if (_music) {
+		retireMusic(_music);
+		_music = 0;
+	}
+	_cacheEntry = 0;
+	_cacheState = kCacheDetached;
 }
 
 void ModulePlayer::handleEvents() {
@@ -347,7 +982,14 @@ void ModulePlayer::handlePattern(uint8_t channel, const uint8_t *data) {
 	}
 	if (pat.note_1 == 0xFFFD) {
 		debug(DBG_SND, "ModulePlayer::handlePattern() _syncVar = 0x%X", pat.note_2);
-		*_syncVar = pat.note_2;
+		if (_syncEvents) {
+			ModuleSyncEvent ev;
+			ev.frame = _frame;
+			ev.value = pat.note_2;
+			_syncEvents->push_back(ev);
+		} else if (!_muteSync) {
+			setSync(pat.note_2);
+		}
 	} else if (pat.note_1 == 0xFFFE) {
 		_channels[channel].sampleLen = 0;
 	} else if (pat.note_1 != 0 && pat.sampleBuffer != 0) {
@@ -363,6 +1005,7 @@ void ModulePlayer::handlePattern(uint8_t channel, const uint8_t *data) {
 		ch->volume = pat.sampleVolume;
 		ch->pos.offset = 0;
 		ch->pos.inc = (freq << Frac::BITS) / _rate;
+		ch->sincTable = (Resampler::_type == kResamplerSinc) ? Resampler::getSincTable(ch->pos.inc) : 0;
 	}
 }
 
@@ -393,6 +1036,21 @@ struct MidiFile {
 	MidiInstrument instruments[128];
 };
 
+struct MidiMusic: SfxMusic {
+	MidiFile midiFile; // owns the data
+
+	MidiMusic() {
+		memset(&midiFile, 0, sizeof(MidiFile));
+	}
+	~MidiMusic() {
+		free((void *)midiFile.data);
+		free(midiFile.tracks);
+		for (int i = 0; i < 128; ++i) {
+			free((void *)midiFile.instruments[i].data);
+		}
+	}
+};
+
 struct MidiChannel {
 	const uint8_t *sampleData;
 	int32_t sampleLen;
@@ -415,7 +1073,8 @@ struct MidiPlayer: SfxPlayer_impl {
 
 	Resource *_res;
 
-	MidiFile _midiFile;
+	MidiMusic *_music;
+	MidiFile _midiFile; // copy of the music file, the tracks are advanced while playing
 	bool _playing;
 	int _rate;
 	int _samplesLeft;
@@ -424,21 +1083,22 @@ struct MidiPlayer: SfxPlayer_impl {
 	MidiPlayer(Resource *res);
 
 	virtual void setSyncVar(int16_t *syncVar);
+	virtual void setSyncLatched(bool latched);
+	virtual bool getSyncEvent(int16_t *value);
 	virtual void setEventsDelay(uint16_t delay);
-	virtual void loadSfxModule(uint16_t resNum, uint16_t delay, uint8_t pos);
-	void readMidi(const uint8_t *p, uint32_t offset);
-	void prepareInstruments();
-	virtual void play(int rate);
+	virtual SfxMusic *loadSfxModule(uint16_t resNum, uint16_t delay, uint8_t pos, int rate);
+	void readMidi(MidiFile *midiFile, const uint8_t *p, uint32_t offset);
+	void prepareInstruments(MidiFile *midiFile);
+	virtual void play(int rate, SfxMusic *music);
 	void mixSamples(int16_t *buf, int len);
 	virtual void readSamples(int16_t *buf, int len);
-	virtual void start();
 	virtual void stop();
 	void handleEvents();
 	//void handlePattern(uint8_t channel, const uint8_t *patternData);
 };
 
 MidiPlayer::MidiPlayer(Resource *res)
-	: _res(res) {
+	: _res(res), _music(0) {
 	_playing = false;
 	memset(&_midiFile, 0, sizeof(MidiFile));
 }
@@ -446,23 +1106,32 @@ MidiPlayer::MidiPlayer(Resource *res)
 void MidiPlayer::setSyncVar(int16_t *syncVar) {
 }
 
-void MidiPlayer::setEventsDelay(uint16_t delay) {
+void MidiPlayer::setSyncLatched(bool latched) {
+}
+
+bool MidiPlayer::getSyncEvent(int16_t *value) {
+	return false;
 }
 
-void MidiPlayer::loadSfxModule(uint16_t resNum, uint16_t delay, uint8_t pos) {
-	stop();
+void MidiPlayer::setEventsDelay(uint16_t delay) {
+}
 
+SfxMusic *MidiPlayer::loadSfxModule(uint16_t resNum, uint16_t delay, uint8_t pos, int rate) {
+	freeMusics(false);
+	MidiMusic *music = new MidiMusic;
 	uint32_t offset;
 	const char *p = _res->getMusicPath(resNum, 0, 0, &offset);
 	if (p) {
-		readMidi((const uint8_t *)p, offset);
-		prepareInstruments();
+		readMidi(&music->midiFile, (const uint8_t *)p, offset);
+		prepareInstruments(&music->midiFile);
 	}
+	_musics.push_back(music);
+	return music;
 }
 
-void MidiPlayer::readMidi(const uint8_t *p, uint32_t offset) {
-	memset(&_midiFile, 0, sizeof(MidiFile));
-	_midiFile.data = p;
+void MidiPlayer::readMidi(MidiFile *midiFile, const uint8_t *p, uint32_t offset) {
+	memset(midiFile, 0, sizeof(MidiFile));
+	midiFile->data = p;
 	p += offset;
 
 	uint32_t mthdMagic = READ_BE_UINT32(p);
@@ -481,22 +1150,22 @@ void MidiPlayer::readMidi(const uint8_t *p, uint32_t offset) {
 	}
 	p += 14;
 
-	_midiFile.tracks = (MidiTrack *)malloc(numberOfTracks * sizeof(MidiTrack));
-	if (!_midiFile.tracks) return;
+	midiFile->tracks = (MidiTrack *)malloc(numberOfTracks * sizeof(MidiTrack));
+	if (!midiFile->tracks) return;
 
 	for (int i = 0; i < numberOfTracks; ++i) {
 		uint32_t mtrkMagic = READ_BE_UINT32(p);
 		if (mtrkMagic != TYPE_MTrk) return;
 		uint32_t mtrkLength = READ_BE_UINT32(p + 4);
 		p += 8;
-		_midiFile.tracks[i].data = p;
-		_midiFile.tracks[i].length = mtrkLength;
+		midiFile->tracks[i].data = p;
+		midiFile->tracks[i].length = mtrkLength;
 		p += mtrkLength;
 	}
 
-	_midiFile.numberOfTracks = numberOfTracks;
-	_midiFile.timeDivision = timeDivision;
-	_midiFile.tempo = 500000;
+	midiFile->numberOfTracks = numberOfTracks;
+	midiFile->timeDivision = timeDivision;
+	midiFile->tempo = 500000;
 
 	debug(DBG_SND, "MidiPlayer::readMidi() formatType = %i numberOfTracks = %i timeDivision = 0x%X", formatType, numberOfTracks, timeDivision);
 }
@@ -516,10 +1185,10 @@ static unsigned int readVariableLength(const uint8_t *&p, unsigned int &length)
 	return (length) ? varLength : 0;
 }
 
-void MidiPlayer::prepareInstruments() {
-	for (unsigned int i = 0; i < _midiFile.numberOfTracks; ++i) {
-		const uint8_t *p = _midiFile.tracks[i].data;
-		unsigned int length = _midiFile.tracks[i].length, varLength;
+void MidiPlayer::prepareInstruments(MidiFile *midiFile) {
+	for (unsigned int i = 0; i < midiFile->numberOfTracks; ++i) {
+		const uint8_t *p = midiFile->tracks[i].data;
+		unsigned int length = midiFile->tracks[i].length, varLength;
 		uint8_t status = 0;
 		while (length) {
 			readVariableLength(p, length);
@@ -542,12 +1211,12 @@ void MidiPlayer::prepareInstruments() {
 				if (length) {
 					uint8_t num = *p++;
 					--length;
-					if (!_midiFile.instruments[num].loaded) {
-						_midiFile.instruments[num].loaded = true;
+					if (!midiFile->instruments[num].loaded) {
+						midiFile->instruments[num].loaded = true;
 						uint32_t offset;
 						const uint8_t *p2 = _res->getInstrument(num, &offset);
 						if (p2) {
-							MidiInstrument *instrument = &_midiFile.instruments[num];
+							MidiInstrument *instrument = &midiFile->instruments[num];
 							instrument->data = p2;
 							instrument->offset = offset + 42;
 							instrument->length = READ_BE_UINT32(p2 + offset + 24);
@@ -619,7 +1288,21 @@ void MidiPlayer::prepareInstruments() {
 	}
 }
 
-void MidiPlayer::play(int rate) {
+// audio callback, the music was loaded by the game thread
+void MidiPlayer::play(int rate, SfxMusic *music) {
+	if (_music) {
+		retireMusic(_music);
+	}
+	_music = (MidiMusic *)music;
+	if (_music) {
+		_midiFile = _music->midiFile;
+	} else {
+		memset(&_midiFile, 0, sizeof(MidiFile));
+	}
+	for (unsigned int i = 0; i < _midiFile.numberOfTracks; ++i) {
+		_midiFile.tracks[i].delta = readVariableLength(_midiFile.tracks[i].data, _midiFile.tracks[i].length);
+		_midiFile.tracks[i].status = 0;
+	}
 	_playing = (_midiFile.numberOfTracks != 0);
 	_rate = rate;
 	_samplesLeft = 0;
@@ -686,29 +1369,12 @@ void MidiPlayer::readSamples(int16_t *buf, int len) {
 	}
 }
 
-void MidiPlayer::start() {
-	for (unsigned int i = 0; i < _midiFile.numberOfTracks; ++i) {
-		_midiFile.tracks[i].delta = readVariableLength(_midiFile.tracks[i].data, _midiFile.tracks[i].length);
-		_midiFile.tracks[i].status = 0;
-	}
-}
-
 void MidiPlayer::stop() {
 	_playing = false;
 	_midiFile.numberOfTracks = 0;
-	if (_midiFile.data) {
-		free((void *)_midiFile.data);
-		_midiFile.data = 0;
-	}
-	if (_midiFile.tracks) {
-		free(_midiFile.tracks);
-		_midiFile.tracks = 0;
-	}
-	for (int i = 0; i < 128; ++i) {
-		if (_midiFile.instruments[i].data) {
-			free((void *)_midiFile.instruments[i].data);
-			_midiFile.instruments[i].data = 0;
-		}
+	if (_music) {
+		retireMusic(_music);
+		_music = 0;
 	}
 }
 
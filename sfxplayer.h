@@ -10,21 +10,30 @@
 #include "intern.h"
 
 struct Resource;
+struct SfxMusic;
 struct SfxPlayer_impl;
 
 struct SfxPlayer {
+	static bool _prerender; // render the modules once on a background thread and play the samples
+
 	SfxPlayer_impl *_impl;
 
 	SfxPlayer();
 	~SfxPlayer();
 	void init(Resource *res);
 	void setSyncVar(int16_t *syncVar);
+	// the sync events are kept until read with getSyncEvent() instead of setting the variable
+	void setSyncLatched(bool latched);
+	bool getSyncEvent(int16_t *value);
 
 	void setEventsDelay(uint16_t delay);
-	void loadSfxModule(uint16_t resNum, uint16_t delay, uint8_t pos);
-	void play(int rate);
+	// game thread, reads the module and its instruments for play(), 0 on error
+	SfxMusic *loadSfxModule(uint16_t resNum, uint16_t delay, uint8_t pos, int rate);
+	// game thread, for a loaded music that was not passed to play()
+	void releaseMusic(SfxMusic *music);
+	// the music is owned by the player until stopped or replaced, it is freed by the next load
+	void play(int rate, SfxMusic *music);
 	void readSamples(int16_t *buf, int len);
-	void start();
 	void stop();
 };
 
@@ -0,0 +1,149 @@
+
+#include "statehash.h"
+#include "util.h"
+
+static const uint32_t kMagic = 0x52534853; // 'RSHS'
+static const uint16_t kVersion = 1;
+
+StateHash::StateHash()
+	: _recording(false), _verifying(false), _diverged(false), _frame(0), _tasksCount(0), _expectedTasksCount(0) {
+}
+
+StateHash::~StateHash() {
+	close();
+}
+
+bool StateHash::openForRecording(const char *path) {
+	if (!_f.openForWriting(path)) {
+		warning("Unable to open '%s' for writing", path);
+		return false;
+	}
+	_f.writeUint32BE(kMagic);
+	_f.writeUint16LE(kVersion);
+	_recording = true;
+	_frame = 0;
+	return true;
+}
+
+bool StateHash::openForVerifying(const char *path) {
+	if (!_f.open(path)) {
+		return false;
+	}
+	const uint32_t magic = _f.readUint32BE();
+	const uint16_t version = _f.readUint16LE();
+	if (magic != kMagic || version != kVersion) {
+		warning("Unhandled state hashes file '%s' magic 0x%X version %d", path, magic, version);
+		_f.close();
+		return false;
+	}
+	_verifying = true;
+	_diverged = false;
+	_frame = 0;
+	return true;
+}
+
+void StateHash::close() {
+	if (_verifying && !_diverged) {
+		debug(DBG_INFO, "State hashes matched for %d frames", _frame);
+	}
+	_recording = _verifying = false;
+	_f.close();
+}
+
+void StateHash::beginFrame() {
+	_tasksCount = 0;
+	if (_verifying) {
+		uint8_t buf[9];
+		if (_f.read(buf, 1) != 1) {
+			debug(DBG_INFO, "End of state hashes after %d frames", _frame);
+			_verifying = false;
+			return;
+		}
+		_expectedTasksCount = buf[0];
+		if (_expectedTasksCount > kMaxTasks) {
+			warning("Invalid state hashes at frame %d : %d tasks", _frame, _expectedTasksCount);
+			_verifying = false;
+			return;
+		}
+		for (int i = 0; i < _expectedTasksCount; ++i) {
+			if (_f.read(buf, 9) != 9) {
+				break;
+			}
+			TaskHash *t = &_expectedTasks[i];
+			t->slot = buf[0];
+			t->startPc = READ_LE_UINT16(buf + 1);
+			t->endPc = READ_LE_UINT16(buf + 3);
+			t->hash = READ_LE_UINT32(buf + 5);
+		}
+		_expectedStateHash = _f.readUint32LE();
+		_expectedPageHash = _f.readUint32LE();
+		if (_f.ioErr()) {
+			debug(DBG_INFO, "Truncated state hashes after %d frames", _frame);
+			_verifying = false;
+		}
+	}
+}
+
+bool StateHash::addTask(int slot, uint16_t startPc, uint16_t endPc, uint32_t hash, uint8_t opcode, uint16_t opcodePc) {
+	if (_tasksCount >= kMaxTasks) {
+		return true;
+	}
+	TaskHash *t = &_tasks[_tasksCount];
+	t->slot = slot;
+	t->startPc = startPc;
+	t->endPc = endPc;
+	t->hash = hash;
+	if (_verifying) {
+		if (_tasksCount >= _expectedTasksCount) {
+			warning("State divergence at frame %d : task 0x%02X pc 0x%04X ran, no task expected", _frame, slot, startPc);
+			_diverged = true;
+		} else {
+			const TaskHash *e = &_expectedTasks[_tasksCount];
+			if (e->slot != slot || e->startPc != startPc) {
+				warning("State divergence at frame %d : task 0x%02X pc 0x%04X ran, expected task 0x%02X pc 0x%04X", _frame, slot, startPc, e->slot, e->startPc);
+				_diverged = true;
+			} else if (e->endPc != endPc || e->hash != hash) {
+				warning("State divergence at frame %d : task 0x%02X pc 0x%04X ended at 0x%04X hash 0x%08X, expected 0x%04X hash 0x%08X, last opcode 0x%02X at 0x%04X", _frame, slot, startPc, endPc, hash, e->endPc, e->hash, opcode, opcodePc);
+				_diverged = true;
+			}
+		}
+		if (_diverged) {
+			_verifying = false;
+			return false;
+		}
+	}
+	++_tasksCount;
+	return true;
+}
+
+bool StateHash::endFrame(uint32_t stateHash, uint32_t pageHash) {
+	if (_recording) {
+		_f.writeByte(_tasksCount);
+		for (int i = 0; i < _tasksCount; ++i) {
+			const TaskHash *t = &_tasks[i];
+			_f.writeByte(t->slot);
+			_f.writeUint16LE(t->startPc);
+			_f.writeUint16LE(t->endPc);
+			_f.writeUint32LE(t->hash);
+		}
+		_f.writeUint32LE(stateHash);
+		_f.writeUint32LE(pageHash);
+	} else if (_verifying) {
+		if (_tasksCount != _expectedTasksCount) {
+			warning("State divergence at frame %d : %d tasks ran, expected %d", _frame, _tasksCount, _expectedTasksCount);
+			_diverged = true;
+		} else if (stateHash != _expectedStateHash) {
+			warning("State divergence at frame %d : tasks state hash 0x%08X, expected 0x%08X", _frame, stateHash, _expectedStateHash);
+			_diverged = true;
+		} else if (pageHash != _expectedPageHash) {
+			warning("Display divergence at frame %d : page hash 0x%08X, expected 0x%08X", _frame, pageHash, _expectedPageHash);
+			_diverged = true;
+		}
+		if (_diverged) {
+			_verifying = false;
+			return false;
+		}
+	}
+	++_frame;
+	return true;
+}
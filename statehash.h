@@ -0,0 +1,47 @@
+
+#ifndef STATEHASH_H__
+#define STATEHASH_H__
+
+#include "intern.h"
+#include "file.h"
+
+struct TaskHash {
+	uint8_t slot;
+	uint16_t startPc, endPc;
+	uint32_t hash; // script variables after the task ran
+};
+
+// Per frame hashes of the interpreter state and the displayed page. They are
+// written next to the input journal when recording and compared when replaying.
+struct StateHash {
+	enum {
+		kMaxTasks = 64
+	};
+
+	File _f;
+	bool _recording;
+	bool _verifying;
+	bool _diverged;
+	uint32_t _frame;
+	TaskHash _tasks[kMaxTasks];
+	int _tasksCount;
+	TaskHash _expectedTasks[kMaxTasks];
+	int _expectedTasksCount;
+	uint32_t _expectedStateHash, _expectedPageHash;
+
+	StateHash();
+	~StateHash();
+
+	bool openForRecording(const char *path);
+	bool openForVerifying(const char *path);
+	void close();
+
+	bool isActive() const { return _recording || _verifying; }
+
+	void beginFrame();
+	// returns false when the state diverges from the recording
+	bool addTask(int slot, uint16_t startPc, uint16_t endPc, uint32_t hash, uint8_t opcode, uint16_t opcodePc);
+	bool endFrame(uint32_t stateHash, uint32_t pageHash);
+};
+
+#endif
@@ -27,6 +27,7 @@ struct PlayerInput {
 	char lastChar;
 	bool fastMode;
 	bool screenshot;
+	bool rewind;
 };
 
 struct DisplayMode {
@@ -63,8 +64,11 @@ struct SystemStub {
 	virtual void processEvents() = 0;
 	virtual void sleep(uint32_t duration) = 0;
 	virtual uint32_t getTimeStamp() = 0;
+
+	virtual void setRewindKey(const char *name) {}
 };
 
 extern SystemStub *SystemStub_SDL_create();
+extern SystemStub *SystemStub_Null_create();
 
 #endif
@@ -0,0 +1,41 @@
+
+#include "systemstub.h"
+
+// Headless stub : nothing is displayed, no events are read and time only
+// advances when sleeping, making runs independent of the host speed.
+struct SystemStub_Null : SystemStub {
+
+	uint32_t _timeStamp;
+
+	SystemStub_Null()
+		: _timeStamp(0) {
+	}
+	virtual ~SystemStub_Null() {}
+
+	virtual void init(const char *title, const DisplayMode *dm) {
+		_dm = *dm;
+	}
+	virtual void fini() {}
+
+	virtual void prepareScreen(int &w, int &h, float ar[4]) {
+		w = _dm.width;
+		h = _dm.height;
+		ar[0] = ar[1] = 0.f;
+		ar[2] = ar[3] = 1.f;
+	}
+	virtual void updateScreen() {}
+	virtual void setScreenPixelsCLUT(const uint8_t *data, const uint8_t *pal, int w, int h) {}
+	virtual void setScreenPixels555(const uint16_t *data, int w, int h) {}
+
+	virtual void processEvents() {}
+	virtual void sleep(uint32_t duration) {
+		_timeStamp += duration;
+	}
+	virtual uint32_t getTimeStamp() {
+		return _timeStamp;
+	}
+};
+
+SystemStub *SystemStub_Null_create() {
+	return new SystemStub_Null();
+}
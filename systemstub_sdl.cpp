@@ -25,6 +25,7 @@ struct SystemStub_SDL : SystemStub {
 	SDL_Joystick *_joystick;
 	SDL_GameController *_controller;
 	int _screenshot;
+	SDL_Keycode _rewindKey;
 
 	SystemStub_SDL();
 	virtual ~SystemStub_SDL() {}
@@ -42,13 +43,15 @@ struct SystemStub_SDL : SystemStub {
 	virtual void sleep(uint32_t duration);
 	virtual uint32_t getTimeStamp();
 
+	virtual void setRewindKey(const char *name);
+
 	void setAspectRatio(int w, int h);
 };
 
 const float SystemStub_SDL::kAspectRatio = 16.f / 10.f;
 
 SystemStub_SDL::SystemStub_SDL()
-	: _w(0), _h(0), _window(0), _renderer(0), _texW(0), _texH(0), _texture(0) {
+	: _w(0), _h(0), _window(0), _renderer(0), _texW(0), _texH(0), _texture(0), _rewindKey(SDLK_TAB) {
 }
 
 void SystemStub_SDL::init(const char *title, const DisplayMode *dm) {
@@ -284,6 +287,10 @@ void SystemStub_SDL::processEvents() {
 			}
 			break;
 		case SDL_KEYUP:
+			if (ev.key.keysym.sym == _rewindKey) {
+				_pi.rewind = false;
+				break;
+			}
 			switch (ev.key.keysym.sym) {
 			case SDLK_LEFT:
 				_pi.dirMask &= ~PlayerInput::DIR_LEFT;
@@ -344,6 +351,10 @@ void SystemStub_SDL::processEvents() {
 				}
 				break;
 			}
+			if (ev.key.keysym.sym == _rewindKey) {
+				_pi.rewind = true;
+				break;
+			}
 			if (ev.key.keysym.sym < 128) {
 				_pi.lastChar = ev.key.keysym.sym;
 			}
@@ -530,6 +541,15 @@ uint32_t SystemStub_SDL::getTimeStamp() {
 	return SDL_GetTicks();
 }
 
+void SystemStub_SDL::setRewindKey(const char *name) {
+	const SDL_Keycode key = SDL_GetKeyFromName(name);
+	if (key == SDLK_UNKNOWN) {
+		warning("Unknown rewind key '%s'", name);
+	} else {
+		_rewindKey = key;
+	}
+}
+
 void SystemStub_SDL::setAspectRatio(int w, int h) {
 	const float currentAspectRatio = w / (float)h;
 	if (int(currentAspectRatio * 100) == int(kAspectRatio * 100)) {
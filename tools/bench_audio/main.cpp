@@ -0,0 +1,505 @@
+
+// Renders the mixer and module player outputs as the audio device callback would, without
+// an audio device, and reports the cost per stereo sample and the slowest buffer.
+
+#include <getopt.h>
+#include <stdlib.h>
+#include <chrono>
+#include <vector>
+#include "../../graphics.h"
+#include "../../file.h"
+#include "../../mixer.h"
+#include "../../resampler.h"
+#include "../../resource.h"
+#include "../../script.h"
+#include "../../sfxplayer.h"
+#include "../../systemstub.h"
+#include "../../util.h"
+#include "../../video.h"
+
+// defined in the game main.cpp
+bool Graphics::_is1991 = false;
+bool Graphics::_use555 = false;
+bool Video::_useEGA = false;
+Difficulty Script::_difficulty = DIFFICULTY_NORMAL;
+bool Script::_useRemasteredAudio = true;
+bool SfxPlayer::_prerender = false;
+
+static const char USAGE[] =
+	"Usage: %s [OPTIONS]...\n"
+	"  --datapath=PATH   Also benchmark the sounds and modules of the DOS, Amiga or Atari data\n"
+	"  --rate=HZ         Output sample rate (default 44100)\n"
+	"  --buffer=N        Frames rendered per callback (default 4096)\n"
+	"  --seconds=N       Duration rendered per case (default 10)\n"
+	"  --resampler=NAME  Only use this resampler (nearest,linear,sinc)\n"
+	"  --case=NAME       Only run the cases whose name contains NAME\n"
+	;
+
+static const struct {
+	const char *name;
+	int type;
+} RESAMPLERS[] = {
+	{ "nearest", kResamplerNearest },
+	{ "linear", kResamplerLinear },
+	{ "sinc", kResamplerSinc },
+	{ 0, -1 }
+};
+
+struct Options {
+	const char *dataPath;
+	int rate;
+	int bufferSize;
+	int seconds;
+	int resampler;
+	const char *filter;
+};
+
+static uint64_t getTimeNs() {
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+struct BenchCase {
+	virtual ~BenchCase() {}
+	virtual void update(int buffer) {} // called before rendering each buffer
+	virtual void render(int16_t *buf, int len) = 0; // len is the number of int16_t
+};
+
+struct MixerCase: BenchCase {
+	SystemStub *_stub;
+	Mixer _mix;
+
+	MixerCase(MixerType type, SfxPlayer *sfx, const Options &opt)
+		: _mix(sfx) {
+		// the null stub clock does not advance : nothing is rendered outside of render()
+		_stub = SystemStub_Null_create();
+		_mix.setAudioFormat(opt.rate, opt.bufferSize);
+		_mix.setOffline(0);
+		_mix.init(type, _stub);
+	}
+	virtual ~MixerCase() {
+		_mix.quit();
+		delete _stub;
+	}
+	virtual void render(int16_t *buf, int len) {
+		_mix.mixSamples(buf, len);
+	}
+};
+
+struct ModuleCase: BenchCase {
+	SfxPlayer _sfx;
+	int16_t _syncVar;
+
+	ModuleCase(Resource *res, int num, const Options &opt)
+		: _syncVar(0) {
+		_sfx.init(res);
+		_sfx.setSyncVar(&_syncVar);
+		_sfx.play(opt.rate, _sfx.loadSfxModule(num, 0, 0, opt.rate));
+	}
+	virtual void render(int16_t *buf, int len) {
+		memset(buf, 0, len * sizeof(int16_t));
+		_sfx.readSamples(buf, len);
+	}
+};
+
+static void runCase(const char *name, BenchCase *b, const Options &opt, const char *resampler) {
+	std::vector<int16_t> buf(opt.bufferSize * 2);
+	const int buffers = (int64_t)opt.seconds * opt.rate / opt.bufferSize;
+	uint64_t total = 0, peak = 0;
+	uint32_t hash = kHashInit;
+	for (int i = 0; i < buffers; ++i) {
+		b->update(i);
+		const uint64_t t = getTimeNs();
+		b->render(&buf[0], buf.size());
+		const uint64_t duration = getTimeNs() - t;
+		total += duration;
+		peak = MAX(peak, duration);
+		hash = HASH_DATA(hash, &buf[0], buf.size() * sizeof(int16_t));
+	}
+	const double frames = (double)buffers * opt.bufferSize;
+	const double load = total * 100. / (frames * 1000000000. / opt.rate);
+	fprintf(stdout, "%-28s %-8s %10.2f %10.1f %7.2f%% 0x%08X\n", name, resampler, total / frames, peak / 1000., load, hash);
+	fflush(stdout);
+}
+
+static bool matchCase(const Options &opt, const char *name) {
+	return !opt.filter || strstr(name, opt.filter) != 0;
+}
+
+// synthetic data, looped so the channels stay busy
+
+static void writeBE32(uint8_t *p, uint32_t value) {
+	p[0] = value >> 24;
+	p[1] = (value >> 16) & 255;
+	p[2] = (value >> 8) & 255;
+	p[3] = value & 255;
+}
+
+static void makeRaw(std::vector<uint8_t> &data, int len, int loopLen, int period) {
+	data.resize(8 + len + loopLen);
+	data[0] = (len / 2) >> 8;
+	data[1] = (len / 2) & 255;
+	data[2] = (loopLen / 2) >> 8;
+	data[3] = (loopLen / 2) & 255;
+	for (int i = 0; i < len + loopLen; ++i) {
+		data[8 + i] = (int8_t)(((i % period) * 200 / period) - 100 + (rand() % 16));
+	}
+}
+
+static void makeMac(std::vector<uint8_t> &data, int len, int period) {
+	data.assign(42 + len, 0);
+	writeBE32(&data[24], len);
+	writeBE32(&data[32], 0); // loop start
+	writeBE32(&data[36], len); // loop end
+	for (int i = 0; i < len; ++i) {
+		data[42 + i] = 128 + ((i % period) * 200 / period) - 100 + (rand() % 16);
+	}
+}
+
+static void makeWav(std::vector<uint8_t> &data, int frames, int rate, bool bits16, bool stereo) {
+	const int channels = stereo ? 2 : 1;
+	const int bytesPerSample = bits16 ? 2 : 1;
+	const int dataSize = frames * channels * bytesPerSample;
+	data.assign(44 + dataSize, 0);
+	WRITE_LE_UINT32(&data[0], 0x46464952); // RIFF
+	WRITE_LE_UINT32(&data[4], 36 + dataSize);
+	WRITE_LE_UINT32(&data[8], 0x45564157); // WAVE
+	WRITE_LE_UINT32(&data[12], 0x20746D66); // fmt
+	WRITE_LE_UINT32(&data[16], 16);
+	data[20] = 1; // PCM
+	data[22] = channels;
+	WRITE_LE_UINT32(&data[24], rate);
+	WRITE_LE_UINT32(&data[28], rate * channels * bytesPerSample);
+	data[32] = channels * bytesPerSample;
+	data[34] = bits16 ? 16 : 8;
+	WRITE_LE_UINT32(&data[36], 0x61746164); // data
+	WRITE_LE_UINT32(&data[40], dataSize);
+	for (int i = 0; i < frames * channels; ++i) {
+		const int value = ((i / channels) % 100) * 600 - 30000 + (rand() % 512);
+		if (bits16) {
+			data[44 + i * 2] = value & 255;
+			data[44 + i * 2 + 1] = (value >> 8) & 255;
+		} else {
+			data[44 + i] = (value >> 8) + 128;
+		}
+	}
+}
+
+// stereo SDX2 compressed samples, as the 3DO music files
+static bool makeAifc(const char *path, int frames, int rate) {
+	File f;
+	if (!f.openForWriting(path)) {
+		return false;
+	}
+	const uint32_t ssndSize = 8 + frames * 2;
+	f.write("FORM", 4);
+	f.writeUint32BE(4 + 12 + 32 + 8 + ssndSize);
+	f.write("AIFC", 4);
+	f.write("FVER", 4);
+	f.writeUint32BE(4);
+	f.writeUint32BE(0xA2805140);
+	f.write("COMM", 4);
+	f.writeUint32BE(24);
+	f.writeUint16BE(2); // channels
+	f.writeUint32BE(frames);
+	f.writeUint16BE(16); // bits
+	int exp = 0;
+	while ((rate >> exp) > 1) {
+		++exp;
+	}
+	f.writeUint16BE(16383 + exp); // 80 bits extended
+	f.writeUint32BE(((uint32_t)rate) << (31 - exp));
+	f.writeUint32BE(0);
+	f.write("SDX2", 4);
+	f.writeUint16BE(0); // name
+	f.write("SSND", 4);
+	f.writeUint32BE(ssndSize);
+	f.writeUint32BE(0); // block offset
+	f.writeUint32BE(0); // block size
+	for (int i = 0; i < frames * 2; ++i) {
+		f.writeByte(rand());
+	}
+	const bool err = f.ioErr();
+	f.close();
+	return !err;
+}
+
+static void makeModule(std::vector<uint8_t> &module, int firstInstrument, int instrumentsCount) {
+	static const int kOrders = 32;
+	module.assign(0xC0 + 4 * 1024, 0);
+	module[0] = 3000 >> 8; // delay
+	module[1] = 3000 & 255;
+	for (int i = 0; i < instrumentsCount; ++i) {
+		module[2 + i * 4 + 1] = firstInstrument + i;
+		module[2 + i * 4 + 3] = 0x30; // volume
+	}
+	module[0x3F] = kOrders;
+	for (int i = 0; i < kOrders; ++i) {
+		module[0x40 + i] = i & 3;
+	}
+	for (int i = 0; i < 4 * 1024; i += 4) {
+		uint8_t *p = &module[0xC0 + i];
+		const int r = rand() % 8;
+		if (r < 5) {
+			const int period = 0x71 + rand() % 0x300;
+			const int note = ((1 + rand() % instrumentsCount) << 12) | ((5 + rand() % 2) << 8) | (rand() % 8);
+			p[0] = period >> 8;
+			p[1] = period & 255;
+			p[2] = note >> 8;
+			p[3] = note & 255;
+		} else if (r == 5) {
+			p[0] = 0xFF; // sync
+			p[1] = 0xFD;
+			p[3] = rand() % 16;
+		}
+	}
+}
+
+static void setEntry(Resource *res, int num, uint8_t type, std::vector<uint8_t> &data) {
+	MemEntry *me = &res->_memList[num];
+	me->status = Resource::STATUS_LOADED;
+	me->type = type;
+	me->bufPtr = &data[0];
+	me->unpackedSize = data.size();
+}
+
+struct RawChannelsCase: MixerCase {
+	RawChannelsCase(MixerType type, SfxPlayer *sfx, const Options &opt, std::vector<uint8_t> *sounds)
+		: MixerCase(type, sfx, opt) {
+		for (int i = 0; i < 4; ++i) {
+			const int freq = 8000 + i * 3000;
+			if (type == kMixerTypeMac) {
+				_mix.playSoundMac(i, &sounds[i][0], freq, 0x30);
+			} else {
+				_mix.playSoundRaw(i, &sounds[i][0], freq, 0x30);
+			}
+		}
+	}
+};
+
+struct WavChannelsCase: MixerCase {
+	WavChannelsCase(const Options &opt, std::vector<uint8_t> *sounds)
+		: MixerCase(kMixerTypeWav, 0, opt) {
+		for (int i = 0; i < 4; ++i) {
+			_mix.playSoundWav(i, i, &sounds[i][0], 8000 + i * 3000, 0x30, 1);
+		}
+	}
+};
+
+static void runSynthetic(const Options &opt, const char *resampler) {
+	srand(0);
+	std::vector<uint8_t> raw[4], mac[4], wav8[4], wav16[4];
+	for (int i = 0; i < 4; ++i) {
+		makeRaw(raw[i], 4000 + i * 1000, 2000, 20 + i * 7);
+		makeMac(mac[i], 6000 + i * 1000, 20 + i * 7);
+		makeWav(wav8[i], 22050, 22050, false, (i & 1) != 0);
+		makeWav(wav16[i], 22050, 22050, true, (i & 1) != 0);
+	}
+	if (matchCase(opt, "raw 4 channels")) {
+		RawChannelsCase b(kMixerTypeRaw, 0, opt, raw);
+		runCase("raw 4 channels", &b, opt, resampler);
+	}
+	if (matchCase(opt, "mac 4 channels")) {
+		RawChannelsCase b(kMixerTypeMac, 0, opt, mac);
+		runCase("mac 4 channels", &b, opt, resampler);
+	}
+	if (matchCase(opt, "wav 4 channels 8 bits")) {
+		WavChannelsCase b(opt, wav8);
+		runCase("wav 4 channels 8 bits", &b, opt, resampler);
+	}
+	if (matchCase(opt, "wav 4 channels 16 bits")) {
+		WavChannelsCase b(opt, wav16);
+		runCase("wav 4 channels 16 bits", &b, opt, resampler);
+	}
+	if (matchCase(opt, "aifc")) {
+		char path[512];
+		const char *tmpDir = getenv("TMPDIR");
+		snprintf(path, sizeof(path), "%s/bench_audio.aifc", tmpDir ? tmpDir : "/tmp");
+		if (!makeAifc(path, (opt.seconds + 1) * 22050, 22050)) {
+			warning("Unable to write '%s'", path);
+		} else {
+			MixerCase b(kMixerTypeAiff, 0, opt);
+			b._mix.playAifcMusic(path, 0);
+			runCase("aifc", &b, opt, resampler);
+			remove(path);
+		}
+	}
+	// the module uses the raw sounds as instruments
+	Resource res(0, 0);
+	std::vector<uint8_t> module;
+	makeModule(module, 10, 4);
+	setEntry(&res, 5, Resource::RT_MUSIC, module);
+	for (int i = 0; i < 4; ++i) {
+		setEntry(&res, 10 + i, Resource::RT_SOUND, raw[i]);
+	}
+	if (matchCase(opt, "module")) {
+		ModuleCase b(&res, 5, opt);
+		runCase("module", &b, opt, resampler);
+	}
+	if (matchCase(opt, "raw 4 channels + module")) {
+		SfxPlayer sfx;
+		int16_t syncVar = 0;
+		sfx.init(&res);
+		sfx.setSyncVar(&syncVar);
+		RawChannelsCase b(kMixerTypeRaw, &sfx, opt, raw);
+		b._mix.playSfxMusic(5, 0, 0);
+		runCase("raw 4 channels + module", &b, opt, resampler);
+	}
+}
+
+// the game sounds played in turn on the 4 channels, one per buffer
+struct GameSoundsCase: MixerCase {
+	std::vector<const uint8_t *> _sounds;
+
+	GameSoundsCase(const Options &opt, const std::vector<const uint8_t *> &sounds)
+		: MixerCase(kMixerTypeRaw, 0, opt), _sounds(sounds) {
+	}
+	virtual void update(int buffer) {
+		const int period = Script::_periodTable[10 + (buffer * 7) % 30];
+		_mix.playSoundRaw(buffer & 3, _sounds[buffer % _sounds.size()], kPaulaFreq / (period * 2), 0x3F);
+	}
+};
+
+static void resetEntries(Resource *res) {
+	for (int i = 0; i < res->_numMemList; ++i) {
+		res->_memList[i].status = Resource::STATUS_NULL;
+	}
+	res->_scriptCurPtr = res->_memPtrStart;
+}
+
+static void runGameData(Resource *res, const Options &opt, const char *resampler) {
+	std::vector<int> modules;
+	for (int i = 0; i < res->_numMemList; ++i) {
+		if (res->_memList[i].type == Resource::RT_SOUND) {
+			res->_memList[i].status = Resource::STATUS_TOLOAD;
+		} else if (res->_memList[i].type == Resource::RT_MUSIC) {
+			modules.push_back(i);
+		}
+	}
+	res->load();
+	std::vector<const uint8_t *> sounds;
+	for (int i = 0; i < res->_numMemList; ++i) {
+		const MemEntry *me = &res->_memList[i];
+		if (me->type == Resource::RT_SOUND && me->status == Resource::STATUS_LOADED && me->unpackedSize > 8) {
+			sounds.push_back(me->bufPtr);
+		}
+	}
+	if (!sounds.empty() && matchCase(opt, "game sounds")) {
+		GameSoundsCase b(opt, sounds);
+		runCase("game sounds", &b, opt, resampler);
+	}
+	for (size_t i = 0; i < modules.size(); ++i) {
+		char name[32];
+		snprintf(name, sizeof(name), "game module 0x%02X", modules[i]);
+		if (!matchCase(opt, name)) {
+			continue;
+		}
+		resetEntries(res);
+		MemEntry *me = &res->_memList[modules[i]];
+		me->status = Resource::STATUS_TOLOAD;
+		res->load();
+		if (me->status != Resource::STATUS_LOADED) {
+			continue;
+		}
+		for (int j = 0; j < 15; ++j) {
+			const int num = READ_BE_UINT16(me->bufPtr + 2 + j * 4);
+			if (num != 0) {
+				res->_memList[num].status = Resource::STATUS_TOLOAD;
+			}
+		}
+		res->load();
+		// played once from the start, the modules ending early are cheaper
+		ModuleCase b(res, modules[i], opt);
+		runCase(name, &b, opt, resampler);
+	}
+	resetEntries(res);
+}
+
+int main(int argc, char *argv[]) {
+	Options opt;
+	opt.dataPath = 0;
+	opt.rate = Mixer::kDefaultRate;
+	opt.bufferSize = Mixer::kDefaultBufferSize;
+	opt.seconds = 10;
+	opt.resampler = -1;
+	opt.filter = 0;
+	while (1) {
+		static struct option options[] = {
+			{ "datapath",  required_argument, 0, 'd' },
+			{ "rate",      required_argument, 0, 'r' },
+			{ "buffer",    required_argument, 0, 'b' },
+			{ "seconds",   required_argument, 0, 's' },
+			{ "resampler", required_argument, 0, 'R' },
+			{ "case",      required_argument, 0, 'c' },
+			{ "help",      no_argument,       0, 'h' },
+			{ 0, 0, 0, 0 }
+		};
+		int index;
+		const int c = getopt_long(argc, argv, "", options, &index);
+		if (c == -1) {
+			break;
+		}
+		switch (c) {
+		case 'd':
+			opt.dataPath = optarg;
+			break;
+		case 'r':
+			opt.rate = atoi(optarg);
+			break;
+		case 'b':
+			opt.bufferSize = atoi(optarg);
+			break;
+		case 's':
+			opt.seconds = atoi(optarg);
+			break;
+		case 'R':
+			for (int i = 0; RESAMPLERS[i].name; ++i) {
+				if (strcmp(optarg, RESAMPLERS[i].name) == 0) {
+					opt.resampler = RESAMPLERS[i].type;
+					break;
+				}
+			}
+			break;
+		case 'c':
+			opt.filter = optarg;
+			break;
+		default:
+			printf(USAGE, argv[0]);
+			return 0;
+		}
+	}
+	if (opt.rate < 8000 || opt.rate > 96000 || opt.bufferSize < 64 || opt.bufferSize > 16384 || opt.seconds <= 0) {
+		printf(USAGE, argv[0]);
+		return 1;
+	}
+	Resource *res = 0;
+	if (opt.dataPath) {
+		res = new Resource(0, opt.dataPath);
+		res->detectVersion();
+		const Resource::DataType dataType = res->getDataType();
+		if (dataType == Resource::DT_DOS || dataType == Resource::DT_AMIGA || dataType == Resource::DT_ATARI) {
+			res->allocMemBlock();
+			res->readEntries();
+		} else {
+			warning("Only the DOS, Amiga and Atari data are supported, using the synthetic cases");
+			delete res;
+			res = 0;
+		}
+	}
+	fprintf(stdout, "%d Hz, %d frames per buffer, %d seconds per case\n", opt.rate, opt.bufferSize, opt.seconds);
+	fprintf(stdout, "%-28s %-8s %10s %10s %8s %10s\n", "case", "resample", "ns/sample", "peak us", "load", "hash");
+	for (int i = 0; RESAMPLERS[i].name; ++i) {
+		if (opt.resampler != -1 && opt.resampler != RESAMPLERS[i].type) {
+			continue;
+		}
+		Resampler::setType(RESAMPLERS[i].type);
+		runSynthetic(opt, RESAMPLERS[i].name);
+		if (res) {
+			runGameData(res, opt, RESAMPLERS[i].name);
+		}
+	}
+	if (res) {
+		res->freeMemBlock();
+		delete res;
+	}
+	return 0;
+}
@@ -7,66 +7,121 @@
 #include "unpack.h"
 #include "util.h"
 
+// The stream is made of 32 bits words read backwards, bits are consumed from
+// the least significant one. Words are bit reversed when loaded in a 64 bits
+// reservoir so that fields can be extracted from its most significant bits.
+
 struct UnpackCtx {
 	int size;
 	uint32_t crc;
-	uint32_t bits;
+	uint64_t bits;      // left aligned
+	int bitsCount;
+	uint32_t lastWord;  // last word loaded, for the crc
 	uint8_t *dst;
 	const uint8_t *src;
+	const uint8_t *srcStart;
 };
 
-static bool nextBit(UnpackCtx *uc) {
-	bool carry = (uc->bits & 1) != 0;
-	uc->bits >>= 1;
-	if (uc->bits == 0) { // getnextlwd
-		uc->bits = READ_BE_UINT32(uc->src); uc->src -= 4;
-		uc->crc ^= uc->bits;
-		carry = (uc->bits & 1) != 0;
-		uc->bits = (1 << 31) | (uc->bits >> 1);
+static uint8_t _reverseBits[256];
+
+static void initReverseBits() {
+	if (_reverseBits[1] == 0) {
+		for (int i = 0; i < 256; ++i) {
+			uint8_t r = 0;
+			for (int b = 0; b < 8; ++b) {
+				if (i & (1 << b)) {
+					r |= 0x80 >> b;
+				}
+			}
+			_reverseBits[i] = r;
+		}
 	}
-	return carry;
 }
 
-static int getBits(UnpackCtx *uc, int count) { // rdd1bits
-	int bits = 0;
-	for (int i = 0; i < count; ++i) {
-		bits <<= 1;
-		if (nextBit(uc)) {
-			bits |= 1;
+static inline uint32_t reverseBits32(uint32_t x) {
+	return (_reverseBits[x & 255] << 24) | (_reverseBits[(x >> 8) & 255] << 16) | (_reverseBits[(x >> 16) & 255] << 8) | _reverseBits[x >> 24];
+}
+
+static inline void refill(UnpackCtx *uc) { // getnextlwd
+	if (uc->bitsCount < 32) {
+		uint32_t word = 0;
+		if (uc->src >= uc->srcStart) {
+			word = READ_BE_UINT32(uc->src); uc->src -= 4;
+			uc->crc ^= word;
 		}
+		uc->lastWord = word;
+		uc->bits |= uint64_t(reverseBits32(word)) << (32 - uc->bitsCount);
+		uc->bitsCount += 32;
 	}
-	return bits;
 }
 
-static void copyLiteral(UnpackCtx *uc, int bitsCount, int len) { // getd3chr
-	int count = getBits(uc, bitsCount) + len + 1;
+static inline uint32_t getBits(UnpackCtx *uc, int count) { // rdd1bits
+	const uint32_t value = uint32_t(uc->bits >> (64 - count));
+	uc->bits <<= count;
+	uc->bitsCount -= count;
+	return value;
+}
+
+static void copyLiteral(UnpackCtx *uc, int count) { // getd3chr
 	uc->size -= count;
 	if (uc->size < 0) {
 		count += uc->size;
 		uc->size = 0;
 	}
-	for (int i = 0; i < count; ++i) {
-		*(uc->dst - i) = (uint8_t)getBits(uc, 8);
+	uint8_t *dst = uc->dst;
+	while (count > 0) {
+		refill(uc);
+		int n = MIN(count, uc->bitsCount >> 3);
+		count -= n;
+		for (; n != 0; --n) {
+			*dst-- = uint8_t(uc->bits >> 56);
+			uc->bits <<= 8;
+			uc->bitsCount -= 8;
+		}
 	}
-	uc->dst -= count;
+	uc->dst = dst;
 }
 
-static void copyReference(UnpackCtx *uc, int bitsCount, int count) { // copyd3bytes
+static void copyReference(UnpackCtx *uc, int offset, int count) { // copyd3bytes
 	uc->size -= count;
 	if (uc->size < 0) {
 		count += uc->size;
 		uc->size = 0;
 	}
-	const int offset = getBits(uc, bitsCount);
-	for (int i = 0; i < count; ++i) {
-		*(uc->dst - i) = *(uc->dst - i + offset);
+	uint8_t *dst = uc->dst;
+	if (offset >= count) {
+		memcpy(dst - count + 1, dst - count + 1 + offset, count);
+	} else {
+		for (int i = 0; i < count; ++i) {
+			*(dst - i) = *(dst - i + offset);
+		}
 	}
 	uc->dst -= count;
 }
 
+// indexed by the next 3 bits of the stream
+static const struct {
+	uint8_t prefixBits;
+	uint8_t literal;
+	uint8_t countBits;
+	uint8_t count;      // added to the count read
+	uint8_t offsetBits; // references
+} _codes[8] = {
+	{ 2, 1, 3, 1, 0 },  // 00  : 1 to 8 literals
+	{ 2, 1, 3, 1, 0 },
+	{ 2, 0, 0, 2, 8 },  // 01  : 2 bytes reference
+	{ 2, 0, 0, 2, 8 },
+	{ 3, 0, 0, 3, 9 },  // 100 : 3 bytes reference
+	{ 3, 0, 0, 4, 10 }, // 101 : 4 bytes reference
+	{ 3, 0, 8, 1, 12 }, // 110 : 1 to 256 bytes reference
+	{ 3, 1, 8, 9, 0 },  // 111 : 9 to 264 literals
+};
+
 bool bytekiller_unpack(uint8_t *dst, int dstSize, const uint8_t *src, int srcSize) {
+	initReverseBits();
 	UnpackCtx uc;
 	uc.src = src + srcSize - 4;
+	uc.srcStart = src;
 	uc.size = READ_BE_UINT32(uc.src); uc.src -= 4;
 	if (uc.size > dstSize) {
 		warning("Unexpected unpack size %d, buffer size %d", uc.size, dstSize);
@@ -74,33 +129,35 @@ bool bytekiller_unpack(uint8_t *dst, int dstSize, const uint8_t *src, int srcSiz
 	}
 	uc.dst = dst + uc.size - 1;
 	uc.crc = READ_BE_UINT32(uc.src); uc.src -= 4;
-	uc.bits = READ_BE_UINT32(uc.src); uc.src -= 4;
-	uc.crc ^= uc.bits;
+	// the most significant bit set in the first word marks the end of the stream bits
+	const uint32_t first = READ_BE_UINT32(uc.src); uc.src -= 4;
+	uc.crc ^= first;
+	int firstCount = 0;
+	while (firstCount < 32 && (first >> firstCount) > 1) {
+		++firstCount;
+	}
+	uc.bits = (firstCount == 0) ? 0 : (uint64_t(reverseBits32(first)) << 32) & ~(~0ULL >> firstCount);
+	uc.bitsCount = firstCount;
+	uc.lastWord = 0;
 	do {
-		if (!nextBit(&uc)) {
-			if (!nextBit(&uc)) {
-				copyLiteral(&uc, 3, 0);
-			} else {
-				copyReference(&uc, 8, 2);
-			}
+		// longest code is 3 + 8 + 12 bits
+		refill(&uc);
+		const int code = int(uc.bits >> 61);
+		getBits(&uc, _codes[code].prefixBits);
+		int count = _codes[code].count;
+		if (_codes[code].countBits != 0) {
+			count += getBits(&uc, _codes[code].countBits);
+		}
+		if (_codes[code].literal) {
+			copyLiteral(&uc, count);
 		} else {
-			const int code = getBits(&uc, 2);
-			switch (code) {
-			case 3:
-				copyLiteral(&uc, 8, 8);
-				break;
-			case 2:
-				copyReference(&uc, 12, getBits(&uc, 8) + 1);
-				break;
-			case 1:
-				copyReference(&uc, 10, 4);
-				break;
-			case 0:
-				copyReference(&uc, 9, 3);
-				break;
-			}
+			copyReference(&uc, getBits(&uc, _codes[code].offsetBits), count);
 		}
 	} while (uc.size > 0);
 	assert(uc.size == 0);
+	if (uc.bitsCount >= 32) {
+		// the last word loaded was not needed
+		uc.crc ^= uc.lastWord;
+	}
 	return uc.crc == 0;
 }
@@ -5,19 +5,201 @@
  */
 
 #include <cstdarg>
+#include <atomic>
+#include <chrono>
+#include <thread>
 #include "util.h"
 
 uint16_t g_debugMask;
+std::atomic<bool> g_debugAsync;
 
-void debug(uint16_t cm, const char *msg, ...) {
+void debug_printf(uint16_t cm, const char *msg, ...) {
 	char buf[1024];
-	if (cm & g_debugMask) {
-		va_list va;
-		va_start(va, msg);
-		vsprintf(buf, msg, va);
-		va_end(va);
-		printf("%s\n", buf);
+	va_list va;
+	va_start(va, msg);
+	vsnprintf(buf, sizeof(buf), msg, va);
+	va_end(va);
+	printf("%s\n", buf);
+	fflush(stdout);
+}
+
+// bounded multiple producers / single consumer queue, each slot holds a sequence number
+struct DebugCell {
+	DebugRecord record;
+	std::atomic<uint32_t> seq;
+};
+
+static const uint32_t kDebugQueueSize = 8192; // power of two
+
+static DebugCell *_debugQueue;
+static std::atomic<uint32_t> _debugEnqueuePos;
+static uint32_t _debugDequeuePos;
+static std::atomic<uint32_t> _debugDropped;
+static std::atomic<bool> _debugThreadRunning;
+static std::thread _debugThread;
+
+DebugRecord *debug_allocRecord() {
+	uint32_t pos = _debugEnqueuePos.load(std::memory_order_relaxed);
+	while (1) {
+		DebugCell *cell = &_debugQueue[pos & (kDebugQueueSize - 1)];
+		const uint32_t seq = cell->seq.load(std::memory_order_acquire);
+		const int32_t diff = (int32_t)(seq - pos);
+		if (diff == 0) {
+			if (_debugEnqueuePos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+				return &cell->record;
+			}
+		} else if (diff < 0) {
+			// full, the logging thread is behind
+			_debugDropped.fetch_add(1, std::memory_order_relaxed);
+			return 0;
+		} else {
+			pos = _debugEnqueuePos.load(std::memory_order_relaxed);
+		}
+	}
+}
+
+void debug_pushRecord(DebugRecord *r) {
+	DebugCell *cell = reinterpret_cast<DebugCell *>(r);
+	const uint32_t pos = cell - _debugQueue;
+	// slots are reused every kDebugQueueSize records, recover the enqueue position from the sequence
+	const uint32_t seq = cell->seq.load(std::memory_order_relaxed);
+	assert((seq & (kDebugQueueSize - 1)) == pos);
+	cell->seq.store(seq + 1, std::memory_order_release);
+}
+
+static int formatDebugArg(char *dst, int size, const char *spec, char conv, const DebugRecord *r, const DebugArg *a) {
+	char fmt[40];
+	switch (conv) {
+	case 'd':
+	case 'i':
+	case 'c':
+		if (a->type == DebugArg::kInt || a->type == DebugArg::kUint) {
+			if (conv == 'c') {
+				snprintf(fmt, sizeof(fmt), "%sc", spec);
+				return snprintf(dst, size, fmt, (int)a->i);
+			}
+			snprintf(fmt, sizeof(fmt), "%slld", spec);
+			return snprintf(dst, size, fmt, (long long)a->i);
+		}
+		break;
+	case 'u':
+	case 'x':
+	case 'X':
+	case 'o':
+		if (a->type == DebugArg::kInt || a->type == DebugArg::kUint) {
+			uint64_t value = a->u;
+			if (a->size < 8) {
+				value &= (1ULL << (a->size * 8)) - 1;
+			}
+			snprintf(fmt, sizeof(fmt), "%sll%c", spec, conv);
+			return snprintf(dst, size, fmt, (unsigned long long)value);
+		}
+		break;
+	case 'f':
+	case 'F':
+	case 'e':
+	case 'E':
+	case 'g':
+	case 'G':
+		if (a->type == DebugArg::kDouble) {
+			snprintf(fmt, sizeof(fmt), "%s%c", spec, conv);
+			return snprintf(dst, size, fmt, a->d);
+		}
+		break;
+	case 's':
+		if (a->type == DebugArg::kStr) {
+			snprintf(fmt, sizeof(fmt), "%ss", spec);
+			return snprintf(dst, size, fmt, r->strings + a->offset);
+		}
+		break;
+	case 'p':
+		if (a->type == DebugArg::kPtr) {
+			return snprintf(dst, size, "%p", a->p);
+		}
+		break;
+	}
+	return snprintf(dst, size, "<?>");
+}
+
+static void formatDebugRecord(const DebugRecord *r, char *buf, int bufSize) {
+	const char *p = r->msg;
+	int len = 0;
+	int arg = 0;
+	while (*p && len < bufSize - 1) {
+		if (*p != '%' || p[1] == '%' || arg >= r->argsCount) {
+			if (*p == '%' && p[1] == '%') {
+				++p;
+			}
+			buf[len++] = *p++;
+			continue;
+		}
+		char spec[32];
+		int specLen = 0;
+		spec[specLen++] = *p++;
+		while (*p && strchr("-+ #0123456789.", *p) && specLen < (int)sizeof(spec) - 1) {
+			spec[specLen++] = *p++;
+		}
+		spec[specLen] = 0;
+		while (*p && strchr("hlLqjzt", *p)) {
+			++p;
+		}
+		if (!*p) {
+			break;
+		}
+		const char conv = *p++;
+		const int count = formatDebugArg(buf + len, bufSize - len, spec, conv, r, &r->args[arg++]);
+		if (count > 0) {
+			len = MIN(len + count, bufSize - 1);
+		}
+	}
+	buf[len] = 0;
+}
+
+static void debugThread() {
+	while (1) {
+		DebugCell *cell = &_debugQueue[_debugDequeuePos & (kDebugQueueSize - 1)];
+		const uint32_t seq = cell->seq.load(std::memory_order_acquire);
+		if (seq == _debugDequeuePos + 1) {
+			char buf[1024];
+			formatDebugRecord(&cell->record, buf, sizeof(buf));
+			printf("%s\n", buf);
+			cell->seq.store(_debugDequeuePos + kDebugQueueSize, std::memory_order_release);
+			++_debugDequeuePos;
+			continue;
+		}
+		if (!_debugThreadRunning.load(std::memory_order_acquire)) {
+			break;
+		}
 		fflush(stdout);
+		std::this_thread::sleep_for(std::chrono::milliseconds(1));
+	}
+	fflush(stdout);
+}
+
+void debug_startAsync() {
+	if (!_debugQueue) {
+		_debugQueue = new DebugCell[kDebugQueueSize];
+		for (uint32_t i = 0; i < kDebugQueueSize; ++i) {
+			_debugQueue[i].seq.store(i, std::memory_order_relaxed);
+		}
+		_debugEnqueuePos = 0;
+		_debugDequeuePos = 0;
+		_debugDropped = 0;
+		_debugThreadRunning = true;
+		_debugThread = std::thread(debugThread);
+		g_debugAsync = true;
+	}
+}
+
+// can be called from any thread. The queue is never freed : the other threads may still be
+// logging, their records are not printed once the logging thread has exited.
+void debug_stopAsync() {
+	if (g_debugAsync.exchange(false)) {
+		_debugThreadRunning = false;
+		_debugThread.join();
+		if (_debugDropped != 0) {
+			fprintf(stderr, "WARNING: %d debug messages dropped!\n", (int)_debugDropped);
+		}
 	}
 }
 
@@ -27,6 +209,7 @@ void error(const char *msg, ...) {
 	va_start(va, msg);
 	vsprintf(buf, msg, va);
 	va_end(va);
+	debug_stopAsync();
 	fprintf(stderr, "ERROR: %s!\n", buf);
 	exit(-1);
 }
@@ -7,6 +7,7 @@
 #ifndef UTIL_H__
 #define UTIL_H__
 
+#include <atomic>
 #include "intern.h"
 
 enum {
@@ -20,9 +21,115 @@ enum {
 	DBG_RESOURCE = 1 << 7,
 };
 
+// categories compiled in, the per opcode, per shape and per tick traces are only kept in trace builds
+#ifndef DEBUG_COMPILE_MASK
+#define DEBUG_COMPILE_MASK (DBG_BANK | DBG_SER | DBG_INFO | DBG_PAK | DBG_RESOURCE)
+#endif
+
 extern uint16_t g_debugMask;
+extern std::atomic<bool> g_debugAsync;
+
+// the arguments are not evaluated when the category is disabled
+#define debug(cm, ...) \
+	do { \
+		if (((cm) & DEBUG_COMPILE_MASK) != 0 && ((cm) & g_debugMask) != 0) { \
+			debug_log((cm), __VA_ARGS__); \
+		} \
+	} while (0)
+
+struct DebugArg {
+	enum {
+		kInt,
+		kUint,
+		kDouble,
+		kPtr,
+		kStr
+	};
+	uint8_t type;
+	uint8_t size;
+	union {
+		int64_t i;
+		uint64_t u;
+		double d;
+		const void *p;
+		uint32_t offset; // kStr, in DebugRecord::strings
+	};
+};
+
+struct DebugRecord {
+	enum {
+		kMaxArgs = 10,
+		kStringsSize = 128
+	};
+	uint16_t cm;
+	const char *msg;
+	int argsCount;
+	DebugArg args[kMaxArgs];
+	uint32_t stringsSize;
+	char strings[kStringsSize];
+};
+
+inline void setDebugArg(DebugRecord *r, DebugArg *a, int v)           { a->type = DebugArg::kInt; a->size = sizeof(v); a->i = v; }
+inline void setDebugArg(DebugRecord *r, DebugArg *a, long v)          { a->type = DebugArg::kInt; a->size = sizeof(v); a->i = v; }
+inline void setDebugArg(DebugRecord *r, DebugArg *a, long long v)     { a->type = DebugArg::kInt; a->size = sizeof(v); a->i = v; }
+inline void setDebugArg(DebugRecord *r, DebugArg *a, unsigned int v)  { a->type = DebugArg::kUint; a->size = sizeof(v); a->u = v; }
+inline void setDebugArg(DebugRecord *r, DebugArg *a, unsigned long v) { a->type = DebugArg::kUint; a->size = sizeof(v); a->u = v; }
+inline void setDebugArg(DebugRecord *r, DebugArg *a, unsigned long long v) { a->type = DebugArg::kUint; a->size = sizeof(v); a->u = v; }
+inline void setDebugArg(DebugRecord *r, DebugArg *a, double v)        { a->type = DebugArg::kDouble; a->size = sizeof(v); a->d = v; }
+inline void setDebugArg(DebugRecord *r, DebugArg *a, const void *v)   { a->type = DebugArg::kPtr; a->size = sizeof(v); a->p = v; }
+inline void setDebugArg(DebugRecord *r, DebugArg *a, const char *v) {
+	// strings may not outlive the call, copy them
+	a->type = DebugArg::kStr;
+	a->size = sizeof(v);
+	if (r->stringsSize >= DebugRecord::kStringsSize) {
+		// buffer full, point to the terminator of the previous string
+		a->offset = DebugRecord::kStringsSize - 1;
+		return;
+	}
+	a->offset = r->stringsSize;
+	const char *s = v ? v : "(null)";
+	while (*s && r->stringsSize < DebugRecord::kStringsSize - 1) {
+		r->strings[r->stringsSize++] = *s++;
+	}
+	r->strings[r->stringsSize++] = 0;
+}
+
+inline void setDebugArgs(DebugRecord *r) {
+}
+
+template <typename T, typename... Args>
+inline void setDebugArgs(DebugRecord *r, T value, Args... args) {
+	if (r->argsCount < DebugRecord::kMaxArgs) {
+		setDebugArg(r, &r->args[r->argsCount++], value);
+		setDebugArgs(r, args...);
+	}
+}
+
+extern DebugRecord *debug_allocRecord();
+extern void debug_pushRecord(DebugRecord *r);
+extern void debug_printf(uint16_t cm, const char *msg, ...);
+
+template <typename... Args>
+inline void debug_log(uint16_t cm, const char *msg, Args... args) {
+	if (g_debugAsync) {
+		// formatted later by the logging thread
+		DebugRecord *r = debug_allocRecord();
+		if (r) {
+			r->cm = cm;
+			r->msg = msg;
+			r->argsCount = 0;
+			r->stringsSize = 0;
+			setDebugArgs(r, args...);
+			debug_pushRecord(r);
+		}
+	} else {
+		debug_printf(cm, msg, args...);
+	}
+}
+
+extern void debug_startAsync();
+extern void debug_stopAsync();
 
-extern void debug(uint16_t cm, const char *msg, ...);
 extern void error(const char *msg, ...);
 extern void warning(const char *msg, ...);
 
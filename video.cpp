@@ -9,6 +9,7 @@
 #include "resource.h"
 #include "resource_3do.h"
 #include "scaler.h"
+#include "serializer.h"
 #include "systemstub.h"
 #include "util.h"
 
@@ -787,6 +788,10 @@ void Video::copyBitmapPtr(const uint8_t *src, uint32_t size, uint8_t palNum) {
 	}
 }
 
+void Video::copyBitmapRGB(const uint8_t *rgb, int w, int h) {
+	_graphics->drawBitmap(_buffers[0], rgb, w, h, FMT_RGB, 0);
+}
+
 static void readPaletteWin31(const uint8_t *buf, int num, Color pal[16]) {
 	const uint8_t *p = buf + num * 16 * sizeof(uint16_t);
 	for (int i = 0; i < 16; ++i) {
@@ -946,3 +951,16 @@ void Video::drawBitmapDIB(const uint8_t *data, SystemStub *stub) {
 		free(rgb);
 	}
 }
+
+void Video::saveOrLoad(Serializer &ser) {
+	ser.saveOrLoad(_buffers);
+	ser.saveOrLoad(_displayHead);
+	ser.saveOrLoad(_nextPal);
+	uint8_t currentPal = _currentPal;
+	ser.saveOrLoad(currentPal);
+	if (ser.isLoading()) {
+		_currentPal = 0xFF;
+		changePal(currentPal);
+	}
+	_graphics->saveOrLoad(ser);
+}
@@ -17,6 +17,7 @@ struct StrEntry {
 struct Graphics;
 struct Resource;
 struct Scaler;
+struct Serializer;
 struct SystemStub;
 
 struct Video {
@@ -78,6 +79,7 @@ struct Video {
 	void copyPage(uint8_t src, uint8_t dst, int16_t vscroll);
 	void scaleBitmap(const uint8_t *src, int fmt, Color pal[16]);
 	void copyBitmapPtr(const uint8_t *src, uint32_t size = 0, uint8_t palNum = 0);
+	void copyBitmapRGB(const uint8_t *rgb, int w, int h);
 	void readPal(uint8_t palNum, Color pal[16]);
 	void changePal(uint8_t palNum);
 	void updateDisplay(uint8_t page, SystemStub *stub);
@@ -86,6 +88,7 @@ struct Video {
 	void drawRect(uint8_t page, uint8_t color, int x1, int y1, int x2, int y2);
 	void drawBitmap3DO(const char *name, SystemStub *stub);
 	void drawBitmapDIB(const uint8_t *data, SystemStub *stub);
+	void saveOrLoad(Serializer &ser);
 };
 
 #endif